@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "balloc.h"
+
+// Microbenchmark for the bitmap allocator: fills a bitmap to a given
+// occupancy, then times alloc/free cycles with the old bit-at-a-time
+// first-fit scan and with balloc.
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// The scan the server used before balloc: test each bit from the start
+static int scan_alloc(unsigned int *bitmap, int length) {
+    for (int i = 0; i < length; i++) {
+        if (bit_fetch(bitmap, i) == 0) {
+            bit_set(bitmap, i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Fills bitmap with bits set at the requested percentage
+static void fill(unsigned int *bitmap, int length, int percent) {
+    memset(bitmap, 0, (length + 31) / 32 * sizeof(unsigned int));
+    srand(1);
+    for (int i = 0; i < length; i++)
+        if (rand() % 100 < percent) bit_set(bitmap, i);
+}
+
+// Picks a random set bit to release
+static int pick_used(unsigned int *bitmap, int length) {
+    for (;;) {
+        int i = rand() % length;
+        if (bit_fetch(bitmap, i)) return i;
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: allocbench [-n <bits>] [-p <percent_used>] [-i <iterations>]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int length = 1 << 20, percent = 99, iterations = 100000;
+    int c;
+    while ((c = getopt(argc, argv, "n:p:i:")) != -1) {
+        switch (c) {
+            case 'n': length = atoi(optarg); break;
+            case 'p': percent = atoi(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (length <= 0 || percent < 0 || percent >= 100 || iterations <= 0)
+        usage();
+
+    // Round up to a whole number of 64-bit words, as image blocks are
+    unsigned int *bitmap = malloc((length + 63) / 64 * 8);
+
+    // Each cycle frees a random used bit and allocates one, so occupancy
+    // stays put and the free bits stay scattered
+    fill(bitmap, length, percent);
+    double t0 = now();
+    for (int i = 0; i < iterations; i++) {
+        bit_clear(bitmap, pick_used(bitmap, length));
+        scan_alloc(bitmap, length);
+    }
+    double scan = now() - t0;
+
+    fill(bitmap, length, percent);
+    balloc_t b;
+    balloc_init(&b, bitmap, length);
+    t0 = now();
+    for (int i = 0; i < iterations; i++) {
+        balloc_free(&b, pick_used(bitmap, length));
+        balloc_alloc(&b);
+    }
+    double word = now() - t0;
+
+    printf("%d bits, %d%% used, %d cycles\n", length, percent, iterations);
+    printf("bit scan: %8.3f us/op\n", scan / iterations * 1e6);
+    printf("balloc:   %8.3f us/op (%d free)\n", word / iterations * 1e6, balloc_nfree(&b));
+    free(bitmap);
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <stdint.h>
+
+#include "balloc.h"
+
+// Sets the value of the bit at the specified position in the bitmap to 1
+void bit_set(unsigned int *bitmap, int position) {
+    __atomic_fetch_or(&bitmap[position / 32], 0x1 << (31 - (position % 32)), __ATOMIC_RELAXED);
+}
+
+// Returns the value of the bit at the specified position in the bitmap
+unsigned int bit_fetch(unsigned int *bitmap, int position) {
+    return (__atomic_load_n(&bitmap[position / 32], __ATOMIC_RELAXED) >> (31 - (position % 32))) & 0x1;
+}
+
+// Sets the value of the bit at the specified position in the bitmap to 0
+void bit_clear(unsigned int *bitmap, int position) {
+    __atomic_fetch_and(&bitmap[position / 32], ~(0x1 << (31 - (position % 32))), __ATOMIC_RELAXED);
+}
+
+// Returns positions 64 * w .. 64 * w + 63 as one word, first position in the
+// most significant bit. Positions past the end of the bitmap read as used.
+static uint64_t balloc_word(balloc_t *b, int w) {
+    int first = 64 * w;
+    uint64_t hi = __atomic_load_n(&b->bits[2 * w], __ATOMIC_RELAXED);
+    uint64_t lo = first + 32 < b->length ? __atomic_load_n(&b->bits[2 * w + 1], __ATOMIC_RELAXED) : 0;
+    uint64_t word = hi << 32 | lo;
+    if (b->length - first < 64)
+	word |= ~0ULL >> (b->length - first);
+    return word;
+}
+
+void balloc_init(balloc_t *b, void *bits, int length) {
+    b->bits = bits;
+    b->length = length;
+    b->cursor = 0;
+    b->nfree = 0;
+    pthread_mutex_init(&b->lock, NULL);
+    int nwords = (length + 63) / 64;
+    for (int w = 0; w < nwords; w++)
+	b->nfree += 64 - __builtin_popcountll(balloc_word(b, w));
+}
+
+// Takes the first free bit at or after position start, wrapping around, and
+// leaves the cursor at its word. The caller holds the lock and has checked
+// that a bit is free.
+static int balloc_take(balloc_t *b, int start) {
+    int nwords = (b->length + 63) / 64;
+    int position = -1;
+    for (int i = 0; i <= nwords; i++) {
+	int w = (start / 64 + i) % nwords;
+	uint64_t word = balloc_word(b, w);
+	// On the first word, positions before start read as used
+	if (i == 0 && start % 64)
+	    word |= ~(~0ULL >> (start % 64));
+	if (word != ~0ULL) {
+	    position = 64 * w + __builtin_clzll(~word);
+	    b->cursor = w;
+	    break;
+	}
+    }
+    if (position >= 0) {
+	bit_set(b->bits, position);
+	__atomic_fetch_sub(&b->nfree, 1, __ATOMIC_RELAXED);
+    }
+    return position;
+}
+
+// Allocates the first free bit at or after the cursor, wrapping around, and
+// leaves the cursor there. Returns its position, or -1 if the bitmap is full.
+int balloc_alloc(balloc_t *b) {
+    pthread_mutex_lock(&b->lock);
+    int position = b->nfree == 0 ? -1 : balloc_take(b, 64 * b->cursor);
+    pthread_mutex_unlock(&b->lock);
+    return position;
+}
+
+// Words looked at for a fresh run before settling for any free bit
+#define BALLOC_RUN_SEARCH (256)
+
+// Allocates the bit at goal, so consecutive allocations for one file land
+// next to each other. If another file already took it, the allocation
+// moves on to the next wholly free word nearby, so the file starts a fresh run
+// instead of interleaving with the other one; failing that, it takes the
+// first free bit after goal. Without a usable goal this is balloc_alloc.
+int balloc_alloc_near(balloc_t *b, int goal) {
+    if (goal < 0 || goal >= b->length)
+	return balloc_alloc(b);
+    pthread_mutex_lock(&b->lock);
+    int position = -1;
+    if (b->nfree > 0 && bit_fetch(b->bits, goal) == 0) {
+	bit_set(b->bits, goal);
+	__atomic_fetch_sub(&b->nfree, 1, __ATOMIC_RELAXED);
+	position = goal;
+    } else if (b->nfree > 0) {
+	int nwords = (b->length + 63) / 64;
+	for (int i = 1; i < nwords && i <= BALLOC_RUN_SEARCH && position < 0; i++) {
+	    int w = (goal / 64 + i) % nwords;
+	    if (balloc_word(b, w) == 0)
+		position = balloc_take(b, 64 * w);
+	}
+	if (position < 0)
+	    position = balloc_take(b, goal);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return position;
+}
+
+// Allocates the bit at position and no other, as a backup does to follow
+// its primary's choice. Returns position, or -1 if it is out of range or
+// already allocated.
+int balloc_alloc_at(balloc_t *b, int position) {
+    if (position < 0 || position >= b->length)
+	return -1;
+    pthread_mutex_lock(&b->lock);
+    int rc = -1;
+    if (bit_fetch(b->bits, position) == 0) {
+	bit_set(b->bits, position);
+	__atomic_fetch_sub(&b->nfree, 1, __ATOMIC_RELAXED);
+	rc = position;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return rc;
+}
+
+// Releases a bit. Returns -1 (and changes nothing) if the position is out of
+// range or was not allocated.
+int balloc_free(balloc_t *b, int position) {
+    if (position < 0 || position >= b->length)
+	return -1;
+    pthread_mutex_lock(&b->lock);
+    int rc = -1;
+    if (bit_fetch(b->bits, position)) {
+	bit_clear(b->bits, position);
+	__atomic_fetch_add(&b->nfree, 1, __ATOMIC_RELAXED);
+	rc = 0;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return rc;
+}
+
+// Returns the number of free bits
+int balloc_nfree(balloc_t *b) {
+    return __atomic_load_n(&b->nfree, __ATOMIC_RELAXED);
+}
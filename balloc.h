@@ -0,0 +1,32 @@
+#ifndef __balloc_h__
+#define __balloc_h__
+
+#include <pthread.h>
+
+// Bit operations on an on-disk bitmap: position p is bit (31 - p % 32) of
+// 32-bit word p / 32, so the first position is the most significant bit.
+// Words are accessed atomically, since readers test bits while allocations
+// change neighbouring ones.
+void bit_set(unsigned int *bitmap, int position);
+unsigned int bit_fetch(unsigned int *bitmap, int position);
+void bit_clear(unsigned int *bitmap, int position);
+
+// Allocator over one bitmap (inodes or data blocks). It scans 64 bits at a
+// time from a rotating next-fit cursor and keeps a count of free bits, so a
+// full bitmap is detected without scanning.
+typedef struct {
+    unsigned int *bits;    // the bitmap, in the mapped image
+    int length;            // number of bits in use
+    int nfree;             // bits that are clear
+    int cursor;            // 64-bit word where the next scan starts
+    pthread_mutex_t lock;
+} balloc_t;
+
+void balloc_init(balloc_t *b, void *bits, int length);
+int balloc_alloc(balloc_t *b);
+int balloc_alloc_near(balloc_t *b, int goal);
+int balloc_alloc_at(balloc_t *b, int position);
+int balloc_free(balloc_t *b, int position);
+int balloc_nfree(balloc_t *b);
+
+#endif // __balloc_h__
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bcache.h"
+
+bcache_block_t *bcache_blocks = NULL;
+bcache_block_t **bcache_buckets = NULL;
+int bcache_nblocks = 0;
+int bcache_nbuckets = 0;
+
+// Least recently used list: head is the most recent, free blocks sit at
+// the tail so they are reused first
+bcache_block_t *bcache_head = NULL;
+bcache_block_t *bcache_tail = NULL;
+
+static bcache_block_t **bcache_bucket(int inum, int block) {
+    uint32_t h = (uint32_t)inum * 2654435761u ^ (uint32_t)block * 2246822519u;
+    return &bcache_buckets[(h ^ (h >> 16)) % bcache_nbuckets];
+}
+
+static void lru_unlink(bcache_block_t *b) {
+    if (b->prev) b->prev->next = b->next;
+    else bcache_head = b->next;
+    if (b->next) b->next->prev = b->prev;
+    else bcache_tail = b->prev;
+}
+
+static void lru_push_head(bcache_block_t *b) {
+    b->prev = NULL;
+    b->next = bcache_head;
+    if (bcache_head) bcache_head->prev = b;
+    bcache_head = b;
+    if (!bcache_tail) bcache_tail = b;
+}
+
+static void lru_push_tail(bcache_block_t *b) {
+    b->next = NULL;
+    b->prev = bcache_tail;
+    if (bcache_tail) bcache_tail->next = b;
+    bcache_tail = b;
+    if (!bcache_head) bcache_head = b;
+}
+
+static void hash_remove(bcache_block_t *b) {
+    bcache_block_t **link = bcache_bucket(b->inum, b->block);
+    while (*link != b)
+	link = &(*link)->hnext;
+    *link = b->hnext;
+}
+
+// Replaces the cache with an empty one of nblocks blocks (none if 0). The
+// caller has sent every dirty block. Returns -1 if memory runs out.
+int bcache_resize(int nblocks) {
+    free(bcache_blocks);
+    free(bcache_buckets);
+    bcache_blocks = NULL;
+    bcache_buckets = NULL;
+    bcache_head = bcache_tail = NULL;
+    bcache_nblocks = 0;
+    if (nblocks <= 0)
+	return 0;
+
+    bcache_blocks = calloc(nblocks, sizeof(bcache_block_t));
+    bcache_buckets = calloc(2 * nblocks, sizeof(bcache_block_t *));
+    if (bcache_blocks == NULL || bcache_buckets == NULL) {
+	free(bcache_blocks);
+	free(bcache_buckets);
+	bcache_blocks = NULL;
+	bcache_buckets = NULL;
+	return -1;
+    }
+    bcache_nblocks = nblocks;
+    bcache_nbuckets = 2 * nblocks;
+    for (int i = 0; i < nblocks; i++) {
+	bcache_blocks[i].inum = -1;
+	bcache_blocks[i].pending = -1;
+	lru_push_tail(&bcache_blocks[i]);
+    }
+    return 0;
+}
+
+int bcache_capacity() {
+    return bcache_nblocks;
+}
+
+// Returns the cached block, marked most recently used, or null
+bcache_block_t *bcache_find(int inum, int block) {
+    if (bcache_nblocks == 0)
+	return NULL;
+    bcache_block_t *b = *bcache_bucket(inum, block);
+    while (b && (b->inum != inum || b->block != block))
+	b = b->hnext;
+    if (b) {
+	lru_unlink(b);
+	lru_push_head(b);
+    }
+    return b;
+}
+
+// Returns the least recently used block that no read-ahead is filling, or
+// null. It may still hold dirty bytes, which the caller sends before
+// reassigning it.
+bcache_block_t *bcache_victim() {
+    bcache_block_t *b = bcache_tail;
+    while (b && b->pending >= 0)
+	b = b->prev;
+    return b;
+}
+
+// Gives a block a new identity, empty and most recently used
+void bcache_assign(bcache_block_t *b, int inum, int block) {
+    if (b->inum >= 0)
+	hash_remove(b);
+    b->inum = inum;
+    b->block = block;
+    b->len = 0;
+    b->expires = 0;
+    b->lo = b->hi = 0;
+    b->pending = -1;
+    bcache_block_t **bucket = bcache_bucket(inum, block);
+    b->hnext = *bucket;
+    *bucket = b;
+    lru_unlink(b);
+    lru_push_head(b);
+}
+
+// Frees a block, dirty bytes and all
+void bcache_drop(bcache_block_t *b) {
+    if (b->inum >= 0)
+	hash_remove(b);
+    b->inum = -1;
+    b->lo = b->hi = 0;
+    b->pending = -1;
+    lru_unlink(b);
+    lru_push_tail(b);
+}
+
+// Returns block i of the cache, for scans over all of them
+bcache_block_t *bcache_block(int i) {
+    return &bcache_blocks[i];
+}
@@ -0,0 +1,32 @@
+#ifndef __bcache_h__
+#define __bcache_h__
+
+#include "mfs.h"
+
+// Client-side block cache: 4 KB blocks of file data keyed by (inum, block),
+// found through a hash table and replaced in least recently used order.
+// The library decides what goes in and when dirty bytes are sent; this
+// only keeps the blocks.
+
+typedef struct bcache_block {
+    int inum;                  // -1 for a free block
+    int block;
+    int len;                   // bytes from the server, from the block start
+    long expires;              // lease on those bytes
+    int lo, hi;                // bytes written and not yet sent (none if equal)
+    long dirtied;              // when lo..hi became dirty
+    int pending;               // handle of a read-ahead filling data, or -1
+    struct bcache_block *hnext;
+    struct bcache_block *prev, *next;
+    char data[MFS_BLOCK_SIZE];
+} bcache_block_t;
+
+int bcache_resize(int nblocks);
+int bcache_capacity();
+bcache_block_t *bcache_find(int inum, int block);
+bcache_block_t *bcache_victim();
+void bcache_assign(bcache_block_t *b, int inum, int block);
+void bcache_drop(bcache_block_t *b);
+bcache_block_t *bcache_block(int i);
+
+#endif // __bcache_h__
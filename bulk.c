@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "bulk.h"
+
+// A transfer being reassembled. With every slot busy, a new transfer takes
+// over the one that has gone longest without a fragment; that client finds
+// its fragments missing and sends them again.
+typedef struct {
+    int used;
+    uint32_t ip;
+    uint16_t port;
+    uint32_t reqid;
+    int nbytes;
+    int nfrags;
+    int received;
+    uint8_t have[MFS_MAX_FRAGS / 8];
+    char *data;
+    long touched;         // bulk_clock when a fragment last arrived
+} bulk_slot_t;
+
+bulk_slot_t bulk_slots[BULK_SLOTS];
+long bulk_clock = 0;
+pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the slot for the key, taking over a free or the stalest one if
+// there is none; the caller holds bulk_lock
+static bulk_slot_t *bulk_slot(uint32_t ip, uint16_t port, uint32_t reqid, int *fresh) {
+    bulk_slot_t *victim = &bulk_slots[0];
+    for (int i = 0; i < BULK_SLOTS; i++) {
+	bulk_slot_t *b = &bulk_slots[i];
+	if (b->used && b->ip == ip && b->port == port && b->reqid == reqid) {
+	    *fresh = 0;
+	    return b;
+	}
+	if (!b->used || (victim->used && b->touched < victim->touched))
+	    victim = b;
+    }
+    *fresh = 1;
+    return victim;
+}
+
+// Adds one fragment of a bulk write to its transfer
+int bulk_add(struct sockaddr_in *addr, mfs_hdr_t *req, mfs_frag_t *frag, char *data, int len,
+	     uint8_t *have, char **whole) {
+    int nbytes = req->nbytes;
+    if (nbytes <= 0 || nbytes > MFS_MAX_FRAGS * MFS_FRAG_SIZE)
+	return BULK_INVALID;
+    int nfrags = (nbytes - 1) / MFS_FRAG_SIZE + 1;
+    if (frag->index >= nfrags || len != MIN(MFS_FRAG_SIZE, nbytes - frag->index * MFS_FRAG_SIZE))
+	return BULK_INVALID;
+
+    pthread_mutex_lock(&bulk_lock);
+    int fresh;
+    bulk_slot_t *b = bulk_slot(addr->sin_addr.s_addr, addr->sin_port, req->reqid, &fresh);
+    if (fresh) {
+	free(b->data);
+	bzero(b, sizeof(bulk_slot_t));
+	b->data = malloc(nbytes);
+	if (b->data == NULL) {
+	    pthread_mutex_unlock(&bulk_lock);
+	    return BULK_INVALID;
+	}
+	b->used = 1;
+	b->ip = addr->sin_addr.s_addr;
+	b->port = addr->sin_port;
+	b->reqid = req->reqid;
+	b->nbytes = nbytes;
+	b->nfrags = nfrags;
+    } else if (b->nbytes != nbytes) {
+	pthread_mutex_unlock(&bulk_lock);
+	return BULK_INVALID;
+    }
+
+    if (!MFS_FRAG_HAS(b->have, frag->index)) {
+	memcpy(b->data + frag->index * MFS_FRAG_SIZE, data, len);
+	MFS_FRAG_SET(b->have, frag->index);
+	b->received++;
+    }
+    b->touched = ++bulk_clock;
+
+    if (b->received == b->nfrags) {
+	*whole = b->data;
+	b->data = NULL;
+	b->used = 0;
+	pthread_mutex_unlock(&bulk_lock);
+	return BULK_COMPLETE;
+    }
+    memcpy(have, b->have, sizeof(b->have));
+    pthread_mutex_unlock(&bulk_lock);
+    return BULK_PARTIAL;
+}
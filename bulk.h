@@ -0,0 +1,21 @@
+#ifndef __bulk_h__
+#define __bulk_h__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "message.h"
+
+// Reassembly of bulk writes: fragments are collected per transfer, keyed by
+// client address and request id, until the whole write has arrived
+
+#define BULK_SLOTS (16)
+
+#define BULK_INVALID  (-1) // fragment does not fit its transfer
+#define BULK_PARTIAL  (0)  // fragments are missing: have holds those received
+#define BULK_COMPLETE (1)  // *whole holds the data, which the caller frees
+
+int bulk_add(struct sockaddr_in *addr, mfs_hdr_t *req, mfs_frag_t *frag, char *data, int len,
+	     uint8_t *have, char **whole);
+
+#endif // __bulk_h__
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirindex.h"
+
+#define INITIAL_BUCKETS (16)
+
+// FNV-1a
+static unsigned int dirindex_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+	h ^= (unsigned char) *name++;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+dirindex_t *dirindex_new() {
+    dirindex_t *idx = calloc(1, sizeof(dirindex_t));
+    idx->nbuckets = INITIAL_BUCKETS;
+    idx->buckets = malloc(idx->nbuckets * sizeof(int));
+    for (int i = 0; i < idx->nbuckets; i++)
+	idx->buckets[i] = -1;
+    idx->free_ent = -1;
+    return idx;
+}
+
+void dirindex_free(dirindex_t *idx) {
+    if (idx == NULL)
+	return;
+    free(idx->buckets);
+    free(idx->ents);
+    free(idx->free_slots);
+    free(idx);
+}
+
+// Doubles the number of buckets and rehashes every entry
+static void dirindex_grow(dirindex_t *idx) {
+    int nbuckets = idx->nbuckets * 2;
+    int *buckets = malloc(nbuckets * sizeof(int));
+    for (int i = 0; i < nbuckets; i++)
+	buckets[i] = -1;
+    for (int b = 0; b < idx->nbuckets; b++) {
+	int i = idx->buckets[b];
+	while (i >= 0) {
+	    int next = idx->ents[i].next;
+	    int nb = dirindex_hash(idx->ents[i].name) & (nbuckets - 1);
+	    idx->ents[i].next = buckets[nb];
+	    buckets[nb] = i;
+	    i = next;
+	}
+    }
+    free(idx->buckets);
+    idx->buckets = buckets;
+    idx->nbuckets = nbuckets;
+}
+
+// Returns the slot holding name, or -1 if it is not in the directory
+int dirindex_lookup(dirindex_t *idx, const char *name) {
+    int i = idx->buckets[dirindex_hash(name) & (idx->nbuckets - 1)];
+    while (i >= 0) {
+	if (strcmp(idx->ents[i].name, name) == 0)
+	    return idx->ents[i].slot;
+	i = idx->ents[i].next;
+    }
+    return -1;
+}
+
+// Adds name at slot; returns -1 if the name is already present
+int dirindex_insert(dirindex_t *idx, const char *name, int slot) {
+    if (dirindex_lookup(idx, name) >= 0)
+	return -1;
+    if (idx->count >= idx->nbuckets)
+	dirindex_grow(idx);
+
+    int i = idx->free_ent;
+    if (i >= 0) {
+	idx->free_ent = idx->ents[i].next;
+    } else {
+	if (idx->nents == idx->cap) {
+	    idx->cap = idx->cap ? 2 * idx->cap : INITIAL_BUCKETS;
+	    idx->ents = realloc(idx->ents, idx->cap * sizeof(dirindex_ent_t));
+	}
+	i = idx->nents++;
+    }
+    dirindex_ent_t *e = &idx->ents[i];
+    strncpy(e->name, name, sizeof(e->name) - 1);
+    e->name[sizeof(e->name) - 1] = '\0';
+    e->slot = slot;
+    int b = dirindex_hash(e->name) & (idx->nbuckets - 1);
+    e->next = idx->buckets[b];
+    idx->buckets[b] = i;
+    idx->count++;
+    return 0;
+}
+
+// Removes name; returns the slot it held, or -1 if it was not present
+int dirindex_remove(dirindex_t *idx, const char *name) {
+    int *link = &idx->buckets[dirindex_hash(name) & (idx->nbuckets - 1)];
+    while (*link >= 0) {
+	int i = *link;
+	dirindex_ent_t *e = &idx->ents[i];
+	if (strcmp(e->name, name) == 0) {
+	    *link = e->next;
+	    e->next = idx->free_ent;
+	    idx->free_ent = i;
+	    idx->count--;
+	    return e->slot;
+	}
+	link = &e->next;
+    }
+    return -1;
+}
+
+// Records that a slot of the directory is empty
+void dirindex_put_slot(dirindex_t *idx, int slot) {
+    if (idx->nfree == idx->free_cap) {
+	idx->free_cap = idx->free_cap ? 2 * idx->free_cap : INITIAL_BUCKETS;
+	idx->free_slots = realloc(idx->free_slots, idx->free_cap * sizeof(int));
+    }
+    idx->free_slots[idx->nfree++] = slot;
+}
+
+// Returns an empty slot and removes it from the free set, or -1 if none
+int dirindex_take_slot(dirindex_t *idx) {
+    if (idx->nfree == 0)
+	return -1;
+    return idx->free_slots[--idx->nfree];
+}
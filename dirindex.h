@@ -0,0 +1,37 @@
+#ifndef __dirindex_h__
+#define __dirindex_h__
+
+// In-memory index of one directory: maps each name to the slot (position of
+// its dir_ent_t) holding it, and keeps a stack of the empty slots, so that
+// lookup, create and unlink do not have to scan the directory
+
+typedef struct {
+    char name[28];
+    int  slot;  // index of the dir_ent_t in the directory
+    int  next;  // next entry in the same bucket, or in the free list
+} dirindex_ent_t;
+
+typedef struct {
+    int *buckets;          // heads of the bucket chains, -1 if empty
+    int nbuckets;          // always a power of two
+    dirindex_ent_t *ents;
+    int nents;             // entries ever used
+    int cap;               // entries allocated
+    int free_ent;          // head of the list of released entries, or -1
+    int count;             // names in the index
+    int *free_slots;       // empty slots in the directory
+    int nfree;
+    int free_cap;
+} dirindex_t;
+
+dirindex_t *dirindex_new();
+void dirindex_free(dirindex_t *idx);
+
+int dirindex_lookup(dirindex_t *idx, const char *name);
+int dirindex_insert(dirindex_t *idx, const char *name, int slot);
+int dirindex_remove(dirindex_t *idx, const char *name);
+
+void dirindex_put_slot(dirindex_t *idx, int slot);
+int dirindex_take_slot(dirindex_t *idx);
+
+#endif // __dirindex_h__
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "drc.h"
+
+#define DRC_BUCKETS (2 * DRC_SIZE)
+
+// Entries are replaced in FIFO order, so every reply stays cached for the
+// next DRC_SIZE updates, which is far longer than a client retransmits
+typedef struct {
+    int used;
+    int done;             // reply is filled in
+    uint32_t ip;
+    uint16_t port;
+    uint32_t reqid;
+    int next;             // next entry in the same bucket, or -1
+    char *reply;
+    int reply_len;
+    int reply_cap;
+} drc_entry_t;
+
+drc_entry_t drc_entries[DRC_SIZE];
+int drc_buckets[DRC_BUCKETS];
+int drc_victim = 0;
+pthread_mutex_t drc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int drc_hash(uint32_t ip, uint16_t port, uint32_t reqid) {
+    uint32_t h = ip * 2654435761u ^ port * 40503u ^ reqid * 2246822519u;
+    return (h ^ (h >> 16)) % DRC_BUCKETS;
+}
+
+// Returns the entry for the key, or -1; the caller holds drc_lock
+static int drc_find(uint32_t ip, uint16_t port, uint32_t reqid) {
+    int i = drc_buckets[drc_hash(ip, port, reqid)];
+    while (i >= 0) {
+	drc_entry_t *e = &drc_entries[i];
+	if (e->ip == ip && e->port == port && e->reqid == reqid)
+	    return i;
+	i = e->next;
+    }
+    return -1;
+}
+
+// Unlinks an entry from its bucket; the caller holds drc_lock
+static void drc_remove(int i) {
+    drc_entry_t *e = &drc_entries[i];
+    int *link = &drc_buckets[drc_hash(e->ip, e->port, e->reqid)];
+    while (*link != i)
+	link = &drc_entries[*link].next;
+    *link = e->next;
+    e->used = 0;
+}
+
+void drc_init() {
+    for (int i = 0; i < DRC_BUCKETS; i++)
+	drc_buckets[i] = -1;
+}
+
+// Looks up a request. On a miss the request is recorded as in progress, and
+// the caller must execute it and hand the reply to drc_finish.
+int drc_begin(struct sockaddr_in *addr, uint32_t reqid, char *reply, int *reply_len) {
+    uint32_t ip = addr->sin_addr.s_addr;
+    uint16_t port = addr->sin_port;
+
+    pthread_mutex_lock(&drc_lock);
+    int i = drc_find(ip, port, reqid);
+    if (i >= 0) {
+	drc_entry_t *e = &drc_entries[i];
+	int rc = DRC_IN_PROGRESS;
+	if (e->done) {
+	    memcpy(reply, e->reply, e->reply_len);
+	    *reply_len = e->reply_len;
+	    rc = DRC_HIT;
+	}
+	pthread_mutex_unlock(&drc_lock);
+	return rc;
+    }
+
+    // Take over the oldest entry
+    i = drc_victim;
+    drc_victim = (drc_victim + 1) % DRC_SIZE;
+    if (drc_entries[i].used)
+	drc_remove(i);
+    drc_entry_t *e = &drc_entries[i];
+    int bucket = drc_hash(ip, port, reqid);
+    e->used = 1;
+    e->done = 0;
+    e->ip = ip;
+    e->port = port;
+    e->reqid = reqid;
+    e->next = drc_buckets[bucket];
+    drc_buckets[bucket] = i;
+    pthread_mutex_unlock(&drc_lock);
+    return DRC_MISS;
+}
+
+// Looks up a request without recording it. Returns DRC_MISS if it is not
+// cached, or what drc_begin would have returned.
+int drc_peek(struct sockaddr_in *addr, uint32_t reqid, char *reply, int *reply_len) {
+    pthread_mutex_lock(&drc_lock);
+    int i = drc_find(addr->sin_addr.s_addr, addr->sin_port, reqid);
+    int rc = DRC_MISS;
+    if (i >= 0) {
+	drc_entry_t *e = &drc_entries[i];
+	rc = DRC_IN_PROGRESS;
+	if (e->done) {
+	    memcpy(reply, e->reply, e->reply_len);
+	    *reply_len = e->reply_len;
+	    rc = DRC_HIT;
+	}
+    }
+    pthread_mutex_unlock(&drc_lock);
+    return rc;
+}
+
+// Stores the reply to a request started with drc_begin
+void drc_finish(struct sockaddr_in *addr, uint32_t reqid, char *reply, int reply_len) {
+    pthread_mutex_lock(&drc_lock);
+    int i = drc_find(addr->sin_addr.s_addr, addr->sin_port, reqid);
+    if (i >= 0) {
+	drc_entry_t *e = &drc_entries[i];
+	if (e->reply_cap < reply_len) {
+	    free(e->reply);
+	    e->reply = malloc(reply_len);
+	    e->reply_cap = reply_len;
+	}
+	memcpy(e->reply, reply, reply_len);
+	e->reply_len = reply_len;
+	e->done = 1;
+    }
+    pthread_mutex_unlock(&drc_lock);
+}
@@ -0,0 +1,22 @@
+#ifndef __drc_h__
+#define __drc_h__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Duplicate reply cache: remembers the replies to the most recent updates,
+// keyed by client address and request id, so that a retransmitted update is
+// answered from the cache instead of being applied a second time
+
+#define DRC_SIZE (4096)
+
+#define DRC_MISS        (0) // new request: execute it, then drc_finish
+#define DRC_IN_PROGRESS (1) // another worker is executing it: drop this copy
+#define DRC_HIT         (2) // already executed: the cached reply was copied
+
+void drc_init();
+int drc_begin(struct sockaddr_in *addr, uint32_t reqid, char *reply, int *reply_len);
+int drc_peek(struct sockaddr_in *addr, uint32_t reqid, char *reply, int *reply_len);
+void drc_finish(struct sockaddr_in *addr, uint32_t reqid, char *reply, int reply_len);
+
+#endif // __drc_h__
@@ -0,0 +1,901 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ufs.h"
+#include "journal.h"
+#include "message.h"
+
+// Offline checker for an image no server has open. It checks the inode
+// table, the directories and both bitmaps against each other, each pass
+// spread over worker threads, and with -y repairs what it finds:
+//  - inodes that are not usable (bad type, size or block address) are
+//    freed, and entries with a name that is not terminated or that refer
+//    to a free, unusable or missing inode are cleared;
+//  - a second entry for the same inode (there are no hard links) is
+//    cleared, and "." and ".." are pointed where they belong;
+//  - inodes no entry leads to from the root are freed, except detached
+//    ones (see MFS_REMOTE in message.h) in an image that is one server's
+//    part of a sharded namespace: any inode no entry refers to. An image
+//    with an entry or a ".." on another server is taken to be one; -s says
+//    so for an image that shows no sign of it;
+//  - a block in more than one file stays with the lowest numbered inode,
+//    and the others get a copy of it;
+//  - the data bitmap is set to the blocks files use, which frees leaked
+//    blocks and marks used ones taken.
+// The image is mapped privately, so checking never writes it; a journal
+// left by a crash is applied to the mapping, checking the image as the
+// server will find it. With -y the journal is replayed into the file and
+// the repairs are written back through a shared mapping.
+//
+// Exit status: 0 if the image is clean, 1 if it was repaired, 4 if it has
+// problems left, 8 if it could not be checked.
+
+void usage() {
+    fprintf(stderr, "usage: fsck [-y] [-s] [-t <threads>] [-v] <image_file>\n");
+    exit(8);
+}
+
+#define CHUNK_INODES (4096)
+#define CHUNK_BITS   (1 << 20)
+#define MAX_SHOWN    (20)   // problems of each kind listed before the rest are counted
+
+// What pass 1 makes of an inode
+#define INODE_FREE (0)
+#define INODE_OK   (1)
+#define INODE_BAD  (2)
+
+// Kinds of problem, in the order they are listed
+enum { P_BAD_INODE, P_BAD_ENTRY, P_EXTRA_ENTRY, P_DOT, P_ORPHAN, P_CROSS, P_LEAK, P_UNMARKED, P_SHARED, P_KINDS };
+
+typedef struct {
+    int kind;
+    int inum;          // the inode, or directory, it is about
+    long long a, b;    // depending on kind; see print_problem
+    const char *why;
+} problem_t;
+
+char *img;
+super_t sb, *s = &sb;
+inode_t *itable;
+unsigned int *inode_bits, *data_bits;
+int nthreads;
+int shard, repair, verbose;    // shard: see detached()
+
+uint8_t *inode_state;     // INODE_* for each inode
+int *refs;                // entries referring to each inode
+long long *holder;        // first entry for each inode, as directory << 32 | slot
+unsigned int *seen;       // data blocks files use, laid out as the data bitmap
+unsigned int *dups;       // data blocks seen more than once
+
+problem_t *problems;
+long nproblems, problems_cap;
+pthread_mutex_t problems_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Totals a pass gathers, per thread and then summed
+typedef struct {
+    long dirs, files, remote, detached;
+    long extents, fragmented;
+} totals_t;
+
+totals_t totals;
+
+void problem(int kind, int inum, long long a, long long b, const char *why) {
+    pthread_mutex_lock(&problems_lock);
+    if (nproblems == problems_cap) {
+	problems_cap = problems_cap ? 2 * problems_cap : 1024;
+	problems = realloc(problems, problems_cap * sizeof(problem_t));
+    }
+    problem_t p = { kind, inum, a, b, why };
+    problems[nproblems++] = p;
+    pthread_mutex_unlock(&problems_lock);
+}
+
+int bit_get(unsigned int *bitmap, long long position) {
+    return (__atomic_load_n(&bitmap[position / 32], __ATOMIC_RELAXED) >> (31 - position % 32)) & 1;
+}
+
+// Sets a bit, returning whether it was set already
+int bit_test_set(unsigned int *bitmap, long long position) {
+    unsigned int mask = 1U << (31 - position % 32);
+    return (__atomic_fetch_or(&bitmap[position / 32], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+char *block_ptr(long long addr) {
+    return img + addr * UFS_BLOCK_SIZE;
+}
+
+int in_data_region(unsigned int addr) {
+    return addr >= s->data_region_addr && addr < s->data_region_addr + s->data_region_len;
+}
+
+// Data blocks an inode owns, as in the server: a new file owns one block
+// even before its first write
+long inode_blocks(inode_t *inode) {
+    return inode->size == 0 ? 1 : (inode->size - 1) / UFS_BLOCK_SIZE + 1;
+}
+
+long max_blocks() {
+    if (s->version < UFS_VERSION_INDIRECT)
+	return DIRECT_PTRS;
+    return NDIRECT + PTRS_PER_BLOCK + (long)PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+}
+
+// Calls visit on every block pointer the inode owns, in the order the
+// server lays them out: each indirect block's pointer before the pointers
+// in it. An indirect block is only read once visit has returned 0 for it,
+// after any change visit made to its pointer. Returns -1 as soon as visit
+// does, otherwise 0.
+int walk(inode_t *inode, int (*visit)(unsigned int *slot, void *arg), void *arg) {
+    long n = inode_blocks(inode);
+    for (long lblock = 0; lblock < n; lblock++) {
+	if (s->version < UFS_VERSION_INDIRECT || lblock < NDIRECT) {
+	    if (visit(&inode->direct[lblock], arg) < 0)
+		return -1;
+	    continue;
+	}
+	long i = lblock - NDIRECT;
+	if (i == 0 && visit(&inode->direct[INDIRECT_PTR], arg) < 0)
+	    return -1;
+	if (i < PTRS_PER_BLOCK) {
+	    if (visit((unsigned int *)block_ptr(inode->direct[INDIRECT_PTR]) + i, arg) < 0)
+		return -1;
+	    continue;
+	}
+	i -= PTRS_PER_BLOCK;
+	if (i == 0 && visit(&inode->direct[DINDIRECT_PTR], arg) < 0)
+	    return -1;
+	unsigned int *outer = (unsigned int *)block_ptr(inode->direct[DINDIRECT_PTR]);
+	if (i % PTRS_PER_BLOCK == 0 && visit(&outer[i / PTRS_PER_BLOCK], arg) < 0)
+	    return -1;
+	if (visit((unsigned int *)block_ptr(outer[i / PTRS_PER_BLOCK]) + i % PTRS_PER_BLOCK, arg) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+// Returns the directory entry in slot of a directory that pass 1 found usable
+dir_ent_t *dir_entry(inode_t *dir, long slot) {
+    long offset = slot * sizeof(dir_ent_t);
+    unsigned int addr;
+    long lblock = offset / UFS_BLOCK_SIZE;
+    if (s->version < UFS_VERSION_INDIRECT || lblock < NDIRECT) {
+	addr = dir->direct[lblock];
+    } else {
+	long i = lblock - NDIRECT;
+	if (i < PTRS_PER_BLOCK) {
+	    addr = ((unsigned int *)block_ptr(dir->direct[INDIRECT_PTR]))[i];
+	} else {
+	    i -= PTRS_PER_BLOCK;
+	    unsigned int *outer = (unsigned int *)block_ptr(dir->direct[DINDIRECT_PTR]);
+	    addr = ((unsigned int *)block_ptr(outer[i / PTRS_PER_BLOCK]))[i % PTRS_PER_BLOCK];
+	}
+    }
+    return (dir_ent_t *)(block_ptr(addr) + offset % UFS_BLOCK_SIZE);
+}
+
+// Runs pass over [0, count) in chunks of chunk, taken in turn by nthreads
+// threads. pass is called with a range and the calling thread's totals,
+// which are added to totals afterwards.
+typedef void (*pass_t)(long start, long end, totals_t *t);
+
+typedef struct {
+    pass_t pass;
+    long count, chunk;
+    long next;
+} run_t;
+
+void *run_worker(void *arg) {
+    run_t *run = arg;
+    totals_t t;
+    memset(&t, 0, sizeof(t));
+    while (1) {
+	long start = __atomic_fetch_add(&run->next, run->chunk, __ATOMIC_RELAXED);
+	if (start >= run->count)
+	    break;
+	run->pass(start, start + run->chunk < run->count ? start + run->chunk : run->count, &t);
+    }
+    pthread_mutex_lock(&problems_lock);
+    totals.dirs += t.dirs;
+    totals.files += t.files;
+    totals.remote += t.remote;
+    totals.detached += t.detached;
+    totals.extents += t.extents;
+    totals.fragmented += t.fragmented;
+    pthread_mutex_unlock(&problems_lock);
+    return 0;
+}
+
+void run_pass(pass_t pass, long count, long chunk) {
+    run_t run = { pass, count, chunk, 0 };
+    pthread_t threads[nthreads];
+    for (int i = 1; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, run_worker, &run);
+    run_worker(&run);
+    for (int i = 1; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+}
+
+//
+// Pass 1: each allocated inode on its own
+//
+
+int visit_check(unsigned int *slot, void *arg) {
+    return in_data_region(*slot) ? 0 : -1;
+}
+
+const char *inode_problem(int inum, inode_t *inode) {
+    if (inode->type != UFS_DIRECTORY && inode->type != UFS_REGULAR_FILE)
+	return "type is neither directory nor file";
+    if (inode->size < 0 || inode_blocks(inode) > max_blocks())
+	return "size is out of range";
+    if (inode->type == UFS_DIRECTORY && (inode->size % sizeof(dir_ent_t) != 0 || inode->size < 2 * sizeof(dir_ent_t)))
+	return "directory size is not a whole number of entries, \".\" and \"..\" included";
+    if (walk(inode, visit_check, 0) < 0)
+	return "block address outside the data region";
+    return 0;
+}
+
+void pass_inodes(long start, long end, totals_t *t) {
+    for (long inum = start; inum < end; inum++) {
+	if (!bit_get(inode_bits, inum))
+	    continue;
+	const char *why = inode_problem(inum, &itable[inum]);
+	if (why) {
+	    inode_state[inum] = INODE_BAD;
+	    problem(P_BAD_INODE, inum, 0, 0, why);
+	} else {
+	    inode_state[inum] = INODE_OK;
+	}
+    }
+}
+
+//
+// Pass 2: the entries of each usable directory
+//
+
+// Keeps the smallest of the entries referring to an inode
+void hold(int inum, long long entry) {
+    long long old = __atomic_load_n(&holder[inum], __ATOMIC_RELAXED);
+    while (entry < old && !__atomic_compare_exchange_n(&holder[inum], &old, entry, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+void pass_entries(long start, long end, totals_t *t) {
+    for (long dinum = start; dinum < end; dinum++) {
+	inode_t *dir = &itable[dinum];
+	if (inode_state[dinum] != INODE_OK || dir->type != UFS_DIRECTORY)
+	    continue;
+	long n = dir->size / sizeof(dir_ent_t);
+	for (long slot = 0; slot < n; slot++) {
+	    dir_ent_t *e = dir_entry(dir, slot);
+	    if (slot == 1 && e->inum >= 0 && (e->inum & MFS_REMOTE))
+		shard = 1;
+	    if (slot < 2 || e->inum == -1)
+		continue;
+	    if (e->inum >= 0 && (e->inum & MFS_REMOTE)) {
+		shard = 1;
+		t->remote++;
+		continue;
+	    }
+	    const char *why = 0;
+	    if (memchr(e->name, '\0', sizeof(e->name)) == 0)
+		why = "has a name that is not terminated";
+	    else if (e->inum < 0 || e->inum >= s->num_inodes)
+		why = "refers to an inode that does not exist";
+	    else if (e->inum == 0)
+		why = "refers to the root directory";
+	    else if (inode_state[e->inum] == INODE_FREE)
+		why = "refers to a free inode";
+	    else if (inode_state[e->inum] == INODE_BAD)
+		why = "refers to an unusable inode";
+	    if (why) {
+		problem(P_BAD_ENTRY, dinum, slot, e->inum, why);
+		continue;
+	    }
+	    __atomic_fetch_add(&refs[e->inum], 1, __ATOMIC_RELAXED);
+	    hold(e->inum, dinum << 32 | slot);
+	}
+    }
+}
+
+//
+// Pass 3: which inodes an entry leads to from the root
+//
+
+#define REACH_UNKNOWN (0)
+#define REACH_WALKING (1)
+#define REACH_YES     (2)
+#define REACH_NO      (3)
+
+uint8_t *reach;
+int *path;
+
+// Returns whether the usable inode inum may be the target of an entry on
+// another server: in a shard, an inode no entry here refers to
+int detached(int inum) {
+    return shard && refs[inum] == 0 && inum != 0;
+}
+
+// Follows the first entries for inum up towards the root, settling every
+// inode on the way
+int reachable(int inum) {
+    int depth = 0, answer;
+    while (1) {
+	if (reach[inum] == REACH_YES || reach[inum] == REACH_NO) {
+	    answer = reach[inum];
+	    break;
+	}
+	if (reach[inum] == REACH_WALKING) {
+	    answer = REACH_NO;        // a cycle that never meets the root
+	    break;
+	}
+	if (inum == 0 || detached(inum)) {
+	    answer = REACH_YES;
+	    reach[inum] = answer;
+	    break;
+	}
+	if (refs[inum] == 0) {
+	    answer = REACH_NO;
+	    reach[inum] = answer;
+	    break;
+	}
+	reach[inum] = REACH_WALKING;
+	path[depth++] = inum;
+	inum = holder[inum] >> 32;
+    }
+    while (depth > 0)
+	reach[path[--depth]] = answer;
+    return answer == REACH_YES;
+}
+
+void check_reachable(totals_t *t) {
+    for (int inum = 0; inum < s->num_inodes; inum++) {
+	if (inode_state[inum] != INODE_OK)
+	    continue;
+	if (!reachable(inum))
+	    problem(P_ORPHAN, inum, 0, 0, refs[inum] ? "is only in directories cut off from the root" : "is in no directory");
+	else if (refs[inum] == 0 && inum != 0)
+	    t->detached++;
+    }
+}
+
+int kept(long inum) {
+    return inode_state[inum] == INODE_OK && reach[inum] == REACH_YES;
+}
+
+// The "." and ".." of the directories kept, and the count of what is kept
+void pass_links(long start, long end, totals_t *t) {
+    for (long inum = start; inum < end; inum++) {
+	if (!kept(inum))
+	    continue;
+	inode_t *inode = &itable[inum];
+	if (inode->type == UFS_REGULAR_FILE) {
+	    t->files++;
+	    continue;
+	}
+	t->dirs++;
+	dir_ent_t *self = dir_entry(inode, 0), *up = dir_entry(inode, 1);
+	if (strncmp(self->name, ".", sizeof(self->name)) != 0 || self->inum != inum)
+	    problem(P_DOT, inum, 0, inum, 0);
+	// A detached directory's parent is on another server
+	if (refs[inum] == 0 && inum != 0 && up->inum >= 0 && (up->inum & MFS_REMOTE)) {
+	    if (strncmp(up->name, "..", sizeof(up->name)) != 0)
+		problem(P_DOT, inum, 1, up->inum, 0);
+	    continue;
+	}
+	int parent = refs[inum] ? holder[inum] >> 32 : 0;
+	if (strncmp(up->name, "..", sizeof(up->name)) != 0 || up->inum != parent)
+	    problem(P_DOT, inum, 1, parent, 0);
+    }
+}
+
+// Entries for an inode other than its first, now that every first entry
+// is known
+void pass_extra_entries(long start, long end, totals_t *t) {
+    for (long dinum = start; dinum < end; dinum++) {
+	inode_t *dir = &itable[dinum];
+	if (inode_state[dinum] != INODE_OK || dir->type != UFS_DIRECTORY)
+	    continue;
+	long n = dir->size / sizeof(dir_ent_t);
+	for (long slot = 2; slot < n; slot++) {
+	    int target = dir_entry(dir, slot)->inum;
+	    if (target <= 0 || (target & MFS_REMOTE) || target >= s->num_inodes ||
+		inode_state[target] != INODE_OK || refs[target] < 2)
+		continue;
+	    if (holder[target] != (dinum << 32 | slot))
+		problem(P_EXTRA_ENTRY, dinum, slot, target, 0);
+	}
+    }
+}
+
+//
+// Pass 4: the blocks of the inodes kept
+//
+
+typedef struct {
+    long long last;
+    long extents;
+} mark_t;
+
+int visit_mark(unsigned int *slot, void *arg) {
+    mark_t *m = arg;
+    long long bit = *slot - s->data_region_addr;
+    if (bit_test_set(seen, bit))
+	bit_test_set(dups, bit);
+    if (*slot != m->last + 1)
+	m->extents++;
+    m->last = *slot;
+    return 0;
+}
+
+void pass_blocks(long start, long end, totals_t *t) {
+    for (long inum = start; inum < end; inum++) {
+	if (!kept(inum))
+	    continue;
+	mark_t m = { -2, 0 };
+	walk(&itable[inum], visit_mark, &m);
+	t->extents += m.extents;
+	if (m.extents > 1)
+	    t->fragmented++;
+    }
+}
+
+// Lists each use of a block seen more than once
+int visit_shared(unsigned int *slot, void *arg) {
+    if (bit_get(dups, *slot - s->data_region_addr))
+	problem(P_SHARED, *(int *)arg, *slot, 0, 0);
+    return 0;
+}
+
+void pass_shared(long start, long end, totals_t *t) {
+    for (long inum = start; inum < end; inum++) {
+	if (!kept(inum))
+	    continue;
+	int i = inum;
+	walk(&itable[inum], visit_shared, &i);
+    }
+}
+
+//
+// Pass 5: the data bitmap against the blocks in use
+//
+
+// Records the runs of blocks in [start, end) that the data bitmap marks
+// used and no file uses, and the other way round
+void pass_bitmap(long start, long end, totals_t *t) {
+    long long leak = -1, unmarked = -1;
+    for (long bit = start; bit <= end; bit++) {
+	// Whole words that agree, outside a run, are skipped
+	if (bit % 32 == 0 && bit + 32 <= end && leak < 0 && unmarked < 0 && data_bits[bit / 32] == seen[bit / 32]) {
+	    bit += 31;
+	    continue;
+	}
+	int marked = bit < end && bit_get(data_bits, bit);
+	int used = bit < end && bit_get(seen, bit);
+	if (marked && !used) {
+	    if (leak < 0)
+		leak = bit;
+	} else if (leak >= 0) {
+	    problem(P_LEAK, 0, leak + s->data_region_addr, bit + s->data_region_addr, 0);
+	    leak = -1;
+	}
+	if (used && !marked) {
+	    if (unmarked < 0)
+		unmarked = bit;
+	} else if (unmarked >= 0) {
+	    problem(P_UNMARKED, 0, unmarked + s->data_region_addr, bit + s->data_region_addr, 0);
+	    unmarked = -1;
+	}
+    }
+}
+
+//
+// Reporting
+//
+
+int problem_order(const void *x, const void *y) {
+    const problem_t *p = x, *q = y;
+    if (p->kind != q->kind)
+	return p->kind - q->kind;
+    if (p->inum != q->inum)
+	return p->inum < q->inum ? -1 : 1;
+    if (p->a != q->a)
+	return p->a < q->a ? -1 : 1;
+    return p->b < q->b ? -1 : p->b > q->b;
+}
+
+// Orders uses of shared blocks by block, then inode
+int shared_order(const void *x, const void *y) {
+    const problem_t *p = x, *q = y;
+    if (p->a != q->a)
+	return p->a < q->a ? -1 : 1;
+    return p->inum < q->inum ? -1 : p->inum > q->inum;
+}
+
+// Sorts the problems. Uses of a shared block become a cross link for each
+// use after the lowest numbered inode's, and runs of blocks that chunk
+// boundaries split are joined.
+void settle_problems() {
+    qsort(problems, nproblems, sizeof(problem_t), problem_order);
+    long first = nproblems;
+    while (first > 0 && problems[first - 1].kind == P_SHARED)
+	first--;
+    qsort(problems + first, nproblems - first, sizeof(problem_t), shared_order);
+    long n = first;
+    for (long i = first; i < nproblems; i++) {
+	long owner = i;
+	while (owner > first && problems[owner - 1].a == problems[i].a)
+	    owner--;
+	if (owner == i)
+	    continue;
+	problem_t cross = { P_CROSS, problems[i].inum, problems[i].a, problems[owner].inum, 0 };
+	problems[n++] = cross;
+    }
+    nproblems = n;
+    qsort(problems, nproblems, sizeof(problem_t), problem_order);
+
+    n = 0;
+    for (long i = 0; i < nproblems; i++) {
+	problem_t *p = &problems[i];
+	if (n > 0 && (p->kind == P_LEAK || p->kind == P_UNMARKED) && problems[n - 1].kind == p->kind &&
+	    problems[n - 1].b == p->a)
+	    problems[n - 1].b = p->b;
+	else
+	    problems[n++] = *p;
+    }
+    nproblems = n;
+}
+
+const char *kind_names[P_KINDS] = {
+    "unusable inodes", "bad entries", "extra entries", "bad \".\" or \"..\" entries",
+    "inodes no entry leads to", "cross-linked blocks", "runs of leaked blocks",
+    "runs of used blocks marked free", "",
+};
+
+void print_problem(problem_t *p) {
+    switch (p->kind) {
+    case P_BAD_INODE:
+    case P_ORPHAN:
+	printf("inode %d: %s\n", p->inum, p->why);
+	break;
+    case P_BAD_ENTRY:
+	printf("directory %d entry %lld: %s (%lld)\n", p->inum, p->a, p->why, p->b);
+	break;
+    case P_EXTRA_ENTRY:
+	printf("directory %d entry %lld: another entry for inode %lld\n", p->inum, p->a, p->b);
+	break;
+    case P_DOT:
+	printf("directory %d: \"%s\" should refer to %lld\n", p->inum, p->a ? ".." : ".", p->b);
+	break;
+    case P_CROSS:
+	printf("block %lld: in inode %d, and in inode %lld which keeps it\n", p->a, p->inum, p->b);
+	break;
+    case P_LEAK:
+    case P_UNMARKED:
+	if (p->b - p->a == 1)
+	    printf("block %lld: ", p->a);
+	else
+	    printf("blocks %lld-%lld: ", p->a, p->b - 1);
+	printf(p->kind == P_LEAK ? "marked used, in no file\n" : "in a file, marked free\n");
+	break;
+    }
+}
+
+void print_problems() {
+    long shown = 0;
+    for (long i = 0; i < nproblems; i++) {
+	if (i > 0 && problems[i].kind != problems[i - 1].kind)
+	    shown = 0;
+	if (shown++ < MAX_SHOWN) {
+	    print_problem(&problems[i]);
+	    continue;
+	}
+	long more = 1;
+	while (i + more < nproblems && problems[i + more].kind == problems[i].kind)
+	    more++;
+	printf("... and %ld more %s\n", more, kind_names[problems[i].kind]);
+	i += more - 1;
+    }
+}
+
+// Prints what is free among the data blocks, and in how many pieces
+void print_summary(totals_t *t) {
+    long long free_blocks = 0, runs = 0, largest = 0, run = 0;
+    for (long long bit = 0; bit <= s->data_region_len; bit++) {
+	if (bit < s->data_region_len && bit % 32 == 0 && bit + 32 <= s->data_region_len &&
+	    seen[bit / 32] == 0) {
+	    run += 32;
+	    free_blocks += 32;
+	    bit += 31;
+	    continue;
+	}
+	if (bit < s->data_region_len && !bit_get(seen, bit)) {
+	    run++;
+	    free_blocks++;
+	    continue;
+	}
+	if (run > 0) {
+	    runs++;
+	    if (run > largest)
+		largest = run;
+	    run = 0;
+	}
+    }
+    long inodes = t->dirs + t->files;
+    printf("inodes: %ld of %d in use, %ld directories and %ld files", inodes, s->num_inodes, t->dirs, t->files);
+    if (shard)
+	printf(", %ld detached, %ld entries for inodes on other servers", t->detached, t->remote);
+    printf("\n");
+    printf("blocks: %lld of %lld free (%.1f%%), in %lld runs, largest %lld, average %.1f\n", free_blocks,
+	   s->data_region_len, 100.0 * free_blocks / s->data_region_len, runs, largest,
+	   runs ? (double)free_blocks / runs : 0.0);
+    printf("extents: %.2f per inode on average, %.1f%% of inodes in more than one\n",
+	   inodes ? (double)t->extents / inodes : 0.0, inodes ? 100.0 * t->fragmented / inodes : 0.0);
+}
+
+//
+// Repair
+//
+
+long long clone_cursor;
+long unrepaired;
+
+// Returns a data block free in seen, now taken, or -1
+long long take_block() {
+    for (long long i = 0; i < s->data_region_len; i++) {
+	long long bit = (clone_cursor + i) % s->data_region_len;
+	if (!bit_test_set(seen, bit)) {
+	    clone_cursor = bit + 1;
+	    return bit;
+	}
+    }
+    return -1;
+}
+
+typedef struct {
+    int inum;
+    problem_t *cross;   // the inode's cross links, by block
+    long ncross;
+    uint8_t *kept;      // for each, whether a pointer to the block was met
+} clone_t;
+
+// Gives the inode its own copy of a block it shares, unless it keeps the
+// block: the lowest numbered inode does, once
+int visit_clone(unsigned int *slot, void *arg) {
+    clone_t *c = arg;
+    for (long i = 0; i < c->ncross; i++) {
+	if (c->cross[i].a != *slot)
+	    continue;
+	if (c->cross[i].b == c->inum && !c->kept[i]) {
+	    c->kept[i] = 1;
+	    return 0;
+	}
+	long long bit = take_block();
+	if (bit < 0) {
+	    printf("block %u: no free block to copy it to for inode %d\n", *slot, c->inum);
+	    unrepaired++;
+	    return 0;
+	}
+	memcpy(block_ptr(bit + s->data_region_addr), block_ptr(*slot), UFS_BLOCK_SIZE);
+	*slot = bit + s->data_region_addr;
+	return 0;
+    }
+    return 0;
+}
+
+void repair_image() {
+    for (long i = 0; i < nproblems; i++) {
+	problem_t *p = &problems[i];
+	inode_t *dir = &itable[p->inum];
+	if (p->kind == P_BAD_ENTRY || p->kind == P_EXTRA_ENTRY) {
+	    dir_entry(dir, p->a)->inum = -1;
+	} else if (p->kind == P_DOT) {
+	    dir_ent_t *e = dir_entry(dir, p->a);
+	    memset(e->name, 0, sizeof(e->name));
+	    strcpy(e->name, p->a ? ".." : ".");
+	    e->inum = p->b;
+	}
+    }
+
+    // Cross links, an inode at a time; problems are in inode order
+    for (long i = 0; i < nproblems; ) {
+	if (problems[i].kind != P_CROSS) {
+	    i++;
+	    continue;
+	}
+	long n = 1;
+	while (i + n < nproblems && problems[i + n].kind == P_CROSS && problems[i + n].inum == problems[i].inum)
+	    n++;
+	clone_t c = { problems[i].inum, &problems[i], n, calloc(n, 1) };
+	walk(&itable[c.inum], visit_clone, &c);
+	free(c.kept);
+	i += n;
+    }
+
+    for (long inum = 0; inum < s->num_inodes; inum++)
+	if (bit_get(inode_bits, inum) && !kept(inum))
+	    inode_bits[inum / 32] &= ~(1U << (31 - inum % 32));
+    memcpy(data_bits, seen, s->data_bitmap_len * UFS_BLOCK_SIZE);
+}
+
+//
+// Setup
+//
+
+const char *super_problem(long long file_blocks) {
+    if (s->version < UFS_VERSION_DIRECT || s->version > UFS_VERSION)
+	return "unknown format version";
+    if (s->num_inodes <= 0 || s->data_region_len <= 0)
+	return "no inodes or no data blocks";
+    if (s->inode_bitmap_addr < 1 || s->data_bitmap_addr < s->inode_bitmap_addr + s->inode_bitmap_len ||
+	s->inode_region_addr < s->data_bitmap_addr + s->data_bitmap_len ||
+	s->data_region_addr < s->inode_region_addr + s->inode_region_len)
+	return "regions overlap";
+    if (s->inode_bitmap_len * 8 * UFS_BLOCK_SIZE < s->num_inodes ||
+	s->data_bitmap_len * 8 * UFS_BLOCK_SIZE < s->data_region_len ||
+	s->inode_region_len * UFS_BLOCK_SIZE < (long long)s->num_inodes * sizeof(inode_t))
+	return "a region is too small for the inodes or blocks";
+    long long end = s->data_region_addr + s->data_region_len;
+    if (s->version >= UFS_VERSION_JOURNAL && s->journal_len > 0) {
+	if (s->journal_addr < end)
+	    return "journal overlaps the data region";
+	end = s->journal_addr + s->journal_len;
+    }
+    if (end > file_blocks || end > UFS_MAX_BLOCKS)
+	return "regions run past the end of the image";
+    return 0;
+}
+
+double now_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+double pass_start;
+
+void pass_done(const char *name) {
+    double now = now_seconds();
+    if (verbose)
+	printf("%-24s %8.3f s\n", name, now - pass_start);
+    pass_start = now;
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((ch = getopt(argc, argv, "yst:v")) != -1) {
+	switch (ch) {
+	case 'y':
+	    repair = 1;
+	    break;
+	case 's':
+	    shard = 1;
+	    break;
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1 || nthreads < 1)
+	usage();
+    char *image_file = argv[optind];
+
+    double start = now_seconds();
+    pass_start = start;
+    int fd = open(image_file, repair ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+	perror("open");
+	exit(8);
+    }
+    struct stat st;
+    char block[UFS_BLOCK_SIZE];
+    if (fstat(fd, &st) < 0 || pread(fd, block, UFS_BLOCK_SIZE, 0) != UFS_BLOCK_SIZE) {
+	perror("read");
+	exit(8);
+    }
+    ufs_super_read(block, s);
+    const char *why = super_problem(st.st_size / UFS_BLOCK_SIZE);
+    if (why) {
+	printf("superblock: %s; not checking further\n", why);
+	exit(4);
+    }
+
+    // A crash may have left updates in the journal: replayed into the file
+    // when repairing, as the server would, otherwise only into the mapping
+    int replayed = 0;
+    if (repair)
+	replayed = journal_replay(fd, s);
+    img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, repair ? MAP_SHARED : MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (img == MAP_FAILED) {
+	perror("mmap");
+	exit(8);
+    }
+    // Directory blocks lie scattered among the data, where reading around
+    // each one only brings in blocks no pass looks at; the metadata regions
+    // are read whole
+    madvise(img, st.st_size, MADV_RANDOM);
+    madvise(img, s->data_region_addr * UFS_BLOCK_SIZE, MADV_WILLNEED);
+    if (!repair)
+	replayed = journal_replay_private(fd, s, img);
+    if (replayed < 0) {
+	perror("journal replay");
+	exit(8);
+    }
+    if (replayed > 0)
+	printf("journal: %s %d transactions\n", repair ? "replayed" : "applied, in memory only,", replayed);
+    ufs_super_read(img, s);
+    itable = (inode_t *)block_ptr(s->inode_region_addr);
+    inode_bits = (unsigned int *)block_ptr(s->inode_bitmap_addr);
+    data_bits = (unsigned int *)block_ptr(s->data_bitmap_addr);
+
+    inode_state = calloc(s->num_inodes, 1);
+    refs = calloc(s->num_inodes, sizeof(int));
+    holder = malloc(s->num_inodes * sizeof(long long));
+    reach = calloc(s->num_inodes, 1);
+    path = malloc(s->num_inodes * sizeof(int));
+    seen = calloc(s->data_bitmap_len, UFS_BLOCK_SIZE);
+    dups = calloc(s->data_bitmap_len, UFS_BLOCK_SIZE);
+    if (!inode_state || !refs || !holder || !reach || !path || !seen || !dups) {
+	perror("malloc");
+	exit(8);
+    }
+    for (long i = 0; i < s->num_inodes; i++)
+	holder[i] = LLONG_MAX;
+    pass_done("setup");
+
+    run_pass(pass_inodes, s->num_inodes, CHUNK_INODES);
+    pass_done("inodes");
+    if (inode_state[0] != INODE_OK || itable[0].type != UFS_DIRECTORY) {
+	settle_problems();
+	print_problems();
+	printf("root directory is unusable; not checking further\n");
+	exit(4);
+    }
+    run_pass(pass_entries, s->num_inodes, CHUNK_INODES);
+    pass_done("directories");
+    check_reachable(&totals);
+    pass_done("reachability");
+    run_pass(pass_links, s->num_inodes, CHUNK_INODES);
+    run_pass(pass_extra_entries, s->num_inodes, CHUNK_INODES);
+    pass_done("links");
+    run_pass(pass_blocks, s->num_inodes, CHUNK_INODES);
+    run_pass(pass_shared, s->num_inodes, CHUNK_INODES);
+    pass_done("blocks");
+    run_pass(pass_bitmap, s->data_region_len, CHUNK_BITS);
+    pass_done("bitmap");
+    settle_problems();
+    print_problems();
+
+    int status = 0;
+    if (nproblems > 0 && repair) {
+	repair_image();
+	if (msync(img, st.st_size, MS_SYNC) < 0) {
+	    perror("msync");
+	    exit(8);
+	}
+	pass_done("repair");
+	status = unrepaired ? 4 : 1;
+    } else if (nproblems > 0) {
+	status = 4;
+    }
+    print_summary(&totals);
+    printf("%s: %ld problems%s, in %.2f s with %d threads\n", image_file, nproblems,
+	   nproblems == 0 ? "" : repair ? (unrepaired ? ", some left" : ", repaired") : ", run with -y to repair",
+	   now_seconds() - start, nthreads);
+    return status;
+}
@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include "journal.h"
+
+// A transaction: the blocks changed by the updates that ended in it. It is
+// open until a commit closes it, which copies the blocks so the log and
+// the later write home see them exactly as they were then.
+typedef struct journal_tx {
+    uint64_t seq;
+    int count;                // blocks in blocks[], added atomically
+    int cap;
+    int reserved;             // blocks held by updates still running
+    int ops;                  // updates ended in it
+    int *blocks;              // image block numbers, in the order first changed
+    uint8_t *dirty;           // bit per image block: in blocks[] already
+    char *copies;             // count blocks, once closed and if logged
+    struct journal_tx *next;  // next transaction logged but not written home
+} journal_tx_t;
+
+int journal_enabled = 0;
+int journal_logged = 0;       // the image has a journal region
+int journal_fd;
+char *journal_img;
+super_t journal_sb;
+int journal_nblocks;          // image blocks updates may change
+int journal_tx_limit;         // most blocks one transaction may hold
+
+int journal_policy = JOURNAL_SYNC;
+int period_ms, period_blocks; // JOURNAL_PERIODIC: commit after this long or this many blocks
+pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+
+// Updates hold journal_lock shared; a commit takes it exclusively just long
+// enough to close the open transaction and copy its blocks. Writers are
+// preferred so a steady stream of updates cannot hold a commit off.
+pthread_rwlock_t journal_lock;
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+journal_tx_t *open_tx;
+uint64_t committed_seq = 0;   // every transaction up to this one is durable
+int committing = 0;           // a thread is writing a commit or checkpoint
+int closing = 0;              // journal_shutdown holds journal_lock
+journal_tx_t *logged_head, *logged_tail;
+int log_pos = 1;              // next free block of the region
+uint64_t replay_seq = 1;      // sequence number replay ended at
+
+// What the calling thread's replies wait for, the blocks it reserved and
+// how many of those its update has changed so far
+static __thread uint64_t pending_seq;
+static __thread int held_blocks;
+static __thread int used_blocks;
+static __thread int paused_blocks;
+
+// Totals for journal_report
+long stat_commits, stat_ops, stat_blocks, stat_ranges, stat_checkpoints;
+long stat_commit_us, stat_max_commit_us;
+
+static long journal_now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+static void journal_fail(const char *what) {
+    // An update the log cannot hold must not be acknowledged, and later
+    // ones would depend on it
+    perror(what);
+    exit(1);
+}
+
+// Checksum over whole words, for telling a complete transaction from one
+// torn by a crash
+static uint64_t journal_checksum(uint64_t sum, char *p, long len) {
+    uint64_t a = (uint32_t)sum, b = sum >> 32;
+    for (long i = 0; i + 4 <= len; i += 4) {
+	uint32_t w;
+	memcpy(&w, p + i, 4);
+	a += w;
+	b += a;
+    }
+    return (b << 32) ^ a;
+}
+
+static journal_tx_t *journal_tx_new(uint64_t seq) {
+    journal_tx_t *tx = calloc(1, sizeof(journal_tx_t));
+    tx->seq = seq;
+    tx->cap = journal_tx_limit;
+    tx->blocks = malloc(tx->cap * sizeof(int));
+    tx->dirty = calloc(journal_nblocks / 8 + 1, 1);
+    return tx;
+}
+
+static void journal_tx_free(journal_tx_t *tx) {
+    free(tx->blocks);
+    free(tx->dirty);
+    free(tx->copies);
+    free(tx);
+}
+
+static void journal_write_header(uint64_t start_seq) {
+    char block[UFS_BLOCK_SIZE];
+    bzero(block, sizeof(block));
+    journal_header_t *h = (journal_header_t *)block;
+    h->magic = JOURNAL_HEADER_MAGIC;
+    h->start_seq = start_seq;
+    if (pwrite(journal_fd, block, UFS_BLOCK_SIZE, (long)journal_sb.journal_addr * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE ||
+	fdatasync(journal_fd) != 0)
+	journal_fail("journal header");
+}
+
+static int journal_block_cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static int journal_changed(journal_tx_t *tx, int block) {
+    return tx && tx->dirty && (tx->dirty[block / 8] & (1 << (block % 8)));
+}
+
+// Drops the private copies of the logged transactions' blocks once they
+// are home, so that they are read from the file again and the mapping
+// holds only blocks changed since. Blocks the open transaction or pending
+// (closed but not logged yet) changed are kept. Takes journal_lock
+// exclusively, so no update is halfway through changing one.
+static void journal_drop_copies(journal_tx_t *pending) {
+    if (sysconf(_SC_PAGESIZE) != UFS_BLOCK_SIZE)
+	return;
+    int n = 0;
+    for (journal_tx_t *tx = logged_head; tx; tx = tx->next)
+	n += tx->count;
+    int *blocks = malloc((long)MAX(n, 1) * sizeof(int));
+    n = 0;
+    for (journal_tx_t *tx = logged_head; tx; tx = tx->next) {
+	memcpy(blocks + n, tx->blocks, (long)tx->count * sizeof(int));
+	n += tx->count;
+    }
+    qsort(blocks, n, sizeof(int), journal_block_cmp);
+
+    pthread_rwlock_wrlock(&journal_lock);
+    for (int i = 0; i < n; ) {
+	int first = blocks[i], last = first, j = i + 1;
+	int keep = journal_changed(open_tx, first) || journal_changed(pending, first);
+	while (j < n && (blocks[j] == last || (blocks[j] == last + 1 && !keep &&
+		!journal_changed(open_tx, blocks[j]) && !journal_changed(pending, blocks[j]))))
+	    last = blocks[j++];
+	long len = (long)(last - first + 1) * UFS_BLOCK_SIZE;
+	if (!keep && madvise(journal_img + (long)first * UFS_BLOCK_SIZE, len, MADV_DONTNEED) != 0)
+	    journal_fail("madvise");
+	i = j;
+    }
+    pthread_rwlock_unlock(&journal_lock);
+    free(blocks);
+}
+
+// Writes every logged transaction's blocks home, oldest first, and empties
+// the log; next_seq is the first transaction still to be logged. Unless
+// pending is null, the private copies of those blocks are dropped too (see
+// journal_drop_copies). The caller is the one committing thread.
+static void journal_checkpoint(uint64_t next_seq, journal_tx_t *pending) {
+    for (journal_tx_t *tx = logged_head; tx; tx = tx->next) {
+	for (int i = 0; i < tx->count; i++) {
+	    if (pwrite(journal_fd, tx->copies + (long)i * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE,
+		       (long)tx->blocks[i] * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE)
+		journal_fail("journal checkpoint");
+	}
+    }
+    if (fdatasync(journal_fd) != 0)
+	journal_fail("journal checkpoint");
+    journal_write_header(next_seq);
+    if (pending)
+	journal_drop_copies(pending);
+
+    while (logged_head) {
+	journal_tx_t *tx = logged_head;
+	logged_head = tx->next;
+	journal_tx_free(tx);
+    }
+    logged_tail = 0;
+    log_pos = 1;
+    stat_checkpoints++;
+}
+
+// Appends a closed transaction to the log with one write and one flush.
+// One that changed nothing still gets its commit block, since replay stops
+// at the first number missing; nothing waits on it being durable itself,
+// and the next transaction's flush covers it.
+static void journal_log(journal_tx_t *tx) {
+    int ndesc = (tx->count + JOURNAL_TAGS - 1) / JOURNAL_TAGS;
+    int len = ndesc + tx->count + 1;
+    if (log_pos + len > journal_sb.journal_len)
+	journal_checkpoint(tx->seq, closing ? 0 : tx);
+
+    journal_desc_t *descs = calloc(ndesc, sizeof(journal_desc_t));
+    journal_commit_t *commit = calloc(1, UFS_BLOCK_SIZE);
+    struct iovec *iov = malloc((2 * ndesc + 1) * sizeof(struct iovec));
+    uint64_t sum = 0;
+    for (int d = 0; d < ndesc; d++) {
+	int first = d * JOURNAL_TAGS;
+	journal_desc_t *desc = &descs[d];
+	desc->magic = JOURNAL_DESC_MAGIC;
+	desc->seq = tx->seq;
+	desc->count = MIN(JOURNAL_TAGS, tx->count - first);
+	desc->last = d == ndesc - 1;
+	for (int i = 0; i < desc->count; i++)
+	    desc->home[i] = tx->blocks[first + i];
+	iov[2 * d].iov_base = desc;
+	iov[2 * d].iov_len = UFS_BLOCK_SIZE;
+	iov[2 * d + 1].iov_base = tx->copies + (long)first * UFS_BLOCK_SIZE;
+	iov[2 * d + 1].iov_len = (long)desc->count * UFS_BLOCK_SIZE;
+	sum = journal_checksum(sum, iov[2 * d].iov_base, iov[2 * d].iov_len);
+	sum = journal_checksum(sum, iov[2 * d + 1].iov_base, iov[2 * d + 1].iov_len);
+    }
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->nblocks = tx->count;
+    commit->seq = tx->seq;
+    commit->checksum = sum;
+    iov[2 * ndesc].iov_base = commit;
+    iov[2 * ndesc].iov_len = UFS_BLOCK_SIZE;
+
+    // pwritev may stop short on a large transaction; go on from there
+    long offset = ((long)journal_sb.journal_addr + log_pos) * UFS_BLOCK_SIZE;
+    struct iovec *v = iov;
+    int nv = 2 * ndesc + 1;
+    while (nv > 0) {
+	ssize_t n = pwritev(journal_fd, v, MIN(nv, IOV_MAX), offset);
+	if (n <= 0)
+	    journal_fail("journal write");
+	offset += n;
+	while (nv > 0 && n >= (ssize_t)v->iov_len) {
+	    n -= v->iov_len;
+	    v++;
+	    nv--;
+	}
+	if (nv > 0) {
+	    v->iov_base = (char *)v->iov_base + n;
+	    v->iov_len -= n;
+	}
+    }
+    if (tx->count > 0 && fdatasync(journal_fd) != 0)
+	journal_fail("journal write");
+    free(iov);
+    free(commit);
+    free(descs);
+
+    log_pos += len;
+    if (logged_tail)
+	logged_tail->next = tx;
+    else
+	logged_head = tx;
+    logged_tail = tx;
+}
+
+// Writes a closed transaction's blocks in place, as few contiguous runs
+// of the shared mapping as they make up
+static void journal_msync(journal_tx_t *tx) {
+    qsort(tx->blocks, tx->count, sizeof(int), journal_block_cmp);
+    for (int i = 0; i < tx->count; ) {
+	int j = i + 1;
+	while (j < tx->count && tx->blocks[j] == tx->blocks[j - 1] + 1)
+	    j++;
+	if (msync(journal_img + (long)tx->blocks[i] * UFS_BLOCK_SIZE, (long)(j - i) * UFS_BLOCK_SIZE, MS_SYNC) != 0)
+	    journal_fail("msync");
+	stat_ranges++;
+	i = j;
+    }
+}
+
+// Swaps in a new open transaction and returns the old one, with copies of
+// its blocks if they are to be logged. The caller holds journal_lock
+// exclusively, so no update is halfway through changing them.
+static journal_tx_t *journal_close() {
+    journal_tx_t *tx = open_tx;
+    journal_tx_t *next = journal_tx_new(tx->seq + 1);
+    pthread_mutex_lock(&journal_mutex);
+    open_tx = next;
+    pthread_mutex_unlock(&journal_mutex);
+    if (journal_logged) {
+	tx->copies = malloc((long)MAX(tx->count, 1) * UFS_BLOCK_SIZE);
+	for (int i = 0; i < tx->count; i++)
+	    memcpy(tx->copies + (long)i * UFS_BLOCK_SIZE, journal_img + (long)tx->blocks[i] * UFS_BLOCK_SIZE,
+		   UFS_BLOCK_SIZE);
+    }
+    return tx;
+}
+
+// Makes a closed transaction durable, logging it or writing it in place,
+// and returns with journal_mutex held and committed_seq advanced past it
+static void journal_flush(journal_tx_t *tx, long start) {
+    uint64_t seq = tx->seq;
+    int ops = tx->ops, count = tx->count;
+    if (journal_logged) {
+	journal_log(tx);
+	free(tx->dirty);
+	tx->dirty = 0;
+    } else {
+	if (count > 0)
+	    journal_msync(tx);
+	journal_tx_free(tx);
+    }
+    long elapsed = journal_now_us() - start;
+
+    pthread_mutex_lock(&journal_mutex);
+    committed_seq = seq;
+    if (count > 0) {
+	stat_commits++;
+	stat_ops += ops;
+	stat_blocks += count;
+	stat_commit_us += elapsed;
+	stat_max_commit_us = MAX(stat_max_commit_us, elapsed);
+    }
+    pthread_cond_broadcast(&journal_cond);
+}
+
+// Closes the open transaction and makes it durable. Called and returns
+// with journal_mutex held; other threads wait on journal_cond meanwhile.
+static void journal_commit_locked() {
+    committing = 1;
+    pthread_mutex_unlock(&journal_mutex);
+    long start = journal_now_us();
+
+    pthread_rwlock_wrlock(&journal_lock);
+    journal_tx_t *tx = journal_close();
+    pthread_rwlock_unlock(&journal_lock);
+
+    journal_flush(tx, start);
+    committing = 0;
+}
+
+// Waits until transaction seq is durable, committing it if nobody is
+static void journal_wait_for(uint64_t seq) {
+    pthread_mutex_lock(&journal_mutex);
+    while (committed_seq < seq) {
+	if (!committing)
+	    journal_commit_locked();
+	else
+	    pthread_cond_wait(&journal_cond, &journal_mutex);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+// Applies the transactions logged in the journal region, writing each
+// block home in the file, or into the image mapped at img if that is not
+// null. Sets *next to the number the next transaction will have. Returns
+// how many were applied, or -1 on error.
+static int journal_apply(int fd, super_t *s, char *img, uint64_t *next) {
+    long region = (long)s->journal_len * UFS_BLOCK_SIZE;
+    char *log = malloc(region);
+    if (pread(fd, log, region, (long)s->journal_addr * UFS_BLOCK_SIZE) != region) {
+	free(log);
+	return -1;
+    }
+
+    journal_header_t *h = (journal_header_t *)log;
+    uint64_t seq = h->magic == JOURNAL_HEADER_MAGIC ? h->start_seq : 1;
+    int pos = 1, applied = 0;
+    while (pos < s->journal_len) {
+	// Collect the transaction's descriptors, checking each fits
+	int start = pos, nblocks = 0, ok = 0;
+	uint64_t sum = 0;
+	while (pos < s->journal_len) {
+	    journal_desc_t *desc = (journal_desc_t *)(log + (long)pos * UFS_BLOCK_SIZE);
+	    if (desc->magic != JOURNAL_DESC_MAGIC || desc->seq != seq || desc->count > JOURNAL_TAGS ||
+		pos + 1 + desc->count >= s->journal_len)
+		break;
+	    sum = journal_checksum(sum, (char *)desc, (long)(1 + desc->count) * UFS_BLOCK_SIZE);
+	    nblocks += desc->count;
+	    pos += 1 + desc->count;
+	    if (desc->last) {
+		ok = 1;
+		break;
+	    }
+	}
+	// A transaction that changed nothing is just its commit block
+	if (pos == start)
+	    ok = 1;
+	journal_commit_t *commit = (journal_commit_t *)(log + (long)pos * UFS_BLOCK_SIZE);
+	if (!ok || commit->magic != JOURNAL_COMMIT_MAGIC || commit->seq != seq ||
+	    commit->nblocks != nblocks || commit->checksum != sum)
+	    break;
+
+	for (int p = start; p < pos; ) {
+	    journal_desc_t *desc = (journal_desc_t *)(log + (long)p * UFS_BLOCK_SIZE);
+	    for (int i = 0; i < desc->count; i++) {
+		char *copy = log + (long)(p + 1 + i) * UFS_BLOCK_SIZE;
+		long home = (long)desc->home[i] * UFS_BLOCK_SIZE;
+		if (desc->home[i] >= s->journal_addr) {
+		    free(log);
+		    return -1;
+		}
+		if (img) {
+		    memcpy(img + home, copy, UFS_BLOCK_SIZE);
+		} else if (pwrite(fd, copy, UFS_BLOCK_SIZE, home) != UFS_BLOCK_SIZE) {
+		    free(log);
+		    return -1;
+		}
+	    }
+	    p += 1 + desc->count;
+	}
+	applied++;
+	seq++;
+	pos++;
+    }
+    free(log);
+    *next = seq;
+    return applied;
+}
+
+// Applies the transactions logged in the journal region to the image and
+// empties the log. Returns how many were applied, or -1 on error.
+int journal_replay(int fd, super_t *s) {
+    if (s->version < UFS_VERSION_JOURNAL || s->journal_len == 0)
+	return 0;
+    uint64_t seq;
+    int applied = journal_apply(fd, s, 0, &seq);
+    if (applied < 0)
+	return -1;
+
+    journal_fd = fd;
+    journal_sb = *s;
+    if (applied > 0 && fdatasync(fd) != 0)
+	return -1;
+    journal_write_header(seq);
+    replay_seq = seq;
+    return applied;
+}
+
+// Applies the transactions logged in the journal region to the image
+// mapped privately at img, leaving the file as it is, to see the image as
+// a replay would leave it. Returns how many were applied, or -1 on error.
+int journal_replay_private(int fd, super_t *s, char *img) {
+    if (s->version < UFS_VERSION_JOURNAL || s->journal_len == 0)
+	return 0;
+    uint64_t seq;
+    return journal_apply(fd, s, img, &seq);
+}
+
+// Commits the open transaction every period_ms, or sooner once it holds
+// period_blocks blocks, until shutdown
+static void *journal_flusher(void *arg) {
+    pthread_mutex_lock(&journal_mutex);
+    while (1) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	long ns = deadline.tv_nsec + period_ms % 1000 * 1000000L;
+	deadline.tv_sec += period_ms / 1000 + ns / 1000000000L;
+	deadline.tv_nsec = ns % 1000000000L;
+	int rc = 0;
+	while (rc == 0 && __atomic_load_n(&open_tx->count, __ATOMIC_RELAXED) < period_blocks)
+	    rc = pthread_cond_timedwait(&flush_cond, &journal_mutex, &deadline);
+	while (committing)
+	    pthread_cond_wait(&journal_cond, &journal_mutex);
+	if (open_tx->ops > 0)
+	    journal_commit_locked();
+    }
+    return 0;
+}
+
+// Starts tracking updates to the image mapped at img, once replayed. With
+// a journal region they are logged there; otherwise the changed blocks of
+// the shared mapping are written in place. policy says when that happens.
+void journal_init(int fd, char *img, super_t *s, int policy, int ms, int blocks) {
+    journal_enabled = 1;
+    journal_fd = fd;
+    journal_img = img;
+    journal_sb = *s;
+    journal_policy = policy;
+    period_ms = ms;
+    period_blocks = blocks;
+    journal_logged = s->version >= UFS_VERSION_JOURNAL && s->journal_len > 0;
+    if (journal_logged) {
+	journal_nblocks = s->journal_addr;
+	// A transaction's blocks, descriptors and commit fit after the header
+	journal_tx_limit = (long)(s->journal_len - 2) * JOURNAL_TAGS / (JOURNAL_TAGS + 1);
+    } else {
+	journal_nblocks = s->data_region_addr + s->data_region_len;
+	journal_tx_limit = journal_nblocks;
+    }
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&journal_lock, &attr);
+    open_tx = journal_tx_new(replay_seq);
+    committed_seq = replay_seq - 1;
+
+    if (policy == JOURNAL_PERIODIC) {
+	pthread_t flusher;
+	pthread_create(&flusher, NULL, journal_flusher, NULL);
+	pthread_detach(flusher);
+    }
+}
+
+// Starts an update that changes at most max_blocks blocks. If the open
+// transaction lacks room for that many, it is committed first.
+void journal_begin(int max_blocks) {
+    if (!journal_enabled)
+	return;
+    max_blocks = MIN(max_blocks, journal_tx_limit);
+    while (1) {
+	pthread_rwlock_rdlock(&journal_lock);
+	pthread_mutex_lock(&journal_mutex);
+	journal_tx_t *tx = open_tx;
+	int used = tx->reserved + __atomic_load_n(&tx->count, __ATOMIC_RELAXED);
+	if (used == 0 || used + max_blocks <= journal_tx_limit) {
+	    tx->reserved += max_blocks;
+	    held_blocks = max_blocks;
+	    used_blocks = 0;
+	    pthread_mutex_unlock(&journal_mutex);
+	    return;
+	}
+	uint64_t seq = tx->seq;
+	pthread_mutex_unlock(&journal_mutex);
+	pthread_rwlock_unlock(&journal_lock);
+	journal_wait_for(seq);
+    }
+}
+
+// Records that len bytes at ptr in the image have changed; the caller is
+// inside an update
+void journal_dirty(void *ptr, long len) {
+    if (!journal_enabled || len <= 0)
+	return;
+    journal_tx_t *tx = open_tx;
+    long first = ((char *)ptr - journal_img) / UFS_BLOCK_SIZE;
+    long last = ((char *)ptr + len - 1 - journal_img) / UFS_BLOCK_SIZE;
+    for (long b = first; b <= last; b++) {
+	uint8_t bit = 1 << (b % 8);
+	if (__atomic_fetch_or(&tx->dirty[b / 8], bit, __ATOMIC_RELAXED) & bit)
+	    continue;
+	used_blocks++;
+	int i = __atomic_fetch_add(&tx->count, 1, __ATOMIC_RELAXED);
+	if (i >= tx->cap) {
+	    fprintf(stderr, "journal: update changed more blocks than it reserved\n");
+	    abort();
+	}
+	tx->blocks[i] = b;
+    }
+}
+
+// Returns how many more blocks the calling thread's update may change
+// before it has used up what it reserved, so that an update whose size
+// depends on what it finds can refuse rather than overrun the transaction
+int journal_room() {
+    if (!journal_enabled)
+	return INT_MAX;
+    return held_blocks - used_blocks;
+}
+
+// Ends an update; the calling thread's next journal_wait covers it
+void journal_end() {
+    if (!journal_enabled)
+	return;
+    pthread_mutex_lock(&journal_mutex);
+    open_tx->reserved -= held_blocks;
+    open_tx->ops++;
+    pending_seq = MAX(pending_seq, open_tx->seq);
+    if (journal_policy == JOURNAL_PERIODIC && open_tx->count >= period_blocks)
+	pthread_cond_signal(&flush_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_rwlock_unlock(&journal_lock);
+}
+
+// Ends the calling thread's update for now, so that it can run updates of
+// its own first; journal_resume begins it again with the room it had
+// reserved, in what may be a later transaction. The caller holds no inode
+// locks in between.
+void journal_pause() {
+    paused_blocks = held_blocks;
+    journal_end();
+}
+
+void journal_resume() {
+    journal_begin(paused_blocks);
+}
+
+// Makes the calling thread's next journal_wait cover every update ended so
+// far, such as the one a cached reply was saved for
+void journal_depend() {
+    if (!journal_enabled)
+	return;
+    pthread_mutex_lock(&journal_mutex);
+    pending_seq = MAX(pending_seq, open_tx->seq);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+// Waits until the updates the calling thread ended or depends on are
+// durable, if the policy has replies wait for that
+void journal_wait() {
+    if (!journal_enabled || pending_seq == 0)
+	return;
+    if (journal_policy == JOURNAL_SYNC)
+	journal_wait_for(pending_seq);
+    pending_seq = 0;
+}
+
+// Lets the updates in progress end, keeps any more from starting, and
+// makes everything durable, writing logged blocks home so the log is
+// empty. The caller exits afterwards; threads waiting on a commit are
+// released, but no commit follows this one.
+void journal_shutdown() {
+    if (!journal_enabled)
+	return;
+    pthread_mutex_lock(&journal_mutex);
+    while (committing)
+	pthread_cond_wait(&journal_cond, &journal_mutex);
+    committing = 1;
+    pthread_mutex_unlock(&journal_mutex);
+    long start = journal_now_us();
+
+    pthread_rwlock_wrlock(&journal_lock);
+    closing = 1;
+    journal_tx_t *tx = journal_close();
+    uint64_t next_seq = tx->seq + 1;
+    journal_flush(tx, start);
+    pthread_mutex_unlock(&journal_mutex);
+    if (journal_logged)
+	journal_checkpoint(next_seq, 0);
+}
+
+void journal_report(FILE *f) {
+    if (!journal_enabled)
+	return;
+    pthread_mutex_lock(&journal_mutex);
+    long commits = MAX(stat_commits, 1);
+    if (journal_logged)
+	fprintf(f, "journal: %ld commits, %.1f updates and %.1f blocks per commit, "
+		"commit latency %ld us average %ld us max, %ld checkpoints\n",
+		stat_commits, (double)stat_ops / commits, (double)stat_blocks / commits,
+		stat_commit_us / commits, stat_max_commit_us, stat_checkpoints);
+    else
+	fprintf(f, "flush: %ld flushes, %.1f updates, %.1f blocks and %.1f ranges per flush, "
+		"flush latency %ld us average %ld us max\n",
+		stat_commits, (double)stat_ops / commits, (double)stat_blocks / commits,
+		(double)stat_ranges / commits, stat_commit_us / commits, stat_max_commit_us);
+    pthread_mutex_unlock(&journal_mutex);
+}
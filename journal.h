@@ -0,0 +1,78 @@
+#ifndef __journal_h__
+#define __journal_h__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ufs.h"
+
+// Write-ahead journal for images with a journal region. The server maps
+// such an image privately, so changes reach the file only through here.
+// Each update runs between journal_begin and journal_end and marks what it
+// changes with journal_dirty. Updates that end while one commit is being
+// written are gathered into the next: their blocks are copied, logged with
+// a checksummed commit block and made durable with a single fdatasync.
+// journal_wait holds the calling thread until everything it ended (or
+// depends on) is durable, so replies only ever report durable updates.
+// Logged blocks are written to their home locations when the journal
+// fills up and at shutdown; journal_replay applies whatever a crash left
+// logged but not yet written home. Images without a journal region are
+// mapped shared and a commit instead msyncs the blocks changed since the
+// last one, in place and with no ordering between them.
+
+// When commits happen. Under JOURNAL_SYNC replies wait for their updates
+// to be durable. Under JOURNAL_PERIODIC they do not, and a flusher thread
+// commits every flush_ms or once flush_blocks blocks have changed. Under
+// JOURNAL_NONE commits happen only when the log fills and at shutdown.
+#define JOURNAL_SYNC     (0)
+#define JOURNAL_PERIODIC (1)
+#define JOURNAL_NONE     (2)
+
+// On-disk layout: block 0 of the region holds a header, transactions
+// follow from block 1. A transaction is one or more descriptors, each
+// followed by copies of the blocks it lists, and then a commit block whose
+// checksum covers the descriptors and copies. Replay starts at the
+// header's start_seq and stops at the first transaction that is
+// incomplete or out of sequence.
+#define JOURNAL_HEADER_MAGIC (0x4a484452)
+#define JOURNAL_DESC_MAGIC   (0x4a444553)
+#define JOURNAL_COMMIT_MAGIC (0x4a434d54)
+#define JOURNAL_TAGS         ((UFS_BLOCK_SIZE - 24) / 4)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t start_seq;   // first transaction not yet written home
+} journal_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;       // blocks listed in home
+    uint64_t seq;
+    uint32_t last;        // the commit block follows this descriptor's copies
+    uint32_t unused;
+    uint32_t home[JOURNAL_TAGS];
+} journal_desc_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t nblocks;     // block copies in the transaction
+    uint64_t seq;
+    uint64_t checksum;
+} journal_commit_t;
+
+int journal_replay(int fd, super_t *s);
+int journal_replay_private(int fd, super_t *s, char *img);
+void journal_init(int fd, char *img, super_t *s, int policy, int flush_ms, int flush_blocks);
+void journal_begin(int max_blocks);
+void journal_dirty(void *ptr, long len);
+int journal_room();
+void journal_end();
+void journal_pause();
+void journal_resume();
+void journal_depend();
+void journal_wait();
+void journal_shutdown();
+void journal_report(FILE *f);
+
+#endif // __journal_h__
@@ -1,32 +1,1143 @@
 #include <sys/select.h>
 #include <time.h>
+#include <unistd.h>
 #include <stdio.h>
 #include "message.h"
 #include "mfs.h"
 #include "udp.h"
+#include "mcache.h"
+#include "bcache.h"
+#include <sys/param.h>
 
-struct sockaddr_in addrSnd,addrRcv;
+struct sockaddr_in servers[MFS_MAX_SERVERS], addrRcv;
+int nservers = 1;
 int sd;
 int server_stat = 0;
+int wire_version = 1;  // negotiated in MFS_Init, the oldest of the servers'
+uint32_t next_reqid = 0;
+
+// Namespace sharding (see MFS_InitServers). The inode numbers callers see
+// are global: the index of the server holding the inode from bit
+// MFS_SERVER_SHIFT up, its number on that server below, so that with one
+// server they are the server's own.
+static int shard_of(int inum){
+    return inum >> MFS_SERVER_SHIFT;
+}
+
+static int shard_local(int inum){
+    return inum & ((1 << MFS_SERVER_SHIFT) - 1);
+}
+
+// Makes an inode number from a server's reply global. A directory entry
+// for an inode on another server already holds its global number.
+static int shard_global(int server, int inum){
+    if(inum < 0){
+        return inum;
+    }
+    if(inum & MFS_REMOTE){
+        return inum & ~MFS_REMOTE;
+    }
+    return server << MFS_SERVER_SHIFT | inum;
+}
+
+// Picks the server for a new entry of directory pinum: one for all of the
+// directory's entries, spread by a hash of its number
+static int shard_place(int pinum){
+    return ((uint32_t)pinum * 2654435761u >> 8) % nservers;
+}
+
+// Replicas (see MFS_InitReplicas): the primary first, then its backups.
+// Reads any of them can answer go to each in turn.
+struct sockaddr_in replicas[MFS_MAX_SERVERS];
+int nreplicas = 0;
+int next_replica = 0;
+
+// Metadata caching (see MFS_EnableCache). The generation counts the local
+// updates that dropped cache entries, so a reply to a call started before
+// one of them is not cached.
+int cache_enabled = 0;
+long cache_generation = 0;
+
+// Retransmission timer, in microseconds: a Jacobson/Karels estimate of the
+// round trip time, backed off exponentially for each retransmission
+#define MIN_RTO_US     (10000)
+#define MAX_RTO_US     (1000000)
+#define INITIAL_RTO_US (100000)
+
+long srtt_us = 0;               // smoothed round trip time, 0 until sampled
+long rttvar_us = 0;             // round trip time variation
+long rto_us = INITIAL_RTO_US;   // timeout for a first transmission
+long call_timeout_us = 5000000; // give up on a call after this long
+
+static long now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Folds a round trip sample into the estimate
+static void rtt_sample(long rtt){
+    if(srtt_us == 0){
+        srtt_us = rtt;
+        rttvar_us = rtt / 2;
+    } else {
+        long err = rtt - srtt_us;
+        srtt_us += err / 8;
+        rttvar_us += ((err < 0 ? -err : err) - rttvar_us) / 4;
+    }
+    rto_us = MIN(MAX(srtt_us + 4 * rttvar_us, MIN_RTO_US), MAX_RTO_US);
+}
+
+// Waits up to timeout microseconds for the socket to become readable
+static int wait_readable(long timeout){
+    struct timeval tv = { timeout / 1000000, timeout % 1000000 };
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sd, &fds);
+    return select(sd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+// Fragments sent, or asked for, per round trip of a bulk transfer: the
+// window starts at BULK_INITIAL_WINDOW, doubles after every round that lost
+// nothing up to BULK_WINDOW, and halves after a loss, so bursts stay within
+// what the path buffers
+#define BULK_WINDOW (16)
+#define BULK_INITIAL_WINDOW (4)
+#define BULK_DATAGRAM (sizeof(mfs_hdr_t) + sizeof(mfs_frag_t) + MFS_FRAG_SIZE)
+
+// A bulk transfer in flight (see message.h). have records the fragments the
+// receiving side holds, so each round sends or asks for only missing ones.
+typedef struct {
+    char *data;          // the caller's buffer
+    int nfrags;
+    uint8_t have[MFS_MAX_FRAGS / 8];
+    int missing;         // fragments not yet read
+    int window;          // fragments per round
+    int sent;            // fragments sent or asked for this round
+    int got;             // of those, how many arrived
+    int lost;            // the round timed out
+    int moved;           // a datagram of the transfer has arrived
+    int round_done;      // time to send the next round
+    char *scratch;       // BULK_WINDOW datagrams, for writes
+} bulk_t;
+
+// A request that has been sent and not yet collected with call_finish.
+// Replies are matched to calls by request id, so any number can be in
+// flight and they may complete in any order. The request is kept so it can
+// be retransmitted with the same id, which lets the server recognize it.
+typedef struct {
+    int busy;           // slot holds a request
+    int done;           // its reply has arrived (or the call timed out)
+    uint32_t reqid;
+    mfs_hdr_t reply;    // reply header, once done
+    char *out;          // where to copy the reply payload
+    int max;            // size of out
+    MFS_Stat_t *stat;   // where to store the result of an MFS_STAT
+    char *request;      // the datagram, for retransmission
+    int request_len;
+    int retries;        // retransmissions so far
+    long sent_at;       // time of the first transmission
+    long resend_at;     // time of the next retransmission
+    long rto;           // current (backed off) timeout
+    bulk_t *bulk;       // set for a bulk transfer
+    long generation;    // cache_generation when the call started
+    int server;         // the server holding the inode it names
+    struct sockaddr_in *to;  // where the request went
+} call_t;
+
+call_t calls[MFS_MAX_INFLIGHT];
+
+// Marks a call that got no reply before its deadline as failed
+static void call_expire(call_t *call){
+    bzero(&call->reply, sizeof(mfs_hdr_t));
+    call->reply.rc = -1;
+    call->done = 1;
+}
+
+// Sends a legacy message_t for an old server and waits for the reply,
+// which fills in the call directly. Old servers keep no reply cache, so a
+// retransmitted update may be applied twice.
+static int legacy_rpc(call_t *call, mfs_hdr_t *req, char *payload){
+    message_t message;
+    bzero(&message, sizeof(message_t));
+    message.mtype = req->mtype;
+    message.inum = req->inum;
+    message.offset = req->offset;
+    message.nbytes = req->nbytes;
+    message.type = req->type;
+    if(req->mtype == MFS_WRITE){
+        memcpy(message.buffer, payload, MIN(req->len, sizeof(message.buffer)));
+    } else if(req->len > 0){
+        strncpy(message.name, payload, sizeof(message.name) - 1);
+    }
+
+    long start = now_us(), rto = rto_us;
+    message_t reply;
+    int rc;
+    do {
+        if(now_us() - start > call_timeout_us){
+            call_expire(call);
+            return 0;
+        }
+        rc = UDP_Write(sd, call->to, (char *)&message, sizeof(message_t));
+        if(rc < 0){
+            return -1;
+        }
+        rc = wait_readable(rto) ? UDP_Read(sd, &addrRcv, (char *)&reply, sizeof(message_t)) : -1;
+        rto = MIN(2 * rto, MAX_RTO_US);
+    } while(rc < (int)sizeof(message_t));
+
+    call->reply = *req;
+    call->reply.rc = reply.rc;
+    call->reply.inum = reply.inum;
+    call->reply.type = reply.type;
+    call->reply.nbytes = reply.nbytes;
+    if(req->mtype == MFS_READ && call->out != NULL){
+        memcpy(call->out, reply.buffer, MIN(call->max, sizeof(reply.buffer)));
+    }
+    call->done = 1;
+    return 0;
+}
+
+// Picks a free call slot and gives the request its id. Returns the slot's
+// handle, or -1 if too many calls are in flight.
+static int call_alloc(mfs_hdr_t *req, char *out, int max){
+    int handle = 0;
+    while(handle < MFS_MAX_INFLIGHT && calls[handle].busy){
+        handle++;
+    }
+    if(handle == MFS_MAX_INFLIGHT){
+        return -1;
+    }
+
+    call_t *call = &calls[handle];
+    req->magic = MFS_WIRE_MAGIC;
+    req->version = MFS_WIRE_VERSION;
+    req->reqid = next_reqid++;
+    call->reqid = req->reqid;
+    call->done = 0;
+    call->out = out;
+    call->max = max;
+    call->stat = NULL;
+    call->request = NULL;
+    call->bulk = NULL;
+    call->generation = cache_generation;
+    call->server = 0;
+    call->to = &servers[0];
+    return handle;
+}
+
+// Returns whether every call slot is in use, so no call can start until
+// one is finished
+static int calls_full(){
+    for(int i = 0; i < MFS_MAX_INFLIGHT; i++){
+        if(!calls[i].busy){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sends a request to the server holding the inode its inum names (the
+// first if it names none), turning inum into that server's own number.
+// Returns the server's index, or -1 if there is no such server.
+static int route(mfs_hdr_t *req){
+    if(req->inum < 0){
+        return 0;
+    }
+    int server = shard_of(req->inum);
+    if(server >= nservers){
+        return -1;
+    }
+    req->inum = shard_local(req->inum);
+    return server;
+}
+
+// Picks where a request for server goes: a read that any replica can
+// answer to the next replica in turn, anything else to the server
+static struct sockaddr_in *destination(int server, mfs_hdr_t *req){
+    int mtype = req->mtype;
+    if(nreplicas > 1 && (mtype == MFS_READ || mtype == MFS_STAT || mtype == MFS_LOOKUP ||
+                         mtype == MFS_LOOKUPPATH || mtype == MFS_BREAD)){
+        return &replicas[next_replica++ % nreplicas];
+    }
+    return &servers[server];
+}
+
+// Completes a call at once with a result from the cache
+static int call_cached(mfs_hdr_t *req){
+    int handle = call_alloc(req, NULL, 0);
+    if(handle < 0){
+        return -1;
+    }
+    calls[handle].reply = *req;
+    calls[handle].done = 1;
+    calls[handle].busy = 1;
+    return handle;
+}
+
+// Caches the result of a lookup or stat for the lease the server granted
+static void cache_reply(call_t *call){
+    mfs_hdr_t *req = (mfs_hdr_t *)call->request;
+    mfs_hdr_t *reply = &call->reply;
+    if(req == NULL || reply->mtype != req->mtype || reply->offset <= 0 ||
+       call->generation != cache_generation){
+        return;
+    }
+    long expires = call->sent_at + reply->offset * 1000L;
+    int inum = shard_global(call->server, req->inum);
+    if(req->mtype == MFS_LOOKUP){
+        char *name = call->request + sizeof(mfs_hdr_t);
+        mcache_put_lookup(inum, name, reply->rc == 0 ? reply->inum : -1, expires);
+    } else if(req->mtype == MFS_STAT && reply->rc == 0){
+        MFS_Stat_t m = { reply->type, reply->nbytes };
+        mcache_put_stat(inum, &m, expires);
+    }
+}
+
+// Drops what a local update to an inode makes stale
+static void cache_invalidate_stat(int inum){
+    cache_generation++;
+    mcache_drop_stat(inum);
+}
+
+// Drops what creating a name in a directory makes stale: the name may be
+// cached as missing, and the directory grows
+static void cache_invalidate_create(int pinum, char *name){
+    cache_invalidate_stat(pinum);
+    mcache_drop_lookup(pinum, name);
+}
+
+// Sends the next round of a bulk transfer. For a write that is up to a
+// window of fragments the server lacks, the last flagged to ask for the
+// server's progress; when probe is set (after a timeout) only that last
+// one goes. For a read it is a request naming up to a window of fragments
+// still missing.
+static void bulk_send(call_t *call, int probe){
+    bulk_t *bulk = call->bulk;
+    mfs_hdr_t *req = (mfs_hdr_t *)call->request;
+    if(probe){
+        bulk->window = MAX(bulk->window / 2, 1);
+        bulk->lost = 1;
+    }
+    int wanted[BULK_WINDOW], n = 0;
+    for(int i = 0; i < bulk->nfrags && n < bulk->window; i++){
+        if(!MFS_FRAG_HAS(bulk->have, i)){
+            wanted[n++] = i;
+        }
+    }
+
+    if(req->mtype == MFS_BREAD){
+        char datagram[sizeof(mfs_hdr_t) + sizeof(mfs_frag_t)];
+        mfs_hdr_t *hdr = (mfs_hdr_t *)datagram;
+        mfs_frag_t *frag = (mfs_frag_t *)(datagram + sizeof(mfs_hdr_t));
+        *hdr = *req;
+        hdr->len = sizeof(mfs_frag_t);
+        bzero(frag, sizeof(mfs_frag_t));
+        for(int i = 0; i < n; i++){
+            MFS_FRAG_SET(frag->bits, wanted[i]);
+        }
+        bulk->sent = n;
+        bulk->got = 0;
+        UDP_Write(sd, call->to, datagram, sizeof(datagram));
+        return;
+    }
+
+    // Once the server holds everything, keep asking until the reply comes
+    if(n == 0){
+        wanted[n++] = bulk->nfrags - 1;
+    }
+    struct sockaddr_in addrs[BULK_WINDOW];
+    char *datagrams[BULK_WINDOW];
+    int lens[BULK_WINDOW], count = 0;
+    for(int i = probe ? n - 1 : 0; i < n; i++){
+        char *datagram = bulk->scratch + count * BULK_DATAGRAM;
+        mfs_hdr_t *hdr = (mfs_hdr_t *)datagram;
+        mfs_frag_t *frag = (mfs_frag_t *)(datagram + sizeof(mfs_hdr_t));
+        int len = MIN(MFS_FRAG_SIZE, req->nbytes - wanted[i] * MFS_FRAG_SIZE);
+        *hdr = *req;
+        hdr->len = sizeof(mfs_frag_t) + len;
+        bzero(frag, sizeof(mfs_frag_t));
+        frag->index = wanted[i];
+        frag->flags = i == n - 1 ? MFS_FRAG_PROBE : 0;
+        memcpy(datagram + sizeof(mfs_hdr_t) + sizeof(mfs_frag_t),
+               bulk->data + wanted[i] * MFS_FRAG_SIZE, len);
+        addrs[count] = *call->to;
+        datagrams[count] = datagram;
+        lens[count] = sizeof(mfs_hdr_t) + hdr->len;
+        count++;
+    }
+    if(!probe){
+        bulk->sent = count;
+        bulk->got = 0;
+    }
+    UDP_WriteBatch(sd, addrs, datagrams, lens, count);
+}
+
+// Takes in a datagram of a bulk transfer: a fragment of read data or the
+// server's progress on a write. Returns 0 if it completes the call.
+static int bulk_receive(call_t *call, mfs_hdr_t *reply, char *payload){
+    bulk_t *bulk = call->bulk;
+    mfs_hdr_t *req = (mfs_hdr_t *)call->request;
+    if(reply->len < sizeof(mfs_frag_t)){
+        return 0;
+    }
+    mfs_frag_t *frag = (mfs_frag_t *)payload;
+    if(reply->mtype == MFS_BWRITE && reply->rc == MFS_BULK_PARTIAL){
+        for(int i = 0; i < sizeof(bulk->have); i++){
+            bulk->got += __builtin_popcount(frag->bits[i] & ~bulk->have[i]);
+            bulk->have[i] |= frag->bits[i];
+        }
+        bulk->round_done = 1;
+    } else if(reply->mtype == MFS_BREAD && reply->rc == 0){
+        int len = MIN(MFS_FRAG_SIZE, req->nbytes - frag->index * MFS_FRAG_SIZE);
+        if(frag->index >= bulk->nfrags || reply->len != sizeof(mfs_frag_t) + len){
+            return 1;
+        }
+        if(!MFS_FRAG_HAS(bulk->have, frag->index)){
+            memcpy(bulk->data + frag->index * MFS_FRAG_SIZE, payload + sizeof(mfs_frag_t), len);
+            MFS_FRAG_SET(bulk->have, frag->index);
+            bulk->got++;
+            if(--bulk->missing == 0){
+                return 0;
+            }
+            bulk->round_done = bulk->got >= bulk->sent;
+        }
+    } else {
+        return 0;
+    }
+    // Progress on the transfer moves its deadline
+    bulk->moved = 1;
+    call->sent_at = now_us();
+    return 1;
+}
+
+// Sends a request to a server without waiting for the reply, in the
+// negotiated wire format. Up to max bytes of the reply payload will be copied
+// to out when it arrives. Returns the call's handle, or -1 if too many calls
+// are in flight or the request could not be sent.
+static int call_start_at(int server, mfs_hdr_t *req, char *payload, char *out, int max){
+    int handle = call_alloc(req, out, max);
+    if(handle < 0){
+        return -1;
+    }
+    call_t *call = &calls[handle];
+    call->server = server;
+    call->to = destination(server, req);
+
+    if(wire_version < MFS_WIRE_VERSION){
+        // Old servers carry no request id, so the call completes right here
+        if(legacy_rpc(call, req, payload) < 0){
+            return -1;
+        }
+        call->busy = 1;
+        return handle;
+    }
+
+    call->request_len = sizeof(mfs_hdr_t) + req->len;
+    call->request = malloc(call->request_len);
+    memcpy(call->request, req, sizeof(mfs_hdr_t));
+    memcpy(call->request + sizeof(mfs_hdr_t), payload, req->len);
+    int rc = UDP_Write(sd, call->to, call->request, call->request_len);
+    if(rc < 0){
+        free(call->request);
+        return -1;
+    }
+    call->retries = 0;
+    call->rto = rto_us;
+    call->sent_at = now_us();
+    call->resend_at = call->sent_at + call->rto;
+    call->busy = 1;
+    return handle;
+}
+
+// Sends a request to the server holding the inode it names (see route)
+static int call_start(mfs_hdr_t *req, char *payload, char *out, int max){
+    int server = route(req);
+    if(server < 0){
+        return -1;
+    }
+    return call_start_at(server, req, payload, out, max);
+}
+
+// Retransmits every call whose timer has run out, doubling its timeout, and
+// fails calls that are past the overall deadline. Returns the time of the
+// next retransmission due, or -1 if nothing is waiting for a reply.
+static long call_retransmit(){
+    long now = now_us(), next = -1;
+    for(int i = 0; i < MFS_MAX_INFLIGHT; i++){
+        call_t *call = &calls[i];
+        if(!call->busy || call->done){
+            continue;
+        }
+        if(now - call->sent_at >= call_timeout_us){
+            call_expire(call);
+            continue;
+        }
+        if(now >= call->resend_at){
+            if(call->bulk){
+                bulk_send(call, 1);
+            } else {
+                UDP_Write(sd, call->to, call->request, call->request_len);
+            }
+            call->retries++;
+            call->rto = MIN(2 * call->rto, MAX_RTO_US);
+            call->resend_at = now + call->rto;
+        }
+        long due = MIN(call->resend_at, call->sent_at + call_timeout_us);
+        if(next < 0 || due < next){
+            next = due;
+        }
+    }
+    return next;
+}
+
+// Reads one datagram and completes the call it answers. If block is set,
+// waits for one to arrive, retransmitting requests as their timers expire.
+// Returns 1 if a datagram was read, 0 if not.
+static int call_receive(int block){
+    long next = call_retransmit();
+    if(!block || next < 0){
+        if(!wait_readable(0)){
+            return 0;
+        }
+    } else if(!wait_readable(MAX(next - now_us(), 0))){
+        return 0;
+    }
+
+    char buffer[MFS_MAX_DATAGRAM];
+    mfs_hdr_t *reply = (mfs_hdr_t *)buffer;
+    int rc = UDP_Read(sd, &addrRcv, buffer, sizeof(buffer));
+    if(rc < (int)sizeof(mfs_hdr_t) || reply->magic != MFS_WIRE_MAGIC ||
+       sizeof(mfs_hdr_t) + reply->len > rc){
+        return 1;
+    }
+
+    // Replies to calls that are no longer in flight are dropped
+    for(int i = 0; i < MFS_MAX_INFLIGHT; i++){
+        call_t *call = &calls[i];
+        if(call->busy && !call->done && call->reqid == reply->reqid){
+            if(call->bulk && bulk_receive(call, reply, buffer + sizeof(mfs_hdr_t))){
+                break;
+            }
+            call->reply = *reply;
+            call->reply.inum = shard_global(call->server, reply->inum);
+            if(call->out != NULL){
+                memcpy(call->out, buffer + sizeof(mfs_hdr_t), MIN(call->max, reply->len));
+            }
+            call->done = 1;
+            // Karn: a reply to a retransmitted request is no RTT sample
+            if(call->retries == 0 && call->bulk == NULL){
+                rtt_sample(now_us() - call->sent_at);
+            }
+            break;
+        }
+    }
+    return 1;
+}
+
+// Waits for the reply to a call and releases its handle. On return reply
+// holds the reply header. Returns the reply's rc, or -1 for a bad handle or
+// a call that timed out.
+static int call_finish(int handle, mfs_hdr_t *reply){
+    if(handle < 0 || handle >= MFS_MAX_INFLIGHT || !calls[handle].busy){
+        return -1;
+    }
+    while(!calls[handle].done){
+        call_receive(1);
+    }
+    if(cache_enabled){
+        cache_reply(&calls[handle]);
+    }
+    *reply = calls[handle].reply;
+    free(calls[handle].request);
+    calls[handle].busy = 0;
+    return reply->rc;
+}
+
+// Sends a request to the server and waits for its reply. On return req
+// holds the reply header and up to max bytes of the reply payload have been
+// copied to out. Returns the reply's rc, or -1 if the request failed.
+static int rpc(mfs_hdr_t *req, char *payload, char *out, int max){
+    int handle = call_start(req, payload, out, max);
+    if(handle < 0){
+        return -1;
+    }
+    return call_finish(handle, req);
+}
+
+// Like rpc, to the given server
+static int rpc_at(int server, mfs_hdr_t *req, char *payload, char *out, int max){
+    int handle = call_start_at(server, req, payload, out, max);
+    if(handle < 0){
+        return -1;
+    }
+    return call_finish(handle, req);
+}
+
+// Moves nbytes between buffer and a file one block per call, for servers
+// without bulk transfers
+static int block_rpc(int mtype, int inum, char *buffer, int offset, int nbytes){
+    for(int done = 0; done < nbytes; done += MFS_BLOCK_SIZE){
+        mfs_hdr_t req;
+        bzero(&req, sizeof(mfs_hdr_t));
+        req.mtype = mtype;
+        req.inum = inum;
+        req.offset = offset + done;
+        req.nbytes = MIN(MFS_BLOCK_SIZE, nbytes - done);
+        int rc;
+        if(mtype == MFS_WRITE){
+            req.len = req.nbytes;
+            rc = rpc(&req, buffer + done, NULL, 0);
+        } else {
+            rc = rpc(&req, NULL, buffer + done, req.nbytes);
+        }
+        if(rc != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Runs a bulk transfer (mtype MFS_BREAD or MFS_BWRITE) to completion, one
+// round of fragments at a time. Returns the reply's rc, or -1 on failure.
+static int bulk_rpc(int mtype, int inum, char *buffer, int offset, int nbytes){
+    if(inum < 0 || offset < 0 || nbytes <= 0 || nbytes > MFS_MAX_BULK || !server_stat){
+        return -1;
+    }
+    if(wire_version < MFS_WIRE_VERSION){
+        return block_rpc(mtype == MFS_BWRITE ? MFS_WRITE : MFS_READ, inum, buffer, offset, nbytes);
+    }
+
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = mtype;
+    req.inum = inum;
+    req.offset = offset;
+    req.nbytes = nbytes;
+    int server = route(&req);
+    int handle = server < 0 ? -1 : call_alloc(&req, NULL, 0);
+    if(handle < 0){
+        return -1;
+    }
+
+    bulk_t bulk;
+    bzero(&bulk, sizeof(bulk_t));
+    bulk.data = buffer;
+    bulk.nfrags = (nbytes - 1) / MFS_FRAG_SIZE + 1;
+    bulk.missing = bulk.nfrags;
+    bulk.window = BULK_INITIAL_WINDOW;
+    if(mtype == MFS_BWRITE){
+        bulk.scratch = malloc(BULK_WINDOW * BULK_DATAGRAM);
+    }
+
+    call_t *call = &calls[handle];
+    call->request_len = sizeof(mfs_hdr_t);
+    call->request = malloc(call->request_len);
+    memcpy(call->request, &req, sizeof(mfs_hdr_t));
+    call->bulk = &bulk;
+    call->server = server;
+    call->to = destination(server, &req);
+    call->retries = 0;
+    call->rto = rto_us;
+    call->sent_at = now_us();
+    call->resend_at = call->sent_at + call->rto;
+    call->busy = 1;
+    bulk_send(call, 0);
+
+    // Each round goes out once the last one is answered; while data keeps
+    // arriving the retransmission timer is held off
+    while(!call->done){
+        bulk.moved = 0;
+        call_receive(1);
+        if(bulk.round_done){
+            if(!bulk.lost && bulk.got >= bulk.sent){
+                bulk.window = MIN(2 * bulk.window, BULK_WINDOW);
+            } else if(!bulk.lost){
+                bulk.window = MAX(bulk.window / 2, 1);
+            }
+            bulk.round_done = 0;
+            bulk.lost = 0;
+            bulk_send(call, 0);
+            call->rto = rto_us;
+            call->resend_at = now_us() + call->rto;
+        } else if(bulk.moved){
+            call->resend_at = now_us() + call->rto;
+        }
+    }
+
+    int rc = call_finish(handle, &req);
+    free(bulk.scratch);
+    return rc;
+}
+
+// Block caching (see MFS_SetBlockCache). Dirty blocks are sent once the
+// oldest is BCACHE_WRITEBACK_US old. A file read in sequence prefetches a
+// window of blocks that starts at BCACHE_MIN_READAHEAD and doubles with
+// every sequential read up to BCACHE_MAX_READAHEAD; BCACHE_STREAMS files
+// are followed at once.
+#define BCACHE_WRITEBACK_US  (1000000)
+#define BCACHE_MIN_READAHEAD (2)
+#define BCACHE_MAX_READAHEAD (32)
+#define BCACHE_STREAMS       (8)
+#define BCACHE_FAILED        (16)
+
+typedef struct {
+    int inum;           // -1 if unused
+    int next;           // offset where a sequential read would start
+    int window;         // blocks to prefetch, 0 if not sequential
+    long used;
+} stream_t;
+
+stream_t streams[BCACHE_STREAMS];
+bcache_block_t *prefetching[MFS_MAX_INFLIGHT];  // blocks with a read-ahead in flight
+int nprefetching = 0;
+long dirty_since = 0;                 // when the oldest dirty block was written
+int failed_inums[BCACHE_FAILED];      // files whose held-back writes failed
+int nfailed = 0;
+MFS_CacheStats_t block_counters;
+
+static int block_cache_on(){
+    return bcache_capacity() > 0 && wire_version >= MFS_WIRE_VERSION;
+}
+
+// Finishes the read-ahead filling a block
+static void block_settle(bcache_block_t *b){
+    if(b->pending < 0){
+        return;
+    }
+    int handle = b->pending;
+    long sent_at = calls[handle].sent_at;
+    mfs_hdr_t reply;
+    b->pending = -1;
+    for(int i = 0; i < nprefetching; i++){
+        if(prefetching[i] == b){
+            prefetching[i] = prefetching[--nprefetching];
+            break;
+        }
+    }
+    if(call_finish(handle, &reply) == 0){
+        b->len = reply.nbytes;
+        b->expires = sent_at + reply.offset * 1000L;
+    }
+}
+
+// Finishes the read-aheads whose replies have arrived
+static void block_reap(){
+    for(int i = nprefetching - 1; i >= 0; i--){
+        if(calls[prefetching[i]->pending].done){
+            block_settle(prefetching[i]);
+        }
+    }
+}
+
+// Returns whether bytes a..e of a block are known, from the server under
+// a lease or from local writes
+static int block_covers(bcache_block_t *b, int a, int e, long now){
+    if(a >= b->lo && e <= b->hi){
+        return 1;
+    }
+    int known = now < b->expires ? b->len : 0;
+    if(b->lo < b->hi && b->lo <= known){
+        known = MAX(known, b->hi);
+    }
+    return e <= known;
+}
+
+static void block_failed(int inum){
+    for(int i = 0; i < nfailed; i++){
+        if(failed_inums[i] == inum){
+            return;
+        }
+    }
+    if(nfailed < BCACHE_FAILED){
+        failed_inums[nfailed++] = inum;
+    }
+}
+
+// Collects the replies to n writes of held-back blocks, each block's
+// writes being cleared once answered. Returns -1 if any of them failed.
+static int block_finish(int *handles, bcache_block_t **sent, int n){
+    int rc = 0;
+    for(int j = 0; j < n; j++){
+        mfs_hdr_t reply;
+        bcache_block_t *b = sent[j];
+        if(call_finish(handles[j], &reply) != 0){
+            block_failed(b->inum);
+            rc = -1;
+        }
+        // What was written is now known to be on the server
+        if(b->lo <= b->len){
+            b->len = MAX(b->len, b->hi);
+        }
+        b->lo = b->hi = 0;
+    }
+    return rc;
+}
+
+// Sends the held-back writes of a file, or of every file if inum is -1,
+// several at a time. A block that cannot be sent for want of a free call
+// (the application holds them all) stays held back for a later flush.
+// Returns -1 if any write failed or could not be sent.
+static int block_flush(int inum){
+    int handles[MFS_MAX_INFLIGHT];
+    bcache_block_t *sent[MFS_MAX_INFLIGHT];
+    int n = 0, rc = 0, all_clean = 1;
+    for(int i = 0; i <= bcache_capacity(); i++){
+        bcache_block_t *b = i < bcache_capacity() ? bcache_block(i) : NULL;
+        int flushable = b && b->inum >= 0 && b->lo < b->hi && (inum < 0 || b->inum == inum);
+        if(b && b->inum >= 0 && b->lo < b->hi && !flushable){
+            all_clean = 0;
+        }
+        // Collect the replies when the batch is full, or at the end
+        if(n > 0 && (b == NULL || n == MFS_MAX_INFLIGHT / 2)){
+            if(block_finish(handles, sent, n) != 0){
+                rc = -1;
+            }
+            n = 0;
+        }
+        if(!flushable){
+            continue;
+        }
+
+        mfs_hdr_t req;
+        bzero(&req, sizeof(mfs_hdr_t));
+        req.mtype = MFS_WRITE;
+        req.inum = b->inum;
+        req.offset = b->block * MFS_BLOCK_SIZE + b->lo;
+        req.nbytes = b->hi - b->lo;
+        req.len = req.nbytes;
+        cache_invalidate_stat(b->inum);
+        mfs_hdr_t retry = req;
+        int handle = call_start(&req, b->data + b->lo, NULL, 0);
+        if(handle < 0 && n > 0){
+            // The calls in hand may be what fills the table
+            if(block_finish(handles, sent, n) != 0){
+                rc = -1;
+            }
+            n = 0;
+            handle = call_start(&retry, b->data + b->lo, NULL, 0);
+        }
+        if(handle < 0 && calls_full()){
+            all_clean = 0;
+            rc = -1;
+            continue;
+        }
+        if(handle < 0){
+            block_failed(b->inum);
+            b->lo = b->hi = 0;
+            rc = -1;
+            continue;
+        }
+        handles[n] = handle;
+        sent[n++] = b;
+        block_counters.writebacks++;
+    }
+    if(all_clean){
+        dirty_since = 0;
+    }
+    return rc;
+}
+
+// Sends the held-back writes once the oldest has waited long enough
+static void block_writeback_expired(){
+    if(dirty_since != 0 && now_us() - dirty_since >= BCACHE_WRITEBACK_US){
+        block_flush(-1);
+    }
+}
+
+// Frees the cached blocks of a file (every file if inum is -1), dropping
+// any writes held back for them
+static void block_drop(int inum){
+    for(int i = 0; i < bcache_capacity(); i++){
+        bcache_block_t *b = bcache_block(i);
+        if(b->inum >= 0 && (inum < 0 || b->inum == inum)){
+            block_settle(b);
+            bcache_drop(b);
+        }
+    }
+}
+
+// Returns the cached block for a file's block, or takes over the least
+// recently used one for it. If that one holds held-back writes, all of
+// them go out, since a full cache means they are piling up. Returns null
+// if they could not be.
+static bcache_block_t *block_get(int inum, int block){
+    bcache_block_t *b = bcache_find(inum, block);
+    if(b != NULL){
+        block_settle(b);
+        return b;
+    }
+    b = bcache_victim();
+    if(b->inum >= 0 && b->lo < b->hi){
+        block_flush(-1);
+        if(b->lo < b->hi){
+            return NULL;
+        }
+    }
+    bcache_assign(b, inum, block);
+    return b;
+}
+
+// Reads a block from the server into the cache. Returns -1 if that fails.
+static int block_fetch(bcache_block_t *b){
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = MFS_READ;
+    req.inum = b->inum;
+    req.offset = b->block * MFS_BLOCK_SIZE;
+    req.nbytes = MFS_BLOCK_SIZE;
+    req.type = MFS_READ_PARTIAL;
+    long sent_at = now_us();
+    if(rpc(&req, NULL, b->data, MFS_BLOCK_SIZE) != 0){
+        return -1;
+    }
+    b->len = req.nbytes;
+    b->expires = sent_at + req.offset * 1000L;
+    return 0;
+}
+
+// Starts read-aheads for the blocks after a read if the file is being read
+// in sequence
+static void block_readahead(int inum, int offset, int nbytes){
+    stream_t *st = &streams[0];
+    for(int i = 0; i < BCACHE_STREAMS; i++){
+        if(streams[i].inum == inum){
+            st = &streams[i];
+            break;
+        }
+        if(streams[i].used < st->used){
+            st = &streams[i];
+        }
+    }
+    if(st->inum != inum){
+        st->inum = inum;
+        st->window = 0;
+        st->next = 0;
+    }
+    st->used = now_us();
+    if(offset == st->next){
+        st->window = MIN(MAX(2 * st->window, BCACHE_MIN_READAHEAD), BCACHE_MAX_READAHEAD);
+    } else {
+        st->window = 0;
+    }
+    st->next = offset + nbytes;
+
+    // Keep some calls and most of the cache for everything else
+    int limit = MIN(MFS_MAX_INFLIGHT / 2, bcache_capacity() / 4);
+    int first = (offset + nbytes - 1) / MFS_BLOCK_SIZE + 1;
+    long now = now_us();
+    for(int i = 0; i < st->window && nprefetching < limit; i++){
+        bcache_block_t *b = bcache_find(inum, first + i);
+        if(b != NULL && (b->pending >= 0 || b->lo < b->hi || now < b->expires)){
+            continue;
+        }
+        if(b == NULL){
+            b = bcache_victim();
+            if(b->inum >= 0 && b->lo < b->hi){
+                break;
+            }
+            bcache_assign(b, inum, first + i);
+        }
+
+        mfs_hdr_t req;
+        bzero(&req, sizeof(mfs_hdr_t));
+        req.mtype = MFS_READ;
+        req.inum = inum;
+        req.offset = b->block * MFS_BLOCK_SIZE;
+        req.nbytes = MFS_BLOCK_SIZE;
+        req.type = MFS_READ_PARTIAL;
+        int handle = call_start(&req, NULL, b->data, MFS_BLOCK_SIZE);
+        if(handle < 0){
+            bcache_drop(b);
+            break;
+        }
+        b->pending = handle;
+        prefetching[nprefetching++] = b;
+        block_counters.readaheads++;
+    }
+}
+
+// MFS_Read through the block cache
+static int cached_read(int inum, char *buffer, int offset, int nbytes){
+    block_reap();
+    block_writeback_expired();
+    for(int done = 0; done < nbytes; ){
+        int block = (offset + done) / MFS_BLOCK_SIZE;
+        int a = (offset + done) % MFS_BLOCK_SIZE;
+        int e = MIN(MFS_BLOCK_SIZE, a + nbytes - done);
+        bcache_block_t *b = block_get(inum, block);
+        if(b == NULL){
+            return -1;
+        }
+        if(block_covers(b, a, e, now_us())){
+            block_counters.block_hits++;
+        } else {
+            // The server must see held-back writes before the block is read
+            block_counters.block_misses++;
+            if(b->lo < b->hi){
+                block_flush(inum);
+            }
+            if(block_fetch(b) != 0 || !block_covers(b, a, e, now_us())){
+                bcache_drop(b);
+                return -1;
+            }
+        }
+        memcpy(buffer + done, b->data + a, e - a);
+        done += e - a;
+    }
+    block_readahead(inum, offset, nbytes);
+    return 0;
+}
+
+// MFS_Write through the block cache: the bytes are held back in their
+// blocks, merged with earlier writes next to them
+static int cached_write(int inum, char *buffer, int offset, int nbytes){
+    block_reap();
+    block_writeback_expired();
+    cache_invalidate_stat(inum);
+    for(int done = 0; done < nbytes; ){
+        int block = (offset + done) / MFS_BLOCK_SIZE;
+        int a = (offset + done) % MFS_BLOCK_SIZE;
+        int e = MIN(MFS_BLOCK_SIZE, a + nbytes - done);
+        bcache_block_t *b = block_get(inum, block);
+        if(b == NULL){
+            return -1;
+        }
+        // A block holds one dirty range, so a write apart from it sends it
+        if(b->lo < b->hi && (a > b->hi || e < b->lo)){
+            block_flush(inum);
+            if(b->lo < b->hi){
+                return -1;
+            }
+        }
+        memcpy(b->data + a, buffer + done, e - a);
+        if(b->lo == b->hi){
+            b->lo = a;
+            b->hi = e;
+            b->dirtied = now_us();
+            if(dirty_since == 0){
+                dirty_since = b->dirtied;
+            }
+        } else {
+            b->lo = MIN(b->lo, a);
+            b->hi = MAX(b->hi, e);
+        }
+        done += e - a;
+    }
+    return 0;
+}
+
+// Drops what unlinking a name makes stale. The unlinked inode may be
+// reused, so its attributes, blocks and (for a directory) the lookups in
+// it go too; if it is not known, all of those do.
+static void cache_invalidate_unlink(int pinum, char *name){
+    cache_invalidate_stat(pinum);
+    int inum = mcache_drop_lookup(pinum, name);
+    if(inum >= 0){
+        mcache_drop_stat(inum);
+    } else {
+        mcache_drop_all_stats();
+    }
+    mcache_drop_dir(inum);
+    if(block_cache_on()){
+        if(inum < 0){
+            block_flush(-1);
+        }
+        block_drop(inum);
+    }
+}
+
+// Asks a server for its wire version; a server that does not answer
+// within a few tries is assumed to speak only the legacy format
+static int negotiate(struct sockaddr_in *addr){
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.magic = MFS_WIRE_MAGIC;
+    req.version = MFS_WIRE_VERSION;
+    req.mtype = MFS_INIT;
+
+    for(int tries = 0; tries < 3; tries++){
+        req.reqid = next_reqid++;
+        if(UDP_Write(sd, addr, (char *)&req, sizeof(mfs_hdr_t)) < 0){
+            return 1;
+        }
+        long deadline = now_us() + 250000;
+        while(wait_readable(MAX(deadline - now_us(), 0))){
+            mfs_hdr_t reply;
+            int rc = UDP_Read(sd, &addrRcv, (char *)&reply, sizeof(mfs_hdr_t));
+            if(rc >= (int)sizeof(mfs_hdr_t) && reply.magic == MFS_WIRE_MAGIC && reply.reqid == req.reqid){
+                return MIN(reply.type, MFS_WIRE_VERSION);
+            }
+        }
+    }
+    return 1;
+}
 
 int MFS_Init(char *hostname, int port){
- 
+    return MFS_InitServers(&hostname, &port, 1);
+}
+
+int MFS_InitServers(char **hostnames, int *ports, int n){
+
+    if(n < 1 || n > MFS_MAX_SERVERS){
+        return -1;
+    }
+
     // bind to port using Piazza fix @1885
     int MIN_PORT = 20000;
     int MAX_PORT = 40000;
 
-    srand(time(0));
+    // Mix in the pid so clients started in the same second pick different
+    // ports and request ids; the server's reply cache keys on both
+    srand(time(0) ^ getpid());
     int port_num = (rand() % (MAX_PORT - MIN_PORT) + MIN_PORT);
 
     sd  = UDP_Open(port_num);
-    int rc = UDP_FillSockAddr(&addrSnd, hostname, port);
-    assert(rc>-1);
+    // room for the replies of every call that can be in flight at once
+    UDP_SetBufferSize(sd, 2 * MFS_MAX_INFLIGHT * (sizeof(mfs_hdr_t) + MFS_BLOCK_SIZE));
+    for(int i = 0; i < n; i++){
+        int rc = UDP_FillSockAddr(&servers[i], hostnames[i], ports[i]);
+        assert(rc>-1);
+    }
+    nservers = n;
+    nreplicas = 0;
     server_stat = 1;
-    
+    next_reqid = rand();
+    wire_version = MFS_WIRE_VERSION;
+    for(int i = 0; i < n; i++){
+        wire_version = MIN(wire_version, negotiate(&servers[i]));
+    }
+
+    // Entries that refer to other servers need the compact format
+    if(n > 1 && wire_version < MFS_WIRE_VERSION){
+        server_stat = 0;
+        return -1;
+    }
     return 0;
 }
 
-int MFS_Lookup(int pinum, char *name){
+int MFS_InitReplicas(char **hostnames, int *ports, int n){
+    if(n < 1 || n > MFS_MAX_SERVERS || MFS_InitServers(hostnames, ports, 1) < 0){
+        return -1;
+    }
+    replicas[0] = servers[0];
+    for(int i = 1; i < n; i++){
+        int rc = UDP_FillSockAddr(&replicas[i], hostnames[i], ports[i]);
+        assert(rc>-1);
+        wire_version = MIN(wire_version, negotiate(&replicas[i]));
+    }
+    nreplicas = n;
+
+    // Spreading reads needs calls that are matched to replies by id
+    if(n > 1 && wire_version < MFS_WIRE_VERSION){
+        server_stat = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int MFS_LookupAsync(int pinum, char *name){
 
     if(pinum < 0 || strlen(name) == 0){
         return -1;
@@ -35,23 +1146,22 @@ int MFS_Lookup(int pinum, char *name){
         return -1;
     }
 
-    message_t message;
+    mfs_hdr_t message;
+    bzero(&message, sizeof(mfs_hdr_t));
     message.mtype = MFS_LOOKUP;
     message.inum = pinum;
-    strcpy(message.name,name);
+    message.len = strlen(name) + 1;
 
-    int rc = UDP_Write(sd,&addrSnd,(char*)(&message),sizeof(message_t));
-    if(rc<0){
-        return -1;
-    }
-    rc = UDP_Read(sd, &addrRcv, (char *)&message, sizeof(message_t));
-    if(message.rc != 0){
-        return -1;
+    int inum;
+    if(cache_enabled && mcache_lookup(pinum, name, now_us(), &inum)){
+        message.inum = inum;
+        message.rc = inum < 0 ? -1 : 0;
+        return call_cached(&message);
     }
-    return message.inum;
+    return call_start(&message, name, NULL, 0);
 }
 
-int MFS_Stat(int inum, MFS_Stat_t *m){
+int MFS_StatAsync(int inum, MFS_Stat_t *m){
 
     if(inum < 0 || m == NULL){
         return -1;
@@ -61,79 +1171,492 @@ int MFS_Stat(int inum, MFS_Stat_t *m){
         return -1;
     }
 
-    message_t message;
+    // The size must include held-back writes
+    if(block_cache_on()){
+        block_flush(inum);
+    }
+
+    mfs_hdr_t message;
+    bzero(&message, sizeof(mfs_hdr_t));
     message.mtype = MFS_STAT;
     message.inum = inum;
 
-    int rc = UDP_Write(sd,&addrSnd,(char*)(&message),sizeof(message_t));
-    if(rc<0){
-        return -1;
+    MFS_Stat_t cached;
+    int handle;
+    if(cache_enabled && mcache_stat(inum, now_us(), &cached)){
+        message.type = cached.type;
+        message.nbytes = cached.size;
+        handle = call_cached(&message);
+    } else {
+        handle = call_start(&message, NULL, NULL, 0);
+    }
+    if(handle >= 0){
+        calls[handle].stat = m;
     }
+    return handle;
+}
+
+int MFS_WriteAsync(int inum, char *buffer, int offset, int nbytes){
 
-    rc = UDP_Read(sd, &addrRcv, (char *)&message, sizeof(message_t));
-    if(message.rc!=0) {
+    if(inum < 0 || strlen(buffer) == 0 || offset < 0 || nbytes < 0 || nbytes > 4096){
         return -1;
     }
 
-    m->type = message.type;
-    m->size = message.nbytes;
-    fprintf(stderr,"Stat returned type %d size %d\n",m->type,m->size);
+    mfs_hdr_t message;
+    bzero(&message, sizeof(mfs_hdr_t));
+    message.mtype = MFS_WRITE;
+    message.inum = inum;
+    message.offset = offset;
+    message.nbytes = nbytes;
+    message.len = nbytes;
 
-    return 0;
+    cache_invalidate_stat(inum);
+    if(block_cache_on()){
+        block_flush(inum);
+        block_drop(inum);
+    }
+    return call_start(&message, buffer, NULL, 0);
 }
 
-int MFS_Write(int inum, char *buffer, int offset, int nbytes){
+int MFS_ReadAsync(int inum, char *buffer, int offset, int nbytes){
 
-    if(inum < 0 || strlen(buffer) == 0 || offset < 0 || nbytes > 4096){
+    if(inum < 0 || offset < 0 || nbytes < 0 || nbytes > 4096){
         return -1;
     }
 
-    message_t message;
-    message.mtype = MFS_WRITE;
+    if(!server_stat){
+        return -1;
+    } 
+
+    mfs_hdr_t message;
+    bzero(&message, sizeof(mfs_hdr_t));
+    message.mtype = MFS_READ;
     message.inum = inum;
-    memcpy(message.buffer,buffer,nbytes);
     message.offset = offset;
     message.nbytes = nbytes;
 
-    int rc = UDP_Write(sd,&addrSnd,(char*)(&message),sizeof(message_t));
-    if(rc<0){
+    if(block_cache_on()){
+        block_flush(inum);
+    }
+    return call_start(&message, NULL, buffer, nbytes);
+}
+
+int MFS_Poll(int req){
+
+    if(req < 0 || req >= MFS_MAX_INFLIGHT || !calls[req].busy){
+        return -1;
+    }
+
+    // Collect every reply that has already arrived
+    while(!calls[req].done && call_receive(0)){
+    }
+    return calls[req].done;
+}
+
+int MFS_Wait(int req){
+
+    if(req < 0 || req >= MFS_MAX_INFLIGHT || !calls[req].busy){
+        return -1;
+    }
+
+    MFS_Stat_t *m = calls[req].stat;
+    mfs_hdr_t reply;
+    if(call_finish(req, &reply) != 0){
         return -1;
     }
 
-    rc = UDP_Read(sd, &addrRcv, (char *)&message, sizeof(message_t));
-    if(message.rc!=0) {
+    switch(reply.mtype){
+    case MFS_LOOKUP:
+        return reply.inum;
+    case MFS_STAT:
+        m->type = reply.type;
+        m->size = reply.nbytes;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+int MFS_SetTimeout(int timeout_ms){
+
+    if(timeout_ms <= 0){
         return -1;
     }
+    call_timeout_us = timeout_ms * 1000L;
     return 0;
 }
 
+int MFS_Lookup(int pinum, char *name){
+    return MFS_Wait(MFS_LookupAsync(pinum, name));
+}
+
+int MFS_Stat(int inum, MFS_Stat_t *m){
+
+    if(MFS_Wait(MFS_StatAsync(inum, m)) != 0){
+        return -1;
+    }
+    fprintf(stderr,"Stat returned type %d size %d\n",m->type,m->size);
+
+    return 0;
+}
+
+// Resolves a path from the root directory, storing the inum and stat of
+// each of its first max components in inums and stats (either may be
+// null) and the number of components in *count. The metadata cache answers
+// if it holds every step; otherwise the server walks the whole path in one
+// call, or, if it is too old for that, one lookup at a time. Returns the
+// inum of the last component, or -1 if one is missing.
+static int lookup_path(char *path, int *inums, MFS_Stat_t *stats, int max, int *count){
+
+    if(path == NULL || strlen(path) >= MFS_MAX_PATH || !server_stat){
+        return -1;
+    }
+
+    char copy[MFS_MAX_PATH];
+    char *names[MFS_MAX_PATH / 2];
+    char *save;
+    int n = 0;
+    strcpy(copy, path);
+    for(char *name = strtok_r(copy, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)){
+        names[n++] = name;
+    }
+    *count = n;
+    int want = max > 0 && (inums != NULL || stats != NULL);
+    max = MIN(max, n);
+
+    // Sizes must include held-back writes
+    if(stats != NULL && block_cache_on() && dirty_since != 0){
+        block_flush(-1);
+    }
+
+    if(cache_enabled){
+        long now = now_us();
+        int inum = 0, i;
+        for(i = 0; i < n; i++){
+            int next;
+            if(!mcache_lookup(inum, names[i], now, &next)){
+                break;
+            }
+            if(next < 0){
+                return -1;
+            }
+            if(i < max && stats != NULL && !mcache_stat(next, now, &stats[i])){
+                break;
+            }
+            if(i < max && inums != NULL){
+                inums[i] = next;
+            }
+            inum = next;
+        }
+        if(i == n){
+            return inum;
+        }
+    }
+
+    if(wire_version < MFS_WIRE_VERSION){
+        int inum = 0;
+        for(int i = 0; i < n; i++){
+            if((inum = MFS_Lookup(inum, names[i])) < 0){
+                return -1;
+            }
+            if(i < max && inums != NULL){
+                inums[i] = inum;
+            }
+            if(i < max && stats != NULL && MFS_Wait(MFS_StatAsync(inum, &stats[i])) != 0){
+                return -1;
+            }
+        }
+        return inum;
+    }
+
+    // Every component's entry is needed to fill the cache too. A walk
+    // that reaches an entry for an inode on another server goes on from
+    // there with the rest of the path.
+    mfs_path_ent_t ents[MFS_MAX_PATH / 2];
+    mfs_hdr_t req;
+    int stat = want || cache_enabled;
+    long sent_at = now_us();
+    long generation = cache_generation;
+    int rc, resolved = 0, inum = 0, lease = 0, hops = 0;
+    do {
+        // One slash between the components keeps this no longer than path
+        char rest[MFS_MAX_PATH], *end = rest;
+        *end = '\0';
+        for(int i = resolved; i < n; i++){
+            end += sprintf(end, i > resolved ? "/%s" : "%s", names[i]);
+        }
+        int server = shard_of(inum);
+        bzero(&req, sizeof(mfs_hdr_t));
+        req.mtype = MFS_LOOKUPPATH;
+        req.inum = inum;
+        req.len = end - rest + 1;
+        req.type = stat ? MFS_PATH_STAT : 0;
+        rc = rpc(&req, rest, (char *)(ents + resolved), (n - resolved) * sizeof(mfs_path_ent_t));
+        if(req.mtype != MFS_LOOKUPPATH || (stat && req.type != MFS_PATH_STAT)){
+            rc = -1;
+            resolved = 0;
+            lease = 0;
+            break;
+        }
+        int depth = MIN(MAX(req.nbytes, 0), n - resolved);
+        if(stat){
+            depth = MIN(depth, req.len / (int)sizeof(mfs_path_ent_t));
+        }
+        for(int i = resolved; stat && i < resolved + depth; i++){
+            ents[i].inum = shard_global(server, ents[i].inum);
+        }
+        lease = hops++ == 0 ? req.offset : MIN(lease, req.offset);
+        resolved += depth;
+        inum = req.inum;
+    } while(rc == MFS_PATH_REMOTE && inum >= 0 && resolved < n);
+
+    // Entries on other servers come without their attributes
+    for(int i = 0; stat && rc == 0 && i < resolved; i++){
+        if(ents[i].size < 0){
+            MFS_Stat_t m;
+            if(MFS_Wait(MFS_StatAsync(ents[i].inum, &m)) != 0){
+                rc = -1;
+                resolved = i;
+                break;
+            }
+            ents[i].type = m.type;
+            ents[i].size = m.size;
+        }
+    }
+    if(cache_enabled && lease > 0 && generation == cache_generation){
+        long expires = sent_at + lease * 1000L;
+        int parent = 0;
+        for(int i = 0; i < resolved; i++){
+            MFS_Stat_t m = { ents[i].type, ents[i].size };
+            mcache_put_lookup(parent, names[i], ents[i].inum, expires);
+            mcache_put_stat(ents[i].inum, &m, expires);
+            parent = ents[i].inum;
+        }
+        if(rc != 0 && resolved < n){
+            mcache_put_lookup(parent, names[resolved], -1, expires);
+        }
+    }
+
+    if(rc != 0 || (want && resolved < max)){
+        return -1;
+    }
+    for(int i = 0; want && i < max; i++){
+        if(inums != NULL){
+            inums[i] = ents[i].inum;
+        }
+        if(stats != NULL){
+            stats[i].type = ents[i].type;
+            stats[i].size = ents[i].size;
+        }
+    }
+    return req.inum;
+}
+
+int MFS_LookupPath(char *path){
+    int count;
+    return lookup_path(path, NULL, NULL, 0, &count);
+}
+
+int MFS_LookupPathStat(char *path, int *inums, MFS_Stat_t *stats, int max){
+    int count;
+    if(max < 0 || lookup_path(path, inums, stats, max, &count) < 0){
+        return -1;
+    }
+    return count;
+}
+
+int MFS_Write(int inum, char *buffer, int offset, int nbytes){
+    if(block_cache_on()){
+        if(inum < 0 || strlen(buffer) == 0 || offset < 0 || nbytes < 0 || nbytes > 4096){
+            return -1;
+        }
+        return cached_write(inum, buffer, offset, nbytes);
+    }
+    return MFS_Wait(MFS_WriteAsync(inum, buffer, offset, nbytes));
+}
+
 int MFS_Read(int inum, char *buffer, int offset, int nbytes){
+    if(block_cache_on()){
+        if(inum < 0 || offset < 0 || nbytes < 0 || nbytes > 4096){
+            return -1;
+        }
+        return cached_read(inum, buffer, offset, nbytes);
+    }
+    return MFS_Wait(MFS_ReadAsync(inum, buffer, offset, nbytes));
+}
+
+int MFS_ReadBulk(int inum, char *buffer, int offset, int nbytes){
+    if(block_cache_on()){
+        block_flush(inum);
+    }
+    return bulk_rpc(MFS_BREAD, inum, buffer, offset, nbytes) == 0 ? 0 : -1;
+}
+
+int MFS_WriteBulk(int inum, char *buffer, int offset, int nbytes){
+    cache_invalidate_stat(inum);
+    if(block_cache_on()){
+        block_flush(inum);
+        block_drop(inum);
+    }
+    return bulk_rpc(MFS_BWRITE, inum, buffer, offset, nbytes) == 0 ? 0 : -1;
+}
+
+int MFS_EnableCache(int enable){
+    cache_enabled = enable != 0;
+    return 0;
+}
 
-    if(inum < 0 || offset < 0 || nbytes < 0){
+int MFS_GetCacheStats(MFS_CacheStats_t *stats){
+
+    if(stats == NULL){
         return -1;
     }
+    mcache_stats(stats);
+    stats->block_hits = block_counters.block_hits;
+    stats->block_misses = block_counters.block_misses;
+    stats->readaheads = block_counters.readaheads;
+    stats->writebacks = block_counters.writebacks;
+    return 0;
+}
 
-    if(!server_stat){
+int MFS_GetStats(MFS_ServerStats_t *stats){
+
+    if(stats == NULL || !server_stat || wire_version < MFS_WIRE_VERSION){
         return -1;
-    } 
+    }
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = MFS_STATS;
+    mfs_stats_t *st = malloc(sizeof(mfs_stats_t));
+    if(rpc(&req, NULL, (char *)st, sizeof(mfs_stats_t)) != 0 || req.len != sizeof(mfs_stats_t)){
+        free(st);
+        return -1;
+    }
+    stats->uptime_ms = st->uptime_ms;
+    stats->free_inodes = st->free_inodes;
+    stats->num_inodes = st->num_inodes;
+    stats->free_blocks = st->free_blocks;
+    stats->num_blocks = st->num_blocks;
+    for(int i = 0; i < MFS_STATS_OPS; i++){
+        mfs_op_stats_t *from = &st->ops[i];
+        MFS_OpStats_t *to = &stats->ops[i];
+        to->requests = from->requests;
+        to->errors = from->errors;
+        to->bytes_in = from->bytes_in;
+        to->bytes_out = from->bytes_out;
+        for(int b = 0; b < MFS_STATS_BUCKETS; b++){
+            to->handler_us[b] = from->handler_us[b];
+            to->total_us[b] = from->total_us[b];
+        }
+    }
+    stats->num_shards = st->num_shards;
+    for(int i = 0; i < MFS_STATS_SHARDS; i++){
+        stats->shard_datagrams[i] = st->shard_datagrams[i];
+    }
+    free(st);
+    return 0;
+}
 
-    message_t message;
-    message.mtype = MFS_READ;
-    message.inum = inum;
-    message.offset = offset;
-    message.nbytes = nbytes;
+int MFS_GetStatsText(char *buffer, int len){
 
-    int rc = UDP_Write(sd,&addrSnd,(char*)(&message),sizeof(message_t));
-    if(rc<0){
+    if(buffer == NULL || len <= 0 || !server_stat || wire_version < MFS_WIRE_VERSION){
+        return -1;
+    }
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = MFS_STATS;
+    req.type = MFS_STATS_TEXT;
+    if(rpc(&req, NULL, buffer, len) != 0 || req.len == 0){
         return -1;
     }
+    buffer[MIN(req.len, len) - 1] = '\0';
+    return 0;
+}
 
-    rc = UDP_Read(sd, &addrRcv, (char *) &message, sizeof(message_t));
-    if(message.rc!=0) {
+int MFS_SetBlockCache(int nblocks){
+
+    if(nblocks != 0 && nblocks < 4){
         return -1;
     }
-    memcpy(buffer,message.buffer,nbytes);
+    if(bcache_capacity() > 0){
+        block_flush(-1);
+        block_drop(-1);
+    }
+    for(int i = 0; i < BCACHE_STREAMS; i++){
+        streams[i].inum = -1;
+    }
+    return bcache_resize(nblocks);
+}
+
+int MFS_Close(int inum){
 
+    if(inum < 0){
+        return -1;
+    }
+    int rc = block_cache_on() ? block_flush(inum) : 0;
+    for(int i = 0; i < nfailed; i++){
+        if(failed_inums[i] == inum){
+            failed_inums[i] = failed_inums[--nfailed];
+            rc = -1;
+            break;
+        }
+    }
+    return rc;
+}
+
+// Frees an inode made by creat_remote, once no entry refers to it.
+// Returns 0, 1 if the server kept it (a directory with entries), or -1 if
+// it did not answer.
+static int unlink_detached(int inum){
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = MFS_UNLINK;
+    req.inum = -1;
+    req.offset = shard_local(inum);
+    if(rpc_at(shard_of(inum), &req, NULL, NULL, 0) == 0){
+        return 0;
+    }
+    return req.mtype == MFS_UNLINK ? 1 : -1;
+}
+
+// Adds an entry name to directory pinum for inode inum on another server.
+// Returns the reply's rc, and sets *existing to the inode of the entry now
+// under the name.
+static int link_remote(int pinum, char *name, int inum, int *existing){
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = MFS_LINK;
+    req.inum = pinum;
+    req.nbytes = inum;
+    req.len = strlen(name) + 1;
+    int rc = rpc(&req, name, NULL, 0);
+    *existing = req.inum;
+    return rc;
+}
+
+// Creates a file or directory on server for an entry in directory pinum,
+// which is on another one (see MFS_REMOTE in message.h). The inode comes
+// first, so a client that stops halfway leaves at worst an inode nothing
+// refers to, never an entry for a missing one. Returns 0, or -1.
+static int creat_remote(int server, int pinum, int type, char *name){
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = MFS_CRET;
+    req.inum = -1;
+    req.type = type;
+    req.offset = pinum;
+    if(rpc_at(server, &req, NULL, NULL, 0) != 0){
+        return -1;
+    }
+
+    // If the name was taken meanwhile, the new inode is not needed
+    int inum = req.inum, existing;
+    if(link_remote(pinum, name, inum, &existing) != 0){
+        return -1;
+    }
+    if(existing != inum){
+        unlink_detached(inum);
+    }
     return 0;
 }
 
@@ -151,19 +1674,20 @@ int MFS_Creat(int pinum, int type, char *name){
         return -1;
     }
 
-    message_t message;
+    mfs_hdr_t message;
+    bzero(&message, sizeof(mfs_hdr_t));
     message.mtype = MFS_CRET;
     message.inum = pinum;
     message.type = type;
-    strcpy(message.name,name);
+    message.len = strlen(name) + 1;
 
-    int rc = UDP_Write(sd,&addrSnd,(char*)(&message),sizeof(message_t));
-    if(rc<0){
-        return -1;
-    }
+    cache_invalidate_create(pinum, name);
 
-    rc = UDP_Read(sd, &addrRcv, (char *) &message, sizeof(message_t));
-    if(message.rc!=0) {
+    int server = shard_place(pinum);
+    if(server != shard_of(pinum)){
+        return creat_remote(server, pinum, type, name);
+    }
+    if(rpc(&message, name, NULL, 0) != 0){
         return -1;
     }
 
@@ -180,36 +1704,409 @@ int MFS_Unlink(int pinum, char *name){
         return -1;
     }
 
-    message_t message;
+    mfs_hdr_t message;
+    bzero(&message, sizeof(mfs_hdr_t));
     message.mtype = MFS_UNLINK;
     message.inum = pinum;
-    strcpy(message.name,name);
+    message.len = strlen(name) + 1;
+
+    cache_invalidate_unlink(pinum, name);
 
-    int rc = UDP_Write(sd,&addrSnd,(char*)(&message),sizeof(message_t));
-    if(rc<0){
+    if(rpc(&message, name, NULL, 0) != 0){
         return -1;
     }
 
-    rc = UDP_Read(sd, &addrRcv, (char *) &message, sizeof(message_t));
-    if(message.rc!=0){
+    // The entry referred to an inode on another server, which frees it
+    // now; a directory with entries is kept and its entry put back
+    int rc = message.type == MFS_UNLINK_REMOTE ? unlink_detached(message.inum) : 0;
+    if(rc > 0){
+        int existing;
+        link_remote(pinum, name, message.inum, &existing);
+    }
+    if(rc != 0){
         return -1;
     }
 
     return 0;
 }
 
+// Lists a directory by reading its entries, for servers without MFS_READDIR
+static int readdir_singly(int inum, int *cookie, MFS_DirEnt_t *ents, MFS_Stat_t *stats, int max){
+    MFS_Stat_t dir;
+    if(MFS_Wait(MFS_StatAsync(inum, &dir)) != 0 || dir.type != MFS_DIRECTORY){
+        return -1;
+    }
+
+    int nslots = dir.size / sizeof(MFS_DirEnt_t);
+    int per_read = MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t);
+    MFS_DirEnt_t block[MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t)];
+    int slot = *cookie, n = 0;
+    while(slot < nslots && n < max){
+        int count = MIN(per_read, nslots - slot);
+        if(MFS_Wait(MFS_ReadAsync(inum, (char *)block, slot * sizeof(MFS_DirEnt_t), count * sizeof(MFS_DirEnt_t))) != 0){
+            return -1;
+        }
+        int i;
+        for(i = 0; i < count && n < max; i++){
+            if(block[i].inum == -1){
+                continue;
+            }
+            ents[n] = block[i];
+            ents[n].name[sizeof(ents[n].name) - 1] = '\0';
+            if(stats != NULL && MFS_Wait(MFS_StatAsync(ents[n].inum, &stats[n])) != 0){
+                stats[n].type = 0;
+                stats[n].size = -1;
+            }
+            n++;
+        }
+        slot += i;
+    }
+    *cookie = slot < nslots ? slot : -1;
+    return n;
+}
+
+int MFS_ReadDir(int inum, int *cookie, MFS_DirEnt_t *ents, MFS_Stat_t *stats, int max){
+
+    if(inum < 0 || cookie == NULL || ents == NULL || max <= 0 || !server_stat){
+        return -1;
+    }
+    if(*cookie == -1){
+        return 0;
+    }
+    if(*cookie < 0){
+        return -1;
+    }
+
+    // Sizes must include held-back writes
+    if(stats != NULL && block_cache_on() && dirty_since != 0){
+        block_flush(-1);
+    }
+
+    if(wire_version < MFS_WIRE_VERSION){
+        return readdir_singly(inum, cookie, ents, stats, max);
+    }
+
+    mfs_hdr_t req;
+    bzero(&req, sizeof(mfs_hdr_t));
+    req.mtype = MFS_READDIR;
+    req.inum = inum;
+    req.offset = *cookie;
+    req.nbytes = max;
+    req.type = stats != NULL ? MFS_READDIR_PLUS : 0;
+    int server = shard_of(inum);
+    char *payload = malloc(MFS_MAX_PAYLOAD);
+    if(rpc(&req, NULL, payload, MFS_MAX_PAYLOAD) != 0){
+        free(payload);
+        return -1;
+    }
+
+    int n = 0;
+    for(int pos = 0; n < MIN(req.nbytes, max) && pos + sizeof(mfs_dirent_t) <= req.len; n++){
+        mfs_dirent_t ent;
+        memcpy(&ent, payload + pos, sizeof(mfs_dirent_t));
+        pos += sizeof(mfs_dirent_t);
+        if(ent.namelen >= sizeof(ents[n].name) || pos + ent.namelen + 1 > req.len){
+            break;
+        }
+        memcpy(ents[n].name, payload + pos, ent.namelen);
+        ents[n].name[ent.namelen] = '\0';
+        ents[n].inum = shard_global(server, ent.inum);
+        if(stats != NULL){
+            stats[n].type = ent.type;
+            stats[n].size = ent.size;
+        }
+        pos += ent.namelen + 1;
+    }
+    free(payload);
+
+    // Entries on other servers come without their attributes
+    for(int i = 0; stats != NULL && i < n; i++){
+        if(stats[i].size < 0 && shard_of(ents[i].inum) != server &&
+           MFS_Wait(MFS_StatAsync(ents[i].inum, &stats[i])) != 0){
+            stats[i].type = 0;
+            stats[i].size = -1;
+        }
+    }
+    *cookie = (req.type & MFS_READDIR_EOF) ? -1 : req.offset;
+    return n;
+}
+
+// An operation of a batch, with its result once the batch is submitted
+typedef struct {
+    mfs_op_t op;        // inum is the index of an earlier op if MFS_OP_REF is set
+    char *data;         // name or write data
+    int rc;
+    int inum;
+    MFS_Stat_t stat;
+} batch_op_t;
+
+struct MFS_Batch {
+    batch_op_t *ops;
+    int n;
+    int cap;
+};
+
+MFS_Batch_t *MFS_BatchNew(){
+    return calloc(1, sizeof(MFS_Batch_t));
+}
+
+void MFS_BatchFree(MFS_Batch_t *b){
+    if(b == NULL){
+        return;
+    }
+    for(int i = 0; i < b->n; i++){
+        free(b->ops[i].data);
+    }
+    free(b->ops);
+    free(b);
+}
+
+// Appends an operation, copying len bytes of data for it. Returns its
+// index, or -1 if inum refers to no earlier operation.
+static int batch_add(MFS_Batch_t *b, int mtype, int inum, int offset, int nbytes, int type, char *data, int len){
+    if(b == NULL || inum == -1 || inum < MFS_BATCH_REF(b->n - 1)){
+        return -1;
+    }
+    if(b->n == b->cap){
+        int cap = b->cap ? 2 * b->cap : 16;
+        batch_op_t *ops = realloc(b->ops, cap * sizeof(batch_op_t));
+        if(ops == NULL){
+            return -1;
+        }
+        b->ops = ops;
+        b->cap = cap;
+    }
+
+    batch_op_t *o = &b->ops[b->n];
+    bzero(o, sizeof(batch_op_t));
+    o->op.mtype = mtype;
+    o->op.inum = inum;
+    if(inum < -1){
+        o->op.flags = MFS_OP_REF;
+        o->op.inum = -2 - inum;
+    }
+    o->op.offset = offset;
+    o->op.nbytes = nbytes;
+    o->op.type = type;
+    o->op.len = len;
+    o->data = malloc(len > 0 ? len : 1);
+    memcpy(o->data, data, len);
+    o->rc = -1;
+    o->inum = -1;
+    return b->n++;
+}
+
+int MFS_BatchLookup(MFS_Batch_t *b, int pinum, char *name){
+    if(name == NULL || strlen(name) == 0 || strlen(name) >= 28){
+        return -1;
+    }
+    return batch_add(b, MFS_LOOKUP, pinum, 0, 0, 0, name, strlen(name) + 1);
+}
+
+int MFS_BatchStat(MFS_Batch_t *b, int inum){
+    return batch_add(b, MFS_STAT, inum, 0, 0, 0, NULL, 0);
+}
+
+int MFS_BatchWrite(MFS_Batch_t *b, int inum, char *buffer, int offset, int nbytes){
+    if(buffer == NULL || offset < 0 || nbytes < 0 || nbytes > MFS_BLOCK_SIZE){
+        return -1;
+    }
+    return batch_add(b, MFS_WRITE, inum, offset, nbytes, 0, buffer, nbytes);
+}
+
+int MFS_BatchCreat(MFS_Batch_t *b, int pinum, int type, char *name){
+    if(name == NULL || strlen(name) == 0 || strlen(name) >= 28 || type < 0 || type > 1){
+        return -1;
+    }
+    return batch_add(b, MFS_CRET, pinum, 0, 0, type, name, strlen(name) + 1);
+}
+
+int MFS_BatchUnlink(MFS_Batch_t *b, int pinum, char *name){
+    if(name == NULL || strlen(name) == 0){
+        return -1;
+    }
+    return batch_add(b, MFS_UNLINK, pinum, 0, 0, 0, name, strlen(name) + 1);
+}
+
+// Returns the inode an operation runs on: its own inum, or that produced
+// by the operation it refers to (-1 if that one failed)
+static int batch_inum(MFS_Batch_t *b, batch_op_t *o){
+    if(!(o->op.flags & MFS_OP_REF)){
+        return o->op.inum;
+    }
+    batch_op_t *ref = &b->ops[o->op.inum];
+    return ref->rc == 0 ? ref->inum : -1;
+}
+
+// Drops what a batch operation that has run makes stale
+static void batch_invalidate(MFS_Batch_t *b, batch_op_t *o){
+    int inum = batch_inum(b, o);
+    if(inum < 0){
+        return;
+    }
+    if(o->op.mtype == MFS_CRET){
+        cache_invalidate_create(inum, o->data);
+    } else if(o->op.mtype == MFS_UNLINK){
+        cache_invalidate_unlink(inum, o->data);
+    } else if(o->op.mtype == MFS_WRITE){
+        cache_invalidate_stat(inum);
+        if(block_cache_on()){
+            block_drop(inum);
+        }
+    }
+}
+
+// Runs a batch one call per operation, for servers without MFS_COMPOUND
+static void batch_run_singly(MFS_Batch_t *b){
+    for(int i = 0; i < b->n; i++){
+        batch_op_t *o = &b->ops[i];
+        int inum = batch_inum(b, o);
+        o->rc = -1;
+        o->inum = -1;
+        if(inum < 0){
+            continue;
+        }
+        switch(o->op.mtype){
+        case MFS_LOOKUP:
+            o->inum = MFS_Lookup(inum, o->data);
+            o->rc = o->inum < 0 ? -1 : 0;
+            break;
+        case MFS_STAT:
+            o->rc = MFS_Wait(MFS_StatAsync(inum, &o->stat));
+            break;
+        case MFS_WRITE:
+            o->rc = MFS_Wait(MFS_WriteAsync(inum, o->data, o->op.offset, o->op.nbytes));
+            break;
+        case MFS_CRET:
+            if(MFS_Creat(inum, o->op.type, o->data) == 0){
+                o->inum = MFS_Lookup(inum, o->data);
+                o->rc = o->inum < 0 ? -1 : 0;
+            }
+            break;
+        case MFS_UNLINK:
+            o->rc = MFS_Unlink(inum, o->data);
+            break;
+        }
+        if(o->rc == 0 && o->op.mtype != MFS_LOOKUP && o->op.mtype != MFS_CRET){
+            o->inum = inum;
+        }
+    }
+}
+
+int MFS_BatchSubmit(MFS_Batch_t *b){
+
+    if(b == NULL || !server_stat){
+        return -1;
+    }
+
+    // A compound call goes to one server, and the operations of a batch
+    // may be for inodes on several
+    if(wire_version < MFS_WIRE_VERSION || nservers > 1){
+        batch_run_singly(b);
+    } else {
+        // The server must see held-back writes before anything in the batch
+        if(block_cache_on()){
+            block_flush(-1);
+        }
+
+        // As many operations go in each call as fit in it; references to
+        // operations of earlier calls are resolved here
+        char payload[MFS_MAX_PAYLOAD];
+        mfs_result_t results[MFS_MAX_OPS];
+        for(int first = 0, end = 0; first < b->n; first = end){
+            int len = 0;
+            for(end = first; end < b->n && end - first < MFS_MAX_OPS; end++){
+                mfs_op_t op = b->ops[end].op;
+                if(len + sizeof(mfs_op_t) + op.len > MFS_MAX_PAYLOAD){
+                    break;
+                }
+                if((op.flags & MFS_OP_REF) && op.inum < first){
+                    op.flags &= ~MFS_OP_REF;
+                    op.inum = batch_inum(b, &b->ops[end]);
+                } else if(op.flags & MFS_OP_REF){
+                    op.inum -= first;
+                }
+                memcpy(payload + len, &op, sizeof(mfs_op_t));
+                memcpy(payload + len + sizeof(mfs_op_t), b->ops[end].data, op.len);
+                len += sizeof(mfs_op_t) + op.len;
+            }
+
+            mfs_hdr_t req;
+            bzero(&req, sizeof(mfs_hdr_t));
+            req.mtype = MFS_COMPOUND;
+            req.len = len;
+            cache_generation++;
+            rpc(&req, payload, (char *)results, sizeof(results));
+            int ran = 0;
+            if(req.mtype == MFS_COMPOUND && req.nbytes == end - first &&
+               req.len == (end - first) * sizeof(mfs_result_t)){
+                ran = end - first;
+            }
+            for(int i = first; i < end; i++){
+                batch_op_t *o = &b->ops[i];
+                o->rc = ran ? results[i - first].rc : -1;
+                o->inum = ran ? results[i - first].inum : -1;
+                o->stat.type = ran ? results[i - first].type : 0;
+                o->stat.size = ran ? results[i - first].size : 0;
+            }
+        }
+    }
+
+    int rc = 0;
+    for(int i = 0; i < b->n; i++){
+        batch_invalidate(b, &b->ops[i]);
+        if(b->ops[i].rc != 0){
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+int MFS_BatchResult(MFS_Batch_t *b, int op, int *inum, MFS_Stat_t *m){
+
+    if(b == NULL || op < 0 || op >= b->n){
+        return -1;
+    }
+    batch_op_t *o = &b->ops[op];
+    if(inum != NULL){
+        *inum = o->inum;
+    }
+    if(m != NULL && o->op.mtype == MFS_STAT){
+        *m = o->stat;
+    }
+    return o->rc;
+}
+
 int MFS_Shutdown(){
 
     if(!server_stat){
         return -1;
     } 
 
-    message_t message;
+    if(block_cache_on()){
+        block_flush(-1);
+    }
+
+    if(wire_version < MFS_WIRE_VERSION){
+        message_t message;
+        bzero(&message, sizeof(message_t));
+        message.mtype = MFS_SHUTDOWN;
+        return UDP_Write(sd, &servers[0], (char *)(&message), sizeof(message_t)) < 0 ? -1 : 0;
+    }
+
+    mfs_hdr_t message;
+    bzero(&message, sizeof(mfs_hdr_t));
+    message.magic = MFS_WIRE_MAGIC;
+    message.version = MFS_WIRE_VERSION;
     message.mtype = MFS_SHUTDOWN;
 
-    int rc = UDP_Write(sd, &addrSnd, (char *)(&message), sizeof(message_t));
-    if(rc<0){
-        return -1;
+    // Every server of the namespace goes, and every backup
+    for(int i = 0; i < nservers + MAX(nreplicas - 1, 0); i++){
+        struct sockaddr_in *addr = i < nservers ? &servers[i] : &replicas[i - nservers + 1];
+        int rc = UDP_Write(sd, addr, (char *)(&message), sizeof(mfs_hdr_t));
+        if(rc<0){
+            return -1;
+        }
     }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "mcache.h"
+
+typedef struct {
+    int used;
+    int pinum;
+    char name[28];
+    int inum;             // -1 for a name known not to exist
+    long expires;
+} name_entry_t;
+
+typedef struct {
+    int used;
+    int inum;
+    MFS_Stat_t stat;
+    long expires;
+} stat_entry_t;
+
+name_entry_t name_entries[MCACHE_ENTRIES];
+stat_entry_t stat_entries[MCACHE_ENTRIES];
+MFS_CacheStats_t mcache_counters;
+
+// FNV-1a over the parent's inode number and the name
+static name_entry_t *name_slot(int pinum, char *name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < sizeof(int); i++)
+	h = (h ^ ((pinum >> (8 * i)) & 0xff)) * 16777619u;
+    for (; *name; name++)
+	h = (h ^ (unsigned char)*name) * 16777619u;
+    return &name_entries[h % MCACHE_ENTRIES];
+}
+
+static stat_entry_t *stat_slot(int inum) {
+    return &stat_entries[(uint32_t)inum * 2654435761u % MCACHE_ENTRIES];
+}
+
+// Returns 1 and sets *inum if the lookup is cached and its lease holds
+int mcache_lookup(int pinum, char *name, long now, int *inum) {
+    name_entry_t *e = name_slot(pinum, name);
+    if (e->used && e->pinum == pinum && strcmp(e->name, name) == 0 && now < e->expires) {
+	*inum = e->inum;
+	mcache_counters.lookup_hits++;
+	return 1;
+    }
+    mcache_counters.lookup_misses++;
+    return 0;
+}
+
+void mcache_put_lookup(int pinum, char *name, int inum, long expires) {
+    if (strlen(name) >= sizeof(((name_entry_t *)0)->name))
+	return;
+    name_entry_t *e = name_slot(pinum, name);
+    e->used = 1;
+    e->pinum = pinum;
+    strcpy(e->name, name);
+    e->inum = inum;
+    e->expires = expires;
+}
+
+// Forgets a lookup, expired or not. Returns the inode number it held, or -1.
+int mcache_drop_lookup(int pinum, char *name) {
+    name_entry_t *e = name_slot(pinum, name);
+    if (!e->used || e->pinum != pinum || strcmp(e->name, name) != 0)
+	return -1;
+    e->used = 0;
+    return e->inum;
+}
+
+// Forgets every lookup in directory pinum, or every lookup at all if pinum
+// is -1, once the directory may have gone and its inode number be reused
+void mcache_drop_dir(int pinum) {
+    for (int i = 0; i < MCACHE_ENTRIES; i++)
+	if (pinum == -1 || name_entries[i].pinum == pinum)
+	    name_entries[i].used = 0;
+}
+
+// Returns 1 and fills *m if the inode's attributes are cached and their
+// lease holds
+int mcache_stat(int inum, long now, MFS_Stat_t *m) {
+    stat_entry_t *e = stat_slot(inum);
+    if (e->used && e->inum == inum && now < e->expires) {
+	*m = e->stat;
+	mcache_counters.stat_hits++;
+	return 1;
+    }
+    mcache_counters.stat_misses++;
+    return 0;
+}
+
+void mcache_put_stat(int inum, MFS_Stat_t *m, long expires) {
+    stat_entry_t *e = stat_slot(inum);
+    e->used = 1;
+    e->inum = inum;
+    e->stat = *m;
+    e->expires = expires;
+}
+
+void mcache_drop_stat(int inum) {
+    stat_entry_t *e = stat_slot(inum);
+    if (e->used && e->inum == inum)
+	e->used = 0;
+}
+
+void mcache_drop_all_stats() {
+    for (int i = 0; i < MCACHE_ENTRIES; i++)
+	stat_entries[i].used = 0;
+}
+
+void mcache_stats(MFS_CacheStats_t *stats) {
+    *stats = mcache_counters;
+}
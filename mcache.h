@@ -0,0 +1,29 @@
+#ifndef __mcache_h__
+#define __mcache_h__
+
+#include "mfs.h"
+
+// Client-side metadata cache: (pinum, name) -> inum lookups, negative ones
+// included, and inum -> MFS_Stat_t. Each entry lives until the lease the
+// server granted with the reply it came from runs out (times are in
+// microseconds on the caller's clock); the library drops entries its own
+// updates make stale, but nothing tells it of other clients' updates, so
+// an entry may name an inode that was freed and reused meanwhile. Both
+// tables are direct mapped, so a new entry simply replaces whatever shared
+// its slot.
+
+#define MCACHE_ENTRIES (4096)
+
+int mcache_lookup(int pinum, char *name, long now, int *inum);
+void mcache_put_lookup(int pinum, char *name, int inum, long expires);
+int mcache_drop_lookup(int pinum, char *name);
+void mcache_drop_dir(int pinum);
+
+int mcache_stat(int inum, long now, MFS_Stat_t *m);
+void mcache_put_stat(int inum, MFS_Stat_t *m, long expires);
+void mcache_drop_stat(int inum);
+void mcache_drop_all_stats();
+
+void mcache_stats(MFS_CacheStats_t *stats);
+
+#endif // __mcache_h__
@@ -1,6 +1,8 @@
 #ifndef __message_h__
 #define __message_h__
 
+#include <stdint.h>
+
 #define MFS_INIT (1)
 #define MFS_LOOKUP (2)
 #define MFS_STAT (3)
@@ -9,8 +11,17 @@
 #define MFS_CRET (6)
 #define MFS_UNLINK (7)
 #define MFS_SHUTDOWN (8)
+#define MFS_BREAD (9)
+#define MFS_BWRITE (10)
+#define MFS_LOOKUPPATH (11)
+#define MFS_COMPOUND (12)
+#define MFS_READDIR (13)
+#define MFS_STATS (14)
+#define MFS_LINK (15)
+#define MFS_REPLICATE (16)
 
 
+// Legacy (version 1) message: every request and reply is the whole struct
 typedef struct {
     int mtype; // message type from above
     int rc;    // return code
@@ -22,4 +33,212 @@ typedef struct {
     int inum;
 } message_t;
 
+// Compact (version 2) message: a fixed header followed by len bytes of
+// payload, which is a NUL-terminated name for MFS_LOOKUP, MFS_CRET and
+// MFS_UNLINK, the data for MFS_WRITE requests and MFS_READ replies, and
+// empty otherwise. A legacy message starts with a small mtype, so the
+// magic in the first two bytes tells the formats apart; the server
+// answers every request in the format it arrived in.
+#define MFS_WIRE_MAGIC   (0x4d46)
+#define MFS_WIRE_VERSION (2)
+#define MFS_MAX_DATAGRAM (65507)
+
+typedef struct {
+    uint16_t magic;   // MFS_WIRE_MAGIC
+    uint8_t  version; // MFS_WIRE_VERSION of the sender
+    uint8_t  mtype;   // message type from above
+    uint32_t reqid;   // chosen by the client, echoed in the reply
+    int32_t  rc;      // return code
+    int32_t  inum;
+    int32_t  offset;
+    int32_t  nbytes;
+    uint16_t type;
+    uint16_t len;     // payload bytes following the header
+} mfs_hdr_t;
+
+#define MFS_MAX_PAYLOAD (MFS_MAX_DATAGRAM - sizeof(mfs_hdr_t))
+
+// Replies to MFS_LOOKUP, MFS_STAT and MFS_READ carry in offset a lease: how
+// many milliseconds the client may go on using the result without asking
+// again. Servers that grant none leave it 0.
+//
+// An MFS_READ request with type MFS_READ_PARTIAL may be answered with fewer
+// bytes than asked for where the range runs past the end of the file; the
+// reply's nbytes says how many.
+#define MFS_READ_PARTIAL (1)
+
+// A successful MFS_CRET reply carries in inum the new entry's inode number
+// (or that of the entry already there under the name).
+
+// Namespace sharding (MFS_InitServers in mfs.h) spreads one namespace over
+// several servers, each with an image of its own. A directory entry may
+// then refer to an inode on another server: its inum is that inode's
+// global number with MFS_REMOTE set, and such an entry is never followed
+// by the server holding it. Lookups return it as it is and MFS_READDIR
+// lists it with size -1. The ops that build such entries:
+//  - MFS_CRET with inum -1 creates an inode that no entry refers to, the
+//    target of an entry to be made elsewhere; for a directory, offset is
+//    the global number of its parent, which ".." then refers to.
+//  - MFS_LINK adds the name in directory inum as an entry for the remote
+//    inode nbytes (a global number), and replies like MFS_CRET.
+//  - MFS_UNLINK of a remote entry only removes the entry; the reply's type
+//    is MFS_UNLINK_REMOTE and its inum the entry's. MFS_UNLINK with inum
+//    -1 then frees the inode offset made by MFS_CRET with inum -1, unless
+//    it is a directory with entries; it fails for any other inode.
+// None of them is open to legacy messages.
+#define MFS_REMOTE        (0x40000000)
+#define MFS_UNLINK_REMOTE (1)
+
+// MFS_LOOKUPPATH resolves a '/'-separated path, its payload, starting from
+// the directory inum; empty components are skipped, so "/a//b" is "a/b".
+// The reply's inum is that of the last component, or -1 if one is missing,
+// and nbytes says how many components were resolved. With type
+// MFS_PATH_STAT the reply payload holds an mfs_path_ent_t for each of them,
+// in order. The reply carries a lease for all of it. A walk that reaches an
+// entry for an inode on another server (MFS_REMOTE) before the last
+// component stops there with rc MFS_PATH_REMOTE, inum that entry's and
+// nbytes counting it; its mfs_path_ent_t has size -1.
+#define MFS_MAX_PATH    (4096)  // including the NUL
+#define MFS_PATH_STAT   (1)
+#define MFS_PATH_REMOTE (1)
+
+typedef struct {
+    int32_t inum;
+    int32_t type;
+    int32_t size;
+} mfs_path_ent_t;
+
+// Replication (see server.c): a primary logs every change it makes to its
+// image as an mfs_repl_t, numbered in the order the changes were made, and
+// sends the log to its backups in MFS_REPLICATE requests, each with as
+// many consecutive entries as fit. An entry is followed by len bytes: the
+// name for MFS_CRET, MFS_LINK and MFS_UNLINK, the data for MFS_WRITE. Its
+// other fields are those of the request that would make the change, and
+// for MFS_CRET target is the inode number the primary gave the new inode,
+// which the backup gives it too. A backup applies entries strictly in
+// order, skipping those it has applied before. Its reply's payload is the
+// uint64_t number of the last entry it has applied (and made durable); rc
+// MFS_REPL_GAP says entries were missing before the ones sent, which the
+// primary then sends again from its log. An empty request just asks.
+#define MFS_REPL_GAP (1)
+
+typedef struct {
+    uint64_t seq;      // position in the primary's log, from 1
+    int32_t  mtype;    // MFS_CRET, MFS_LINK, MFS_WRITE or MFS_UNLINK
+    int32_t  inum;
+    int32_t  offset;
+    int32_t  nbytes;
+    int32_t  type;
+    int32_t  target;   // for MFS_CRET
+    int32_t  len;      // bytes following
+    int32_t  unused;
+} mfs_repl_t;
+
+// Bulk transfers (MFS_BREAD, MFS_BWRITE) move up to MFS_MAX_FRAGS fragments
+// of MFS_FRAG_SIZE bytes in one call. The header's offset and nbytes
+// describe the whole transfer and every datagram's payload starts with an
+// mfs_frag_t:
+//  - a bulk write sends each fragment as its own datagram, with index set.
+//    Fragments flagged MFS_FRAG_PROBE are answered with rc MFS_BULK_PARTIAL
+//    and bits holding the fragments received so far, until the last one
+//    arrives and the write is applied and answered like MFS_WRITE.
+//  - a bulk read request has bits naming the fragments wanted; each comes
+//    back in its own reply datagram with index set. A failed read gets a
+//    single reply with rc -1 and no payload.
+// Only missing fragments are ever sent again.
+#define MFS_FRAG_SIZE    (32768)
+#define MFS_MAX_FRAGS    (128)
+#define MFS_FRAG_PROBE   (1)
+#define MFS_BULK_PARTIAL (1)
+
+typedef struct {
+    uint16_t index;                   // fragment number
+    uint16_t flags;                   // MFS_FRAG_PROBE
+    uint8_t  bits[MFS_MAX_FRAGS / 8]; // a set of fragments, first in the MSB
+} mfs_frag_t;
+
+#define MFS_FRAG_HAS(bits, i) ((bits)[(i) / 8] & (0x80 >> ((i) % 8)))
+#define MFS_FRAG_SET(bits, i) ((bits)[(i) / 8] |= (0x80 >> ((i) % 8)))
+
+// MFS_COMPOUND carries up to MFS_MAX_OPS operations (MFS_LOOKUP, MFS_STAT,
+// MFS_WRITE, MFS_CRET or MFS_UNLINK), each an mfs_op_t followed by len
+// bytes of what its own request's payload would hold. The server runs them
+// in order and replies with an mfs_result_t for each, nbytes saying how
+// many, and rc 0 only if all succeeded. An op flagged MFS_OP_REF holds in
+// inum the index of an earlier op and runs on the inode that op produced:
+// the one looked up, created, stat'ed or written. It fails if that op did.
+#define MFS_MAX_OPS (256)
+#define MFS_OP_REF  (1)
+
+typedef struct {
+    uint8_t  mtype;
+    uint8_t  flags;   // MFS_OP_REF
+    uint16_t len;     // bytes following
+    int32_t  inum;
+    int32_t  offset;
+    int32_t  nbytes;
+    int32_t  type;
+} mfs_op_t;
+
+typedef struct {
+    int32_t rc;
+    int32_t inum;     // the inode the op produced, or -1
+    int32_t type;     // for MFS_STAT
+    int32_t size;
+} mfs_result_t;
+
+// MFS_READDIR lists the live entries of directory inum from the entry slot
+// offset (0 to start), at most nbytes of them. The reply packs each as an
+// mfs_dirent_t followed by namelen bytes of name and a NUL, with no
+// alignment. nbytes says how many entries there are, offset is the cookie
+// to continue from, and type is MFS_READDIR_EOF once none are left. With
+// type MFS_READDIR_PLUS in the request, each entry carries its inode's
+// type and size; size is -1 if the inode went away while being listed.
+#define MFS_READDIR_PLUS (1)
+#define MFS_READDIR_EOF  (1)
+
+typedef struct {
+    int32_t  inum;
+    int32_t  size;
+    uint16_t type;
+    uint16_t namelen;
+} mfs_dirent_t;
+
+// MFS_STATS asks for the server's counters since it started. The reply
+// payload is an mfs_stats_t, or with type MFS_STATS_TEXT the same figures
+// as NUL-terminated text with p50 and p99 latencies; both are too large
+// for a legacy reply. ops[] is indexed by message type (0 counts unknown
+// ones). A latency histogram counts requests by the time they took: bucket
+// i those under 2^i microseconds, and the last also every slower one.
+// handler_us is the time spent handling a request, total_us the time from
+// the receipt of its datagram until its reply was sent. A server serving
+// its port from several sockets (shards) counts the datagrams each
+// received, in shard_datagrams[] up to num_shards (the rest add up in the
+// last); num_shards is 0 for a server with one socket.
+#define MFS_STATS_TEXT    (1)
+#define MFS_STATS_OPS     (17)
+#define MFS_STATS_BUCKETS (24)
+#define MFS_STATS_SHARDS  (64)
+
+typedef struct {
+    uint64_t requests;
+    uint64_t errors;      // replies with a negative rc
+    uint64_t bytes_in;    // datagram bytes received
+    uint64_t bytes_out;   // datagram bytes sent
+    uint64_t handler_us[MFS_STATS_BUCKETS];
+    uint64_t total_us[MFS_STATS_BUCKETS];
+} mfs_op_stats_t;
+
+typedef struct {
+    uint64_t uptime_ms;
+    int32_t  free_inodes;
+    int32_t  num_inodes;
+    int32_t  free_blocks;
+    int32_t  num_blocks;
+    mfs_op_stats_t ops[MFS_STATS_OPS];
+    int32_t  num_shards;
+    int32_t  unused;
+    uint64_t shard_datagrams[MFS_STATS_SHARDS];
+} mfs_stats_t;
+
 #endif // __message_h__
@@ -27,4 +27,168 @@ int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
 
+// Namespace sharding: MFS_InitServers spreads one namespace over n servers,
+// each with an image of its own; server i is ports[i] on hostnames[i], and
+// every client must list the same servers in the same order. The root
+// directory is the first server's. The entries of a directory are created
+// on the server picked by a hash of its inode number, which may not be the
+// one holding the directory itself; the directory's entries then refer to
+// them remotely. An inode number holds the index of its server from bit
+// MFS_SERVER_SHIFT up, so every call goes straight to the server holding
+// the inode it names. All servers must speak the compact wire format.
+// Batches run one call per operation, MFS_GetStats and MFS_GetStatsText
+// report on the first server, and MFS_Shutdown stops all of them.
+#define MFS_MAX_SERVERS  (64)
+#define MFS_SERVER_SHIFT (24)
+
+int MFS_InitServers(char **hostnames, int *ports, int n);
+
+// Replication: MFS_InitReplicas talks to one namespace served by a primary,
+// ports[0] on hostnames[0], and its backups (server -r and -B). Updates go
+// to the primary, which answers once the backups have applied them, so
+// reads may go anywhere: MFS_Read, MFS_ReadBulk, MFS_Stat, MFS_Lookup and
+// path lookups are spread over all of them in turn. A backup the primary
+// has left behind (see repl.h) may answer from before recent updates
+// until it catches up. MFS_Shutdown stops all of them.
+int MFS_InitReplicas(char **hostnames, int *ports, int n);
+
+// Path lookups resolve a '/'-separated path of up to 4095 bytes from the
+// root directory with a single call, rather than one MFS_Lookup per
+// component. MFS_LookupPath returns the inum of the last component ("/" is
+// the root, 0), or -1 if any is missing. MFS_LookupPathStat fills inums[i]
+// and stats[i] for each of the first max components (either array may be
+// null) and returns how many components the path has, or -1.
+int MFS_LookupPath(char *path);
+int MFS_LookupPathStat(char *path, int *inums, MFS_Stat_t *stats, int max);
+
+// Directory listing: MFS_ReadDir stores up to max of a directory's live
+// entries ("." and ".." included) in ents, continuing from *cookie (0 to
+// start), and updates *cookie for the next call. When stats is not null
+// each entry's attributes are stored there too (size -1 if the entry went
+// away meanwhile), fetched with the same call. Returns how many entries
+// were stored, 0 once the directory is done, or -1.
+int MFS_ReadDir(int inum, int *cookie, MFS_DirEnt_t *ents, MFS_Stat_t *stats, int max);
+
+// Batches: lookups, stats, writes, creates and unlinks added to a batch are
+// sent together by MFS_BatchSubmit, in as few calls as they fit in, and
+// run in order. Each MFS_Batch call returns the new operation's index, or
+// -1 for invalid arguments. Wherever an inum is taken, MFS_BATCH_REF(i)
+// stands for the inode operation i produced (the one it looked up,
+// created, stat'ed or wrote), and the operation fails if operation i did.
+// Write data is copied. MFS_BatchSubmit returns 0 if every operation
+// succeeded and -1 otherwise; MFS_BatchResult then gives an operation's
+// return value, the inode it produced and, for a stat, the attributes.
+typedef struct MFS_Batch MFS_Batch_t;
+
+#define MFS_BATCH_REF(i) (-2 - (i))
+
+MFS_Batch_t *MFS_BatchNew();
+int MFS_BatchLookup(MFS_Batch_t *b, int pinum, char *name);
+int MFS_BatchStat(MFS_Batch_t *b, int inum);
+int MFS_BatchWrite(MFS_Batch_t *b, int inum, char *buffer, int offset, int nbytes);
+int MFS_BatchCreat(MFS_Batch_t *b, int pinum, int type, char *name);
+int MFS_BatchUnlink(MFS_Batch_t *b, int pinum, char *name);
+int MFS_BatchSubmit(MFS_Batch_t *b);
+int MFS_BatchResult(MFS_Batch_t *b, int op, int *inum, MFS_Stat_t *m);
+void MFS_BatchFree(MFS_Batch_t *b);
+
+// Calls are retransmitted on an adaptive timer until they get a reply or
+// timeout_ms (default 5000) has passed, after which they fail with -1
+int MFS_SetTimeout(int timeout_ms);
+
+// Asynchronous calls: each sends its request and returns a handle at once,
+// or -1 on error or when MFS_MAX_INFLIGHT calls are already in flight.
+// MFS_Poll returns 1 once the reply for a handle has arrived and 0 before.
+// MFS_Wait blocks for it, releases the handle and returns what the
+// synchronous call would have returned. Read and stat results are stored
+// when the reply arrives, so those buffers must stay valid until then.
+#define MFS_MAX_INFLIGHT (64)
+
+int MFS_LookupAsync(int pinum, char *name);
+int MFS_StatAsync(int inum, MFS_Stat_t *m);
+int MFS_WriteAsync(int inum, char *buffer, int offset, int nbytes);
+int MFS_ReadAsync(int inum, char *buffer, int offset, int nbytes);
+int MFS_Poll(int req);
+int MFS_Wait(int req);
+
+// Bulk transfers move up to MFS_MAX_BULK bytes with one call, as a train of
+// large datagrams of which only lost ones are sent again. They return what
+// MFS_Read and MFS_Write would for the same range. Against an old server
+// they fall back to one call per block.
+#define MFS_MAX_BULK (4 << 20)
+
+int MFS_ReadBulk(int inum, char *buffer, int offset, int nbytes);
+int MFS_WriteBulk(int inum, char *buffer, int offset, int nbytes);
+
+// Metadata caching, off by default: once enabled, lookups (including failed
+// ones) and stats are answered locally for as long as the lease the server
+// granted with the original reply. This client's own creates, unlinks and
+// writes drop the entries they change; changes by other clients show up
+// once the lease runs out. Until then a name another client has unlinked
+// still looks up to its old inode number, even if a create has since
+// reused that number for a different file, and stats of that number
+// describe the old file. Applications sharing files between clients must
+// allow for that, or run the server with a lease of 0 (-l 0), which turns
+// the caching off.
+typedef struct {
+    long lookup_hits;
+    long lookup_misses;
+    long stat_hits;
+    long stat_misses;
+    long block_hits;      // MFS_Read blocks served from the block cache
+    long block_misses;
+    long readaheads;      // blocks prefetched
+    long writebacks;      // held-back writes sent
+} MFS_CacheStats_t;
+
+int MFS_EnableCache(int enable);
+int MFS_GetCacheStats(MFS_CacheStats_t *stats);
+
+// Block caching, off by default: MFS_SetBlockCache gives the client a cache
+// of nblocks blocks (at least 4; 0 removes it). MFS_Read and MFS_Write then
+// go through it. Writes are held back, merged into whole blocks, and sent
+// when the file is stat'ed or closed, when they are a second old (checked
+// on every call into the library), or when their blocks are needed for
+// other data. Reads of a file in sequence prefetch the blocks ahead. Cached
+// data lasts for the lease the server grants with it, and may be stale for
+// that long if other clients write the file or reuse its inode number, as
+// with metadata caching. A held-back write that fails is reported by
+// MFS_Close.
+int MFS_SetBlockCache(int nblocks);
+int MFS_Close(int inum);
+
+// Server statistics since the server started. ops[] is indexed by request
+// type, numbered as on the wire (2 lookup, 3 stat, 4 write, 5 read, ...;
+// 0 counts unknown ones). A latency histogram counts requests by the time
+// they took: bucket i those under 2^i microseconds, the last also every
+// slower one. MFS_GetStatsText stores the same figures as text, with p50
+// and p99 latencies, in buffer (at most len bytes, NUL included). Both
+// return 0, or -1 if the server keeps no statistics.
+#define MFS_STATS_OPS     (17)
+#define MFS_STATS_BUCKETS (24)
+#define MFS_STATS_SHARDS  (64)
+
+typedef struct {
+    long requests;
+    long errors;
+    long bytes_in;
+    long bytes_out;
+    long handler_us[MFS_STATS_BUCKETS];  // time spent handling the request
+    long total_us[MFS_STATS_BUCKETS];    // from receipt to reply sent
+} MFS_OpStats_t;
+
+typedef struct {
+    long uptime_ms;
+    int free_inodes;
+    int num_inodes;
+    int free_blocks;
+    int num_blocks;
+    MFS_OpStats_t ops[MFS_STATS_OPS];
+    int num_shards;                          // sockets serving the port, 0 if one
+    long shard_datagrams[MFS_STATS_SHARDS];  // datagrams each received
+} MFS_ServerStats_t;
+
+int MFS_GetStats(MFS_ServerStats_t *stats);
+int MFS_GetStatsText(char *buffer, int len);
+
 #endif // __MFS_h__
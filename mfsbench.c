@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "mfs.h"
+
+// Load generator: runs a mix of operations through libmfs from a number of
+// client processes (the library keeps one connection per process) against
+// a running server (or, given several ports, the servers a namespace is
+// sharded over, or with -R a primary and its backups), or one it starts
+// on an image. Each client works in its own directory of files created
+// before the clock starts. Results are printed as key=value lines, one for
+// the run and one per operation, so runs can be compared by script.
+
+// Workload operations; churn creates a file and unlinks it again, each
+// counted as an operation of its own
+enum { OP_LOOKUP, OP_STAT, OP_WRITE, OP_READ, OP_CREAT, OP_UNLINK, NOPS };
+static const char *op_names[NOPS] = { "lookup", "stat", "write", "read", "creat", "unlink" };
+
+// Mix weights are given per workload: lookup, stat, write, read and churn
+#define NWORKLOADS (5)
+static const char *workload_names[NWORKLOADS] = { "lookup", "stat", "write", "read", "churn" };
+
+// Latency histogram with 16 linear sub-buckets per power of two, so a
+// percentile is within about 6% of the true value
+#define SUB_BITS  (4)
+#define NBUCKETS  ((64 - SUB_BITS) << SUB_BITS)
+
+typedef struct {
+    long ops;
+    long errors;
+    long hist[NBUCKETS];    // latencies in microseconds
+} op_result_t;
+
+// Shared with the clients: a start signal and each client's results
+typedef struct {
+    int ready;              // clients done setting up
+    int go;                 // set once all are ready
+    int failed;             // clients that could not set up
+    op_result_t results[];  // NOPS per client
+} shared_t;
+
+static char *host = "localhost";
+static int port = 0;
+static int ports[MFS_MAX_SERVERS];  // with -p, one per shard of the namespace
+static int nports = 0;
+static int replicated = 0;          // -R: the ports are a primary and its backups
+static int clients = 1;
+static double seconds = 5;
+static int weights[NWORKLOADS] = { 0 };
+static int nfiles = 100;          // files per client
+static int file_blocks = 16;      // blocks written to each file at setup
+static int write_size = 256;      // bytes per small random write
+static int meta_cache = 0;
+static int block_cache = 0;       // blocks, 0 for none
+static unsigned seed = 1;
+
+static long now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+static int bucket(long us) {
+    if (us < (1 << SUB_BITS))
+        return us < 0 ? 0 : us;
+    int e = 63 - __builtin_clzl(us);
+    return ((e - SUB_BITS + 1) << SUB_BITS) + ((us >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+// Midpoint of a bucket's range
+static double bucket_value(int b) {
+    if (b < (1 << SUB_BITS))
+        return b;
+    int e = (b >> SUB_BITS) + SUB_BITS - 1;
+    long width = 1L << (e - SUB_BITS);
+    return (1L << e) + (b & ((1 << SUB_BITS) - 1)) * width + width / 2.0;
+}
+
+static double percentile(long *hist, long n, double p) {
+    long rank = (long)(p * n), seen = 0;
+    for (int b = 0; b < NBUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank)
+            return bucket_value(b);
+    }
+    return 0;
+}
+
+static void add(op_result_t *to, op_result_t *r) {
+    to->ops += r->ops;
+    to->errors += r->errors;
+    for (int b = 0; b < NBUCKETS; b++)
+        to->hist[b] += r->hist[b];
+}
+
+static void record(op_result_t *r, long start, int rc) {
+    r->ops++;
+    if (rc < 0)
+        r->errors++;
+    r->hist[bucket(now_us() - start)]++;
+}
+
+// Creates the client's directory and files. Returns the directory's inum,
+// or -1.
+static int setup(int id, int *inums, char *buffer) {
+    char name[28];
+    sprintf(name, "bench%d", id);
+    if (MFS_Creat(0, MFS_DIRECTORY, name) < 0)
+        return -1;
+    int dir = MFS_Lookup(0, name);
+    if (dir < 0)
+        return -1;
+    for (int i = 0; i < nfiles; i++) {
+        sprintf(name, "f%d", i);
+        if (MFS_Creat(dir, MFS_REGULAR_FILE, name) < 0 || (inums[i] = MFS_Lookup(dir, name)) < 0)
+            return -1;
+        for (int b = 0; b < file_blocks; b++)
+            if (MFS_Write(inums[i], buffer, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) < 0)
+                return -1;
+    }
+    return dir;
+}
+
+// Connects to the server, to every shard of a sharded namespace, or with
+// -R to a primary and its backups. Returns 0, or -1.
+static int connect_servers() {
+    if (nports <= 1)
+        return MFS_Init(host, port);
+    char *hosts[MFS_MAX_SERVERS];
+    for (int i = 0; i < nports; i++)
+        hosts[i] = host;
+    return replicated ? MFS_InitReplicas(hosts, ports, nports) : MFS_InitServers(hosts, ports, nports);
+}
+
+static void client(int id, shared_t *shared) {
+    op_result_t *results = &shared->results[id * NOPS];
+    int *inums = malloc(nfiles * sizeof(int));
+    char buffer[MFS_BLOCK_SIZE], name[28];
+    memset(buffer, 'b', sizeof(buffer));
+    unsigned rng = seed + id;
+
+    int dir = -1;
+    if (connect_servers() == 0) {
+        MFS_EnableCache(meta_cache);
+        if (block_cache)
+            MFS_SetBlockCache(block_cache);
+        dir = setup(id, inums, buffer);
+    }
+    if (dir < 0)
+        __atomic_fetch_add(&shared->failed, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&shared->ready, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&shared->go, __ATOMIC_SEQ_CST))
+        usleep(1000);
+    if (dir < 0)
+        exit(1);
+
+    int total = 0;
+    for (int w = 0; w < NWORKLOADS; w++)
+        total += weights[w];
+    int read_file = 0, read_block = 0, churn = 0;
+    long end = now_us() + (long)(seconds * 1e6);
+    while (now_us() < end) {
+        int pick = rand_r(&rng) % total, w = 0;
+        while (pick >= weights[w])
+            pick -= weights[w++];
+        int f = rand_r(&rng) % nfiles;
+        long start = now_us();
+        MFS_Stat_t st;
+        switch (w) {
+        case 0:
+            sprintf(name, "f%d", f);
+            record(&results[OP_LOOKUP], start, MFS_Lookup(dir, name));
+            break;
+        case 1:
+            record(&results[OP_STAT], start, MFS_Stat(inums[f], &st));
+            break;
+        case 2: {
+            int offset = rand_r(&rng) % (file_blocks * MFS_BLOCK_SIZE - write_size + 1);
+            record(&results[OP_WRITE], start, MFS_Write(inums[f], buffer, offset, write_size));
+            break;
+        }
+        case 3:
+            // Each client reads its files through in order
+            record(&results[OP_READ], start,
+                   MFS_Read(inums[read_file], buffer, read_block * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE));
+            if (++read_block == file_blocks) {
+                read_block = 0;
+                read_file = (read_file + 1) % nfiles;
+            }
+            break;
+        case 4:
+            sprintf(name, "t%d", churn++);
+            record(&results[OP_CREAT], start, MFS_Creat(dir, MFS_REGULAR_FILE, name));
+            start = now_us();
+            record(&results[OP_UNLINK], start, MFS_Unlink(dir, name));
+            break;
+        }
+    }
+    exit(0);
+}
+
+// Parses a mix: a workload name, or name=weight pairs separated by commas
+static int parse_mix(char *arg) {
+    memset(weights, 0, sizeof(weights));
+    char *save, *item;
+    for (item = strtok_r(arg, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int weight = 1;
+        if (eq) {
+            *eq = '\0';
+            weight = atoi(eq + 1);
+        }
+        int w = 0;
+        while (w < NWORKLOADS && strcmp(item, workload_names[w]) != 0)
+            w++;
+        if (w == NWORKLOADS || weight < 0)
+            return -1;
+        weights[w] = weight;
+    }
+    int total = 0;
+    for (int w = 0; w < NWORKLOADS; w++)
+        total += weights[w];
+    return total > 0 ? 0 : -1;
+}
+
+// Starts a server on image, at a port picked from our pid. Returns its pid.
+static pid_t start_server(char *path, char *image, char *workers) {
+    port = 20000 + getpid() % 20000;
+    char portarg[16];
+    sprintf(portarg, "%d", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(path, path, "-t", workers, portarg, image, (char *)NULL);
+        perror(path);
+        exit(1);
+    }
+    usleep(300000);
+    return pid;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: mfsbench [-h <host>] [-p <port>[,<port>...] | -i <image> [-x <server> -t <workers>]]\n"
+            "                [-c <clients>] [-d <seconds>] [-m <mix>] [-n <files>] [-b <blocks>]\n"
+            "                [-w <write_bytes>] [-M] [-B <cache_blocks>] [-r <seed>] [-R] [-v]\n"
+            "  mix: lookup, stat, write, read or churn, or weights such as lookup=6,stat=3,write=1\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    char *image = 0, *server = "./server", *workers = "4", *mix = "mix";
+    char mixarg[256] = "lookup=4,stat=3,write=1,read=1,churn=1";
+    int verbose = 0, c;
+    while ((c = getopt(argc, argv, "h:p:i:x:t:c:d:m:n:b:w:MB:r:Rv")) != -1) {
+        switch (c) {
+            case 'h': host = optarg; break;
+            case 'p':
+                for (char *p = strtok(optarg, ","); p && nports < MFS_MAX_SERVERS; p = strtok(NULL, ","))
+                    ports[nports++] = atoi(p);
+                port = ports[0];
+                break;
+            case 'i': image = optarg; break;
+            case 'x': server = optarg; break;
+            case 't': workers = optarg; break;
+            case 'c': clients = atoi(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'm': mix = optarg; snprintf(mixarg, sizeof(mixarg), "%s", optarg); break;
+            case 'n': nfiles = atoi(optarg); break;
+            case 'b': file_blocks = atoi(optarg); break;
+            case 'w': write_size = atoi(optarg); break;
+            case 'M': meta_cache = 1; break;
+            case 'B': block_cache = atoi(optarg); break;
+            case 'r': seed = atoi(optarg); break;
+            case 'R': replicated = 1; break;
+            case 'v': verbose = 1; break;
+            default: usage();
+        }
+    }
+    if ((port <= 0) == (image == 0) || clients < 1 || seconds <= 0 || nfiles < 1 || file_blocks < 1 ||
+        write_size < 1 || write_size > MFS_BLOCK_SIZE || parse_mix(mixarg) < 0)
+        usage();
+
+    pid_t server_pid = image ? start_server(server, image, workers) : 0;
+
+    size_t size = sizeof(shared_t) + (size_t)clients * NOPS * sizeof(op_result_t);
+    shared_t *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    for (int i = 0; i < clients; i++)
+        if (fork() == 0)
+            client(i, shared);
+
+    // Time the run from when every client has set up
+    while (__atomic_load_n(&shared->ready, __ATOMIC_SEQ_CST) < clients)
+        usleep(1000);
+    long start = now_us();
+    __atomic_store_n(&shared->go, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < clients; i++)
+        wait(NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    // Sum the clients' results per operation and overall
+    op_result_t *sum = calloc(NOPS + 1, sizeof(op_result_t));
+    for (int i = 0; i < clients; i++) {
+        for (int op = 0; op < NOPS; op++) {
+            add(&sum[op], &shared->results[i * NOPS + op]);
+            add(&sum[NOPS], &shared->results[i * NOPS + op]);
+        }
+    }
+
+    op_result_t *all = &sum[NOPS];
+    printf("mfsbench mix=%s clients=%d seconds=%.2f files=%d file_blocks=%d meta_cache=%d block_cache=%d "
+           "failed_clients=%d ops=%ld errors=%ld ops_per_s=%.0f p50_us=%.0f p90_us=%.0f p99_us=%.0f p999_us=%.0f\n",
+           mix, clients, elapsed, nfiles, file_blocks, meta_cache, block_cache, shared->failed, all->ops,
+           all->errors, all->ops / elapsed, percentile(all->hist, all->ops, 0.5),
+           percentile(all->hist, all->ops, 0.9), percentile(all->hist, all->ops, 0.99),
+           percentile(all->hist, all->ops, 0.999));
+    for (int op = 0; op < NOPS; op++) {
+        op_result_t *r = &sum[op];
+        if (r->ops == 0)
+            continue;
+        printf("op=%s ops=%ld errors=%ld ops_per_s=%.0f p50_us=%.0f p90_us=%.0f p99_us=%.0f p999_us=%.0f\n",
+               op_names[op], r->ops, r->errors, r->ops / elapsed, percentile(r->hist, r->ops, 0.5),
+               percentile(r->hist, r->ops, 0.9), percentile(r->hist, r->ops, 0.99),
+               percentile(r->hist, r->ops, 0.999));
+    }
+
+    // The server's own view, and shutting down one we started
+    if (verbose || server_pid) {
+        if (connect_servers() == 0) {
+            char text[8192];
+            if (verbose && MFS_GetStatsText(text, sizeof(text)) == 0)
+                fputs(text, stderr);
+            if (server_pid)
+                MFS_Shutdown();
+        }
+    }
+    if (server_pid)
+        waitpid(server_pid, NULL, 0);
+    return shared->failed > 0;
+}
@@ -1,35 +1,80 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "ufs.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-j <journal_blocks>] [-p] [-v]\n");
     exit(1);
 }
 
+// Reserves disk space for blocks [first, first + len) of the image, so the
+// server's writes there find it allocated and laid out together. Left
+// sparse where the file system cannot do that.
+void reserve(int fd, long long first, long long len) {
+    if (len == 0)
+	return;
+    if (fallocate(fd, 0, first * UFS_BLOCK_SIZE, len * UFS_BLOCK_SIZE) < 0 && errno != EOPNOTSUPP) {
+	perror("fallocate");
+	exit(1);
+    }
+}
+
+// Writes count blocks, block i from bufs[i] to address addrs[i], addresses
+// increasing: each run of consecutive addresses with one vectored write
+void write_blocks(int fd, long long *addrs, void **bufs, int count) {
+    struct iovec iov[IOV_MAX];
+    int i = 0;
+    while (i < count) {
+	int n = 0;
+	do {
+	    iov[n].iov_base = bufs[i + n];
+	    iov[n].iov_len = UFS_BLOCK_SIZE;
+	    n++;
+	} while (i + n < count && n < IOV_MAX && addrs[i + n] == addrs[i] + n);
+	ssize_t rc = pwritev(fd, iov, n, addrs[i] * UFS_BLOCK_SIZE);
+	if (rc != (ssize_t)n * UFS_BLOCK_SIZE) {
+	    perror("write");
+	    exit(1);
+	}
+	i += n;
+    }
+}
+
 int main(int argc, char *argv[]) {
     int ch;
     char *image_file = NULL;
     int num_inodes = 32;
-    int num_data_blocks = 32;
+    long long num_data_blocks = 32;
+    long long journal_blocks = UFS_JOURNAL_MIN_LEN;
+    int preallocate = 0;
     int visual = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:j:pv")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
 	    break;
 	case 'd':
-	    num_data_blocks = atoi(optarg);
+	    num_data_blocks = atoll(optarg);
 	    break;
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'j':
+	    journal_blocks = atoll(optarg);
+	    break;
+	case 'p':
+	    preallocate = 1;
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
@@ -43,145 +88,116 @@ int main(int argc, char *argv[]) {
     if (image_file == NULL)
 	usage();
 
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
-    }
-
-    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-	perror("open");
-	exit(1);
-    }
-
     assert(num_inodes >= 32);
     assert(num_data_blocks >= 32);
+    assert(journal_blocks == 0 || journal_blocks >= UFS_JOURNAL_MIN_LEN);
 
     // presumed: block 0 is the super block
     super_t s;
+    memset(&s, 0, sizeof(super_t));
 
     // Total inodes and data blocks 
     s.num_data_blocks = num_data_blocks;
     s.num_inodes = num_inodes;
+    s.version = UFS_VERSION;
 
     // inode bitmap
-    int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
+    long long bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
 
     s.inode_bitmap_addr = 1;
-    s.inode_bitmap_len = num_inodes / bits_per_block;
-    if (num_inodes % bits_per_block != 0)
-	s.inode_bitmap_len++;
+    s.inode_bitmap_len = (num_inodes + bits_per_block - 1) / bits_per_block;
 
     // data bitmap
     s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
-    s.data_bitmap_len = num_data_blocks / bits_per_block;
-    if (num_data_blocks % bits_per_block != 0)
-	s.data_bitmap_len++;
+    s.data_bitmap_len = (num_data_blocks + bits_per_block - 1) / bits_per_block;
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
-    s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-    if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
-	s.inode_region_len++;
+    long long total_inode_bytes = (long long)num_inodes * sizeof(inode_t);
+    s.inode_region_len = (total_inode_bytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
 
     // data blocks
     s.data_region_addr = s.inode_region_addr + s.inode_region_len;
     s.data_region_len = num_data_blocks;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    // journal, zeroed like everything else, which reads as empty
+    s.journal_addr = s.data_region_addr + s.data_region_len;
+    s.journal_len = journal_blocks;
 
-    // super block is the first block
-    int rc = pwrite(fd, &s, sizeof(super_t), 0);
-    if (rc != sizeof(super_t)) {
-	perror("write");
+    long long total_blocks = s.journal_addr + s.journal_len;
+    if (total_blocks > UFS_MAX_BLOCKS) {
+	fprintf(stderr, "mkfs: %lld blocks is more than the %lld an image may have\n", total_blocks, UFS_MAX_BLOCKS);
 	exit(1);
     }
 
-    printf("total blocks        %d\n", total_blocks);
+    int fd = open(image_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+	perror("open");
+	exit(1);
+    }
+
+    printf("total blocks        %lld\n", total_blocks);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
-    printf("  data blocks       %d\n", num_data_blocks);
+    printf("  data blocks       %lld\n", num_data_blocks);
     printf("layout details\n");
-    printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
-    printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
-
-    // first, zero out all the blocks
-    int i;
-    for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
-	    perror("write");
-	    exit(1);
-	}
+    printf("  inode bitmap address/len %lld [%lld]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
+    printf("  data bitmap address/len  %lld [%lld]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    printf("  journal address/len      %lld [%lld]\n", s.journal_addr, s.journal_len);
+
+    // Every block starts out zero, which is what extending the file gives
+    // without writing any of them: bitmaps all free, inodes unused, the
+    // journal empty. The metadata and journal are written on every update,
+    // so they are reserved now; the data region only with -p.
+    if (ftruncate(fd, total_blocks * UFS_BLOCK_SIZE) < 0) {
+	perror("ftruncate");
+	exit(1);
+    }
+    if (preallocate) {
+	reserve(fd, 0, total_blocks);
+    } else {
+	reserve(fd, 0, s.data_region_addr);
+	reserve(fd, s.journal_addr, s.journal_len);
     }
 
-    //
-    // need to allocate first inode in inode bitmap
-    //
-    typedef struct {
-	unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
-    } bitmap_t;
-    assert(sizeof(bitmap_t) == UFS_BLOCK_SIZE);
-
-    bitmap_t b;
-    for (i = 0; i < 1024; i++)
-	b.bits[i] = 0;
-    b.bits[0] = 0x80000000; // first entry is allocated
-    
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
-
-    //
-    // need to allocate first data block in data bitmap
-    // (can just reuse this to write out data bitmap too)
-    //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
-
-    //
-    // need to write out inode
-    //
-    typedef struct {
-	inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-    } inode_block;
-
-    inode_block itable;
-    itable.inodes[0].type = UFS_DIRECTORY;
-    itable.inodes[0].size = sizeof(dir_ent_t) << 1; // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
+    // What is not zero: the super block, the first inode and data block
+    // taken, and the root directory in them
+    char *blocks = calloc(5, UFS_BLOCK_SIZE);
+    if (blocks == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    char *super = blocks;
+    unsigned int *inode_bits = (unsigned int *)(blocks + UFS_BLOCK_SIZE);
+    unsigned int *data_bits = (unsigned int *)(blocks + 2 * UFS_BLOCK_SIZE);
+    inode_t *itable = (inode_t *)(blocks + 3 * UFS_BLOCK_SIZE);
+    dir_ent_t *root = (dir_ent_t *)(blocks + 4 * UFS_BLOCK_SIZE);
+
+    memcpy(super, &s, sizeof(super_t));
+    inode_bits[0] = 0x80000000; // first entry is allocated
+    data_bits[0] = 0x80000000;
+
+    itable[0].type = UFS_DIRECTORY;
+    itable[0].size = sizeof(dir_ent_t) << 1; // in bytes
+    itable[0].direct[0] = s.data_region_addr;
+    int i;
     for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
-
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+	itable[0].direct[i] = -1;
 
-    // 
-    // need to write out root directory contents to first data block
     // create a root directory, with nothing in it
-    // 
-    typedef struct {
-	dir_ent_t entries[128];
-    } dir_block_t;
-    // xxx assumes 4096 block, 32 byte entries
-    assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
-
-    dir_block_t parent;
-    strcpy(parent.entries[0].name, ".");
-    parent.entries[0].inum = 0;
-
-    strcpy(parent.entries[1].name, "..");
-    parent.entries[1].inum = 0;
-
-    for (i = 2; i < 128; i++)
-	parent.entries[i].inum = -1;
-
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    int entries = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+    strcpy(root[0].name, ".");
+    root[0].inum = 0;
+    strcpy(root[1].name, "..");
+    root[1].inum = 0;
+    for (i = 2; i < entries; i++)
+	root[i].inum = -1;
+
+    long long addrs[] = { 0, s.inode_bitmap_addr, s.data_bitmap_addr, s.inode_region_addr, s.data_region_addr };
+    void *bufs[] = { super, inode_bits, data_bits, itable, root };
+    write_blocks(fd, addrs, bufs, 5);
 
     if (visual) {
-	int i;
+	long long i;
 	printf("\nVisualization of layout\n\n");
 	printf("S");
 	for (i = 0; i < s.inode_bitmap_len; i++)
@@ -192,10 +208,15 @@ int main(int argc, char *argv[]) {
 	    printf("I");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
+	for (i = 0; i < s.journal_len; i++)
+	    printf("J");
 	printf("\n\n");
     }
 
-    (void) fsync(fd);
+    if (fsync(fd) < 0) {
+	perror("fsync");
+	exit(1);
+    }
     (void) close(fd);
     
     return 0;
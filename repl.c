@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/param.h>
+
+#include "repl.h"
+#include "journal.h"
+#include "udp.h"
+
+typedef struct {
+    char name[64];            // as given, for reports
+    struct sockaddr_in addr;
+    int known;                // has answered, so acked is its own
+    uint64_t acked;           // entries it has applied
+    uint64_t sent;            // entries sent to it
+    long sent_at;             // when entries (or a probe) last went
+    long heard_at;            // when it last answered
+    long waiting_since;       // when it last made progress, or fell behind
+    int down;                 // replies no longer wait for it
+    int lost;                 // too far behind the log to catch up
+} backup_t;
+
+static backup_t backups[REPL_MAX_BACKUPS];
+static int nbackups;
+static int repl_sd;
+static long long *repl_seq;   // the image's last entry logged
+
+// Entry seq of the log is in log_entries[seq % REPL_LOG_ENTRIES] while
+// seq >= log_first
+static char *log_entries[REPL_LOG_ENTRIES];
+static uint64_t log_first = 1;
+static long log_bytes;
+
+static pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER;
+static char send_buffer[MFS_MAX_DATAGRAM];
+static uint32_t next_reqid;
+
+// What the calling thread's replies wait for
+static __thread uint64_t pending_seq;
+
+// Totals for repl_report
+static long stat_entries, stat_waits, stat_wait_us, stat_resends;
+
+static long repl_now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000L + t.tv_nsec / 1000000;
+}
+
+static long repl_now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+// Adds a backup given as host:port. Returns 0, or -1 if spec is not one.
+int repl_add_backup(char *spec) {
+    char *colon = strrchr(spec, ':');
+    if (nbackups == REPL_MAX_BACKUPS || !colon || colon == spec || strlen(spec) >= sizeof(backups[0].name))
+	return -1;
+    backup_t *b = &backups[nbackups];
+    strcpy(b->name, spec);
+    b->name[colon - spec] = '\0';
+    int port = atoi(colon + 1);
+    if (port <= 0 || UDP_FillSockAddr(&b->addr, b->name, port) < 0)
+	return -1;
+    strcpy(b->name, spec);
+    nbackups++;
+    return 0;
+}
+
+int repl_enabled() {
+    return nbackups > 0;
+}
+
+// Sends backup b one datagram: the entries after those it was sent, as
+// many as fit and the window allows (none for a probe). The caller holds
+// repl_mutex.
+static void repl_datagram(backup_t *b, long now) {
+    mfs_hdr_t *hdr = (mfs_hdr_t *)send_buffer;
+    memset(hdr, 0, sizeof(mfs_hdr_t));
+    hdr->magic = MFS_WIRE_MAGIC;
+    hdr->version = MFS_WIRE_VERSION;
+    hdr->mtype = MFS_REPLICATE;
+    hdr->reqid = next_reqid++;
+    int len = 0;
+    while (b->known && b->sent < *repl_seq && b->sent - b->acked < REPL_WINDOW) {
+	mfs_repl_t *e = (mfs_repl_t *)log_entries[(b->sent + 1) % REPL_LOG_ENTRIES];
+	int size = sizeof(mfs_repl_t) + e->len;
+	if (sizeof(mfs_hdr_t) + len + size > MFS_MAX_DATAGRAM)
+	    break;
+	memcpy(send_buffer + sizeof(mfs_hdr_t) + len, e, size);
+	len += size;
+	b->sent++;
+    }
+    hdr->len = len;
+    UDP_Write(repl_sd, &b->addr, send_buffer, sizeof(mfs_hdr_t) + len);
+    b->sent_at = now;
+}
+
+// Sends backup b what it has not been sent, within the window, or until
+// it has answered once a probe asking where it stands. The caller holds
+// repl_mutex.
+static void repl_send_locked(backup_t *b, long now) {
+    if (b->lost)
+	return;
+    if (!b->known) {
+	if (now - b->sent_at >= REPL_RETRY_MS)
+	    repl_datagram(b, now);
+	return;
+    }
+    if (b->acked + 1 < log_first && b->acked < *repl_seq) {
+	b->lost = 1;
+	fprintf(stderr, "replication: backup %s is behind the log and needs a copy of the image\n", b->name);
+	pthread_cond_broadcast(&repl_cond);
+	return;
+    }
+    if (b->sent < b->acked)
+	b->sent = b->acked;
+    while (b->sent < *repl_seq && b->sent - b->acked < REPL_WINDOW)
+	repl_datagram(b, now);
+}
+
+// Returns whether every backup that keeps up has applied entry seq
+static int repl_confirmed(uint64_t seq) {
+    for (int i = 0; i < nbackups; i++)
+	if (!backups[i].down && !backups[i].lost && backups[i].acked < seq)
+	    return 0;
+    return 1;
+}
+
+// Takes in a backup's answer. The caller holds repl_mutex.
+static void repl_ack_locked(struct sockaddr_in *addr, char *reply, int n, long now) {
+    mfs_hdr_t *hdr = (mfs_hdr_t *)reply;
+    if (n < sizeof(mfs_hdr_t) + sizeof(uint64_t) || hdr->magic != MFS_WIRE_MAGIC ||
+	hdr->mtype != MFS_REPLICATE || hdr->rc < 0)
+	return;
+    backup_t *b = 0;
+    for (int i = 0; i < nbackups && !b; i++)
+	if (backups[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && backups[i].addr.sin_port == addr->sin_port)
+	    b = &backups[i];
+    if (!b || b->lost)
+	return;
+
+    uint64_t applied;
+    memcpy(&applied, reply + sizeof(mfs_hdr_t), sizeof(uint64_t));
+    b->heard_at = now;
+    if (applied > *repl_seq) {
+	b->lost = 1;
+	fprintf(stderr, "replication: backup %s has entries this primary never logged\n", b->name);
+    }
+    if (!b->known || applied > b->acked) {
+	b->acked = applied;
+	b->waiting_since = now;
+    }
+    b->known = 1;
+    if (hdr->rc == MFS_REPL_GAP)
+	b->sent = b->acked;
+    if (b->down && b->acked == *repl_seq) {
+	b->down = 0;
+	fprintf(stderr, "replication: backup %s caught up\n", b->name);
+    }
+    pthread_cond_broadcast(&repl_cond);
+}
+
+// Takes the backups' answers, sends again what went unanswered for
+// REPL_RETRY_MS, and leaves behind backups silent for REPL_DOWN_MS
+static void *repl_receiver(void *arg) {
+    char reply[MFS_MAX_DATAGRAM];
+    struct pollfd p = { repl_sd, POLLIN, 0 };
+    while (1) {
+	int ready = poll(&p, 1, REPL_RETRY_MS / 2);
+	struct sockaddr_in addr;
+	int n = ready > 0 ? UDP_Read(repl_sd, &addr, reply, sizeof(reply)) : -1;
+
+	pthread_mutex_lock(&repl_mutex);
+	long now = repl_now_ms();
+	if (n > 0)
+	    repl_ack_locked(&addr, reply, n, now);
+	for (int i = 0; i < nbackups; i++) {
+	    backup_t *b = &backups[i];
+	    if (b->lost || (b->known && b->acked >= (uint64_t)*repl_seq))
+		continue;
+	    if (!b->down && now - b->waiting_since >= REPL_DOWN_MS) {
+		b->down = 1;
+		fprintf(stderr, "replication: backup %s is not answering, replies no longer wait for it\n", b->name);
+		pthread_cond_broadcast(&repl_cond);
+	    }
+	    if (now - MAX(b->heard_at, b->sent_at) >= REPL_RETRY_MS) {
+		if (b->sent > b->acked)
+		    stat_resends++;
+		b->sent = b->acked;
+		repl_send_locked(b, now);
+	    }
+	}
+	pthread_mutex_unlock(&repl_mutex);
+    }
+    return 0;
+}
+
+// Starts replicating to the backups added, numbering the log on from
+// *seq, which repl_log advances
+void repl_start(long long *seq) {
+    if (!nbackups)
+	return;
+    repl_seq = seq;
+    log_first = *seq + 1;
+    repl_sd = UDP_Open(0);
+    if (repl_sd < 0) {
+	perror("replication socket");
+	exit(1);
+    }
+    UDP_SetBufferSize(repl_sd, MFS_MAX_FRAGS * MFS_FRAG_SIZE);
+    long now = repl_now_ms();
+    for (int i = 0; i < nbackups; i++) {
+	backups[i].waiting_since = now;
+	backups[i].sent_at = now - REPL_RETRY_MS;
+    }
+
+    pthread_t receiver;
+    pthread_create(&receiver, NULL, repl_receiver, NULL);
+    pthread_detach(receiver);
+}
+
+// Logs a change the calling thread is making, as part of its update:
+// op and the len bytes at data. The caller holds the locks of the inodes
+// the change involves.
+void repl_log(mfs_repl_t *op, char *data) {
+    if (!nbackups)
+	return;
+    char *e = malloc(sizeof(mfs_repl_t) + op->len);
+    pthread_mutex_lock(&repl_mutex);
+    op->seq = ++*repl_seq;
+    journal_dirty(repl_seq, sizeof(*repl_seq));
+
+    // Make room, forgetting the oldest entries
+    while (log_first < op->seq &&
+	   (op->seq - log_first >= REPL_LOG_ENTRIES || log_bytes > REPL_LOG_BYTES)) {
+	char **old = &log_entries[log_first % REPL_LOG_ENTRIES];
+	log_bytes -= sizeof(mfs_repl_t) + ((mfs_repl_t *)*old)->len;
+	free(*old);
+	*old = 0;
+	log_first++;
+    }
+    memcpy(e, op, sizeof(mfs_repl_t));
+    memcpy(e + sizeof(mfs_repl_t), data, op->len);
+    log_entries[op->seq % REPL_LOG_ENTRIES] = e;
+    log_bytes += sizeof(mfs_repl_t) + op->len;
+    stat_entries++;
+    pthread_mutex_unlock(&repl_mutex);
+    pending_seq = op->seq;
+}
+
+// Makes the calling thread's next replies wait for every entry logged so
+// far, as for an update answered from the duplicate reply cache
+void repl_depend() {
+    if (!nbackups)
+	return;
+    pthread_mutex_lock(&repl_mutex);
+    pending_seq = MAX(pending_seq, *repl_seq);
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+// Sends what the calling thread logged to the backups, if the sender has
+// not, and waits until those that keep up have applied it
+void repl_wait() {
+    if (!nbackups || pending_seq == 0)
+	return;
+    long start = repl_now_us();
+    pthread_mutex_lock(&repl_mutex);
+    long now = repl_now_ms();
+    for (int i = 0; i < nbackups; i++) {
+	backup_t *b = &backups[i];
+	if (b->down || b->sent >= pending_seq)
+	    continue;
+	if (b->known && b->sent == b->acked)
+	    b->waiting_since = now;
+	repl_send_locked(b, now);
+    }
+    while (!repl_confirmed(pending_seq))
+	pthread_cond_wait(&repl_cond, &repl_mutex);
+    stat_waits++;
+    stat_wait_us += repl_now_us() - start;
+    pthread_mutex_unlock(&repl_mutex);
+    pending_seq = 0;
+}
+
+void repl_report(FILE *f) {
+    if (!nbackups)
+	return;
+    pthread_mutex_lock(&repl_mutex);
+    fprintf(f, "replication: %ld entries logged up to %lld, %ld waits of %ld us average, %ld resends\n",
+	    stat_entries, *repl_seq, stat_waits, stat_wait_us / MAX(stat_waits, 1), stat_resends);
+    for (int i = 0; i < nbackups; i++)
+	fprintf(f, "  backup %s: applied %llu%s\n", backups[i].name, (unsigned long long)backups[i].acked,
+		backups[i].lost ? ", lost" : backups[i].down ? ", down" : "");
+    pthread_mutex_unlock(&repl_mutex);
+}
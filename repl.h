@@ -0,0 +1,39 @@
+#ifndef __repl_h__
+#define __repl_h__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "message.h"
+
+// Primary side of replication (see message.h for the protocol). Every
+// change the server makes is logged with repl_log by the fs_ function
+// making it, while that function still holds the inode locks involved, so
+// changes that touch the same inode are logged in the order they were
+// made. The log is numbered on from the image's repl_seq, which each entry
+// advances within the update's journal transaction. A sender pushes the
+// log to each backup and takes its acknowledgements; repl_wait holds the
+// calling thread until every backup that keeps up has applied what the
+// thread logged (or depends on), so replies only report replicated
+// updates. A backup that stops answering for REPL_DOWN_MS is left behind:
+// replies stop waiting for it and it is brought up to date from the log
+// once it answers again. The log keeps the last REPL_LOG_ENTRIES entries,
+// at most REPL_LOG_BYTES of them; a backup further behind than that needs
+// a fresh copy of the image.
+#define REPL_MAX_BACKUPS (16)
+#define REPL_LOG_ENTRIES (65536)
+#define REPL_LOG_BYTES   (256L << 20)
+#define REPL_MAX_DATA    (MFS_FRAG_SIZE)  // longer writes are logged in pieces
+#define REPL_WINDOW      (4096)           // entries sent ahead of the acknowledged
+#define REPL_RETRY_MS    (20)
+#define REPL_DOWN_MS     (1000)
+
+int repl_add_backup(char *spec);
+void repl_start(long long *seq);
+int repl_enabled();
+void repl_log(mfs_repl_t *op, char *data);
+void repl_depend();
+void repl_wait();
+void repl_report(FILE *f);
+
+#endif // __repl_h__
@@ -1,57 +1,164 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include "udp.h"
 #include "ufs.h"
 #include "message.h"
+#include "drc.h"
+#include "dirindex.h"
+#include "balloc.h"
+#include "bulk.h"
+#include "journal.h"
+#include "stats.h"
+#include "uring.h"
+#include "repl.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 
 inode_t* inode_table;
 void* img;
-int sd;
+__thread int sd;  // the socket the calling worker serves
 int fs_img;
-super_t* s;
+super_t* s;          // the image's superblock, in the current format
+long long* image_seq; // the image's repl_seq, where its superblock keeps it
 char* inode_bitmap;
 char* data_bitmap;
-#define BUFFER_SZ (5000)
+#define BUFFER_SZ (MFS_MAX_DATAGRAM)
+#define MAX_WORKERS (256)
+#define MAX_BATCH (64)
+
+// Datagrams drained per receive call by each worker
+int batch_size = 32;
+
+// Lease granted with lookup and stat replies, in milliseconds: how long a
+// client may cache them without asking again. Nothing is revoked early,
+// so a client may see another's unlinks and inode reuse that much late.
+int lease_ms = 1000;
+
+// When updates are made durable (JOURNAL_*), and for JOURNAL_PERIODIC how
+// often in milliseconds and after how many changed blocks
+int flush_policy = JOURNAL_SYNC;
+int flush_ms = 100;
+int flush_blocks = 256;
+
+// Whether workers run the io_uring event loop (-u) rather than the
+// blocking one
+int use_uring = 0;
+
+// Sharding (-s, or -S to steer by CPU): the port is served from one
+// SO_REUSEPORT socket per worker rather than from one socket shared by
+// all, and each worker is pinned to a CPU of its own. The kernel spreads
+// datagrams over the sockets by flow, or with -S hands each to the socket
+// of the CPU that received it. Everything else is shared as before.
+#define SHARD_NONE (0)
+#define SHARD_FLOW (1)
+#define SHARD_CPU  (2)
+int sharding = SHARD_NONE;
+int sockets[MAX_WORKERS];
+int num_sockets;
+__thread int shard;  // the calling worker's index
+
+// Replication: a primary (-r, once per backup) logs every change it makes
+// and replies to an update only once the backups have applied it (see
+// repl.h). A backup (-B) takes changes only from its primary, in the
+// primary's order and giving new inodes the primary's numbers, and serves
+// reads like any server, so clients can spread their reads over all of
+// them (MFS_InitReplicas). Data blocks and directory slots are the
+// backup's own choice. Every server starts from a copy of the same image.
+int backup = 0;
+pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t replay_cond = PTHREAD_COND_INITIALIZER;
+#define REPLAY_WAIT_MS (5)
+
+// Per-inode reader/writer locks (a directory is locked through its inode)
+pthread_rwlock_t* inode_locks;
+
+// Allocators over the inode and data bitmaps
+balloc_t inode_alloc;
+balloc_t data_alloc;
+
+// Name index of each directory, built on first use and kept up to date by
+// fs_create and fs_unlink under the directory's lock
+dirindex_t** dir_indexes;
+pthread_mutex_t dir_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether each regular file was made by fs_create_detached, so that no
+// entry of this image refers to it (a detached directory's ".." tells by
+// itself). Found by find_detached at startup and kept under the file's
+// lock after that.
+char* detached_files;
 
 /*
 * HELPER FUNCTIONS: 
-*   used for bit manipulation & fetching pointers, bytes, and inodes 
+*   used for fetching pointers, bytes, and inodes 
 */
 
-// Sets the value of the bit at the specified position in the bitmap to 1
-void bit_set(unsigned int *bitmap, int position) {
-    bitmap[position / 32] |= 0x1 << (31 - (position % 32));
+// Returns a pointer to the block at the specified block address
+char* block_ptr(unsigned int addr){
+    return (char*)img + (long)addr * UFS_BLOCK_SIZE;
+}
+
+// Records a change to the bitmap word holding the specified bit
+void bitmap_dirty(char* bitmap, int bit){
+    journal_dirty((unsigned int*)bitmap + bit / 32, sizeof(unsigned int));
 }
 
-// Returns the value of the bit at the specified position in the bitmap
-unsigned int bit_fetch(unsigned int *bitmap, int position) {
-    return (bitmap[position / 32] >> (31 - (position % 32))) & 0x1;
+// Returns the number of data blocks an inode owns (a new file owns one
+// block even before its first write)
+int inode_blocks(inode_t* inode){
+    return inode->size == 0 ? 1 : (inode->size - 1) / UFS_BLOCK_SIZE + 1;
 }
 
-// Sets the value of the bit at the specified position in the bitmap to 0
-void bit_clear(unsigned int *bitmap, int position){
-    bitmap[position / 32] &= ~(0x1 << (31 - (position % 32)));
+// Returns the most data blocks one inode can map in this image's format
+long max_blocks(){
+    if(s->version < UFS_VERSION_INDIRECT) return DIRECT_PTRS;
+    return NDIRECT + PTRS_PER_BLOCK + (long)PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+}
+
+// Returns where the block address of the inode's logical block lblock is
+// kept: one of its pointers, or an entry in one of its indirect blocks
+unsigned int* bmap_slot(inode_t* inode, int lblock){
+    if(s->version < UFS_VERSION_INDIRECT || lblock < NDIRECT)
+        return &inode->direct[lblock];
+    lblock -= NDIRECT;
+    if(lblock < PTRS_PER_BLOCK)
+        return (unsigned int*)block_ptr(inode->direct[INDIRECT_PTR]) + lblock;
+    lblock -= PTRS_PER_BLOCK;
+    unsigned int* outer = (unsigned int*)block_ptr(inode->direct[DINDIRECT_PTR]);
+    return (unsigned int*)block_ptr(outer[lblock / PTRS_PER_BLOCK]) + lblock % PTRS_PER_BLOCK;
+}
+
+// Returns the block address of a logical block the inode owns
+unsigned int bmap(inode_t* inode, int lblock){
+    return *bmap_slot(inode, lblock);
 }
 
 // Returns a pointer to the specified offset in the specified inode
 char* fetch_ptr(inode_t* inode, int offset){
-    return (char*)img+(inode->direct[offset/UFS_BLOCK_SIZE])*UFS_BLOCK_SIZE+offset%UFS_BLOCK_SIZE;
+    return block_ptr(bmap(inode, offset/UFS_BLOCK_SIZE))+offset%UFS_BLOCK_SIZE;
 }
 
-// Finds the first free byte in the specified bitmap and sets it to used
-// Returns the position of the free byte, or -1 if no free bytes are found
-int locate_free_byte(char* bitmap, int length){
-    for(int i = 0; i<length; i++){
-        if(bit_fetch((unsigned int*) bitmap, i)==0){
-            bit_set((unsigned int*) bitmap, i);
-            return i;
-        }
+// Copies nbytes between buffer and the inode's data starting at offset, in
+// the direction given by to_inode. A null buffer writes zeros.
+void copy_data(inode_t* inode, char* buffer, int offset, int nbytes, int to_inode){
+    while(nbytes > 0){
+        int n = MIN(nbytes, UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE);
+        char* data = fetch_ptr(inode, offset);
+        if(!to_inode) memcpy(buffer, data, n);
+        else if(buffer) memcpy(data, buffer, n);
+        else memset(data, 0, n);
+        if(to_inode) journal_dirty(data, n);
+        if(buffer) buffer += n;
+        offset += n;
+        nbytes -= n;
     }
-    return -1;
 }
 
 // Returns a pointer to the inode with the specified inode number, or null if it does not exist
@@ -65,122 +172,417 @@ inode_t* fetch_inode(int inum){
     return &(inode_table[inum]);
 }
 
-// Signal handler for interrupt signal (Ctrl + C)
-void interrupt_handler(int dummy) {
-    UDP_Close(sd);
+// Locks the specified inode for reading (shared) or writing (exclusive) and
+// returns it, or returns null (with nothing locked) if it does not exist.
+// Locks are always taken parent before child, so directory operations that
+// hold two inodes cannot deadlock.
+inode_t* lock_inode(int inum, int exclusive){
+    if(inum<0 || inum>=s->num_inodes) return 0;
+    if(exclusive) pthread_rwlock_wrlock(&inode_locks[inum]);
+    else pthread_rwlock_rdlock(&inode_locks[inum]);
+    // Re-check allocation now that no unlink can be in progress on it
+    inode_t* inode = fetch_inode(inum);
+    if(inode==0) pthread_rwlock_unlock(&inode_locks[inum]);
+    return inode;
+}
+
+// Releases a lock taken by lock_inode
+void unlock_inode(int inum){
+    pthread_rwlock_unlock(&inode_locks[inum]);
+}
+
+// Allocates a data block, at block address goal if that is free or else as
+// close after it as possible (a goal of -1 takes any block). Returns its
+// block address, or -1 if the image is full.
+int alloc_block(int goal){
+    int data_block = balloc_alloc_near(&data_alloc, goal < 0 ? -1 : goal - s->data_region_addr);
+    if(data_block < 0) return -1;
+    bitmap_dirty(data_bitmap, data_block);
+    return data_block + s->data_region_addr;
+}
+
+// Releases the data block at the specified block address
+void free_block(unsigned int addr){
+    balloc_free(&data_alloc, (int)(addr - s->data_region_addr));
+    bitmap_dirty(data_bitmap, (int)(addr - s->data_region_addr));
+}
+
+// Allocates a zeroed block for block addresses
+int alloc_index_block(int goal){
+    int addr = alloc_block(goal);
+    if(addr >= 0){
+        memset(block_ptr(addr), 0, UFS_BLOCK_SIZE);
+        journal_dirty(block_ptr(addr), UFS_BLOCK_SIZE);
+    }
+    return addr;
+}
+
+// Gives the inode logical block lblock, the one just past those it owns,
+// along with any indirect block that starts with it. The block goes right
+// after the previous one when that is free, so files grow in contiguous
+// runs. Returns its block address, or -1 if the file or image is full.
+int append_block(inode_t* inode, int lblock){
+    if(lblock >= max_blocks()) return -1;
+    int goal = lblock > 0 ? bmap(inode, lblock - 1) + 1 : -1;
+
+    // Indirect blocks allocated here, released again on failure
+    int single = -1, outer = -1;
+    if(s->version >= UFS_VERSION_INDIRECT && lblock >= NDIRECT){
+        int i = lblock - NDIRECT;
+        if(i == 0){
+            if((single = alloc_index_block(goal)) < 0) return -1;
+            inode->direct[INDIRECT_PTR] = single;
+            goal = single + 1;
+        } else if(i >= PTRS_PER_BLOCK && (i - PTRS_PER_BLOCK) % PTRS_PER_BLOCK == 0){
+            i -= PTRS_PER_BLOCK;
+            if(i == 0){
+                if((outer = alloc_index_block(goal)) < 0) return -1;
+                inode->direct[DINDIRECT_PTR] = outer;
+                goal = outer + 1;
+            }
+            if((single = alloc_index_block(goal)) < 0){
+                if(outer >= 0) free_block(outer);
+                return -1;
+            }
+            unsigned int* entry = (unsigned int*)block_ptr(inode->direct[DINDIRECT_PTR]) + i / PTRS_PER_BLOCK;
+            *entry = single;
+            journal_dirty(entry, sizeof(unsigned int));
+            goal = single + 1;
+        }
+    }
+
+    int addr = alloc_block(goal);
+    if(addr < 0){
+        if(single >= 0) free_block(single);
+        if(outer >= 0) free_block(outer);
+        return -1;
+    }
+    unsigned int* slot = bmap_slot(inode, lblock);
+    *slot = addr;
+    journal_dirty(slot, sizeof(unsigned int));
+    journal_dirty(inode, sizeof(inode_t));
+    return addr;
+}
+
+// Releases the inode's logical blocks from keep up to nblocks, along with
+// the indirect blocks that no longer map anything
+void release_blocks(inode_t* inode, int keep, int nblocks){
+    for(int j = nblocks - 1; j >= keep; j--){
+        free_block(bmap(inode, j));
+        if(s->version < UFS_VERSION_INDIRECT || j < NDIRECT) continue;
+        int i = j - NDIRECT;
+        if(i == 0){
+            free_block(inode->direct[INDIRECT_PTR]);
+        } else if(i >= PTRS_PER_BLOCK && (i - PTRS_PER_BLOCK) % PTRS_PER_BLOCK == 0){
+            i -= PTRS_PER_BLOCK;
+            free_block(((unsigned int*)block_ptr(inode->direct[DINDIRECT_PTR]))[i / PTRS_PER_BLOCK]);
+            if(i == 0) free_block(inode->direct[DINDIRECT_PTR]);
+        }
+    }
+}
+
+// Returns the name index of a directory, building it from the directory's
+// entries on first use. The caller holds the directory's lock; readers
+// holding it shared may race to build, so building is serialized.
+dirindex_t* dir_index(int pinum, inode_t* pinode){
+    dirindex_t* idx = __atomic_load_n(&dir_indexes[pinum], __ATOMIC_ACQUIRE);
+    if(idx) return idx;
+
+    pthread_mutex_lock(&dir_index_lock);
+    idx = dir_indexes[pinum];
+    if(idx == 0){
+        idx = dirindex_new();
+        for(int i = 0; i < pinode->size / sizeof(dir_ent_t); i++){
+            dir_ent_t* dir = (dir_ent_t*) fetch_ptr(pinode, i * sizeof(dir_ent_t));
+            // On a duplicate name, the first entry wins as it did for a scan
+            if(dir->inum == -1) dirindex_put_slot(idx, i);
+            else dirindex_insert(idx, dir->name, i);
+        }
+        __atomic_store_n(&dir_indexes[pinum], idx, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&dir_index_lock);
+    return idx;
+}
+
+// Takes a snapshot of the counters, with the free inode and block gauges
+void server_stats(mfs_stats_t* st) {
+    stats_snapshot(st);
+    st->num_inodes = s->num_inodes;
+    st->free_inodes = balloc_nfree(&inode_alloc);
+    st->num_blocks = s->data_region_len;
+    st->free_blocks = balloc_nfree(&data_alloc);
+}
+
+// Flushes every update made so far in order, letting no more begin, and
+// closes the sockets; the caller exits
+void stop_server() {
+    journal_shutdown();
+    journal_report(stderr);
+    repl_report(stderr);
+    mfs_stats_t st;
+    char text[8192];
+    server_stats(&st);
+    stats_format(&st, text, sizeof(text));
+    fputs(text, stderr);
+    for (int i = 0; i < num_sockets; i++) UDP_Close(sockets[i]);
+}
+
+// Waits for an interrupt (Ctrl + C) or termination signal, which every
+// other thread blocks, and stops the server
+void* interrupt_handler(void* arg) {
+    int sig;
+    sigwait((sigset_t*)arg, &sig);
+    stop_server();
     exit(130);
 }
 
+// Allocates an inode: number want, when a backup replays its primary's
+// create, or else any free one. Returns its number, or -1.
+int alloc_inode(int want){
+    return want >= 0 ? balloc_alloc_at(&inode_alloc, want) : balloc_alloc(&inode_alloc);
+}
+
+// Sets up a newly allocated inode with its first data block; a directory
+// gets "." and ".." entries, ".." referring to parent. The caller holds
+// the inode's lock.
+void init_inode(int index, int type, int data_block, int parent){
+    inode_t* inode = &inode_table[index];
+    inode->direct[0] = data_block;
+    inode->size = 0;
+    inode->type = type;
+
+    // Add "." and ".." entries to new directory
+    if (inode->type == UFS_DIRECTORY) {
+        dir_ent_t* self = (dir_ent_t*)fetch_ptr(inode, 0);
+        sprintf(self->name, ".");
+        self->inum = index;
+        dir_ent_t* up = (dir_ent_t*)fetch_ptr(inode, sizeof(dir_ent_t));
+        sprintf(up->name, "..");
+        up->inum = parent;
+        inode->size = 2 * sizeof(dir_ent_t);
+        journal_dirty(self, 2 * sizeof(dir_ent_t));
+    }
+    journal_dirty(inode, sizeof(inode_t));
+}
+
+// Fills the empty slot of a directory with an entry, or pushes it onto
+// the end if slot is -1 (the caller has made room for it there). The
+// caller holds the directory's lock exclusively.
+void put_entry(inode_t* pinode, dirindex_t* idx, int slot, char* name, int inum){
+    if (slot < 0) {
+        slot = pinode->size / sizeof(dir_ent_t);
+        pinode->size += sizeof(dir_ent_t);
+        journal_dirty(pinode, sizeof(inode_t));
+    }
+    dir_ent_t* dir = (dir_ent_t*) fetch_ptr(pinode, slot * sizeof(dir_ent_t));
+    strcpy(dir->name, name);
+    dir->inum = inum;
+    journal_dirty(dir, sizeof(dir_ent_t));
+    dirindex_insert(idx, name, slot);
+}
+
 /**
  * This function creates a new file or directory in the file system.
  *
  *  pinum:  the inode number of the parent directory
  *  type:   the type of file to fs_create (UFS_REGULAR or UFS_DIRECTORY)
  *  name:   the name of the file or directory to fs_create
+ *  inum:   on entry the number to give a new inode, or -1 for any; set
+ *          to the inode number of the new (or existing) entry
  *
  *  returns:  an integer indicating the success or failure of the operation
  *            (1 for success, -1 for failure)
  */
-int fs_create(int pinum, int type, char *name){
-    // Validate inode of the parent 
-    inode_t* pinode = fetch_inode(pinum);
-    if(pinode==0 || pinode->type!=UFS_DIRECTORY || strlen(name)>=28) 
+int fs_create(int pinum, int type, char *name, int *inum){
+    if(strlen(name)>=28) return -1;
+
+    // Validate inode of the parent and hold it exclusively for the update
+    inode_t* pinode = lock_inode(pinum, 1);
+    if(pinode==0) return -1;
+    if(pinode->type!=UFS_DIRECTORY){
+        unlock_inode(pinum);
         return -1;
+    }
 
-    // Check for existing directories 
-    dir_ent_t* dir;
-    int i; 
-    while((i<pinode->size/sizeof(dir_ent_t)) && 
-        (dir = (dir_ent_t*) fetch_ptr(pinode, i*sizeof(dir_ent_t)))->inum != -1) {
-            if(strcmp(dir->name,name)==0){
-                return 0;
-            }
-            i++;
-    }
-
-    int empty = 0; // empty flag indicator
-    // Find first empty directory entry
-    i = 0; 
-    while ((i < pinode->size/sizeof(dir_ent_t)) && 
-        (dir = (dir_ent_t*) fetch_ptr(pinode, i * sizeof(dir_ent_t)))->inum != -1) {
-        // If directory entry is empty, add new directory
-        if (dir->inum == -1) {
-            strcpy(dir->name, name);
-
-            // Allocate new inode for new directory
-            int index = locate_free_byte(inode_bitmap, s->num_inodes);
-            if (index < 0) return -1;
-            dir->inum = index;
-            inode_t* inode = &inode_table[index];
-
-            // Allocate new data block for new directory
-            int data_block = locate_free_byte(data_bitmap, s->data_region_len);
-            if (data_block < 0) return -1;
-            inode->direct[0] = data_block + s->data_region_addr;
-            inode->size = 0;
-            inode->type = type;
-
-            // Add "." and ".." entries to new directory
-            if (inode->type == UFS_DIRECTORY) {
-            dir_ent_t* self = (dir_ent_t*)fetch_ptr(inode, 0);
-            sprintf(self->name, ".");
-            self->inum = index;
-            dir_ent_t* parent = (dir_ent_t*)fetch_ptr(inode, sizeof(dir_ent_t));
-            sprintf(parent->name, "..");
-            parent->inum = pinum;
-            inode->size = 2 * sizeof(dir_ent_t);
-            }
-            empty = 1;
-        }
-        i++;
+    // Check for an existing entry and pick an empty slot for the new one
+    dirindex_t* idx = dir_index(pinum, pinode);
+    int existing = dirindex_lookup(idx, name);
+    if(existing >= 0){
+        *inum = ((dir_ent_t*) fetch_ptr(pinode, existing * sizeof(dir_ent_t)))->inum;
+        unlock_inode(pinum);
+        return 0;
     }
+    int slot = dirindex_take_slot(idx);
 
-    // Intermediate empty slot not found, push onto end 
-    if (!empty) {
-        // Allocate new block for parent directory if full
-        if (pinode->size % UFS_BLOCK_SIZE == 0) {
-            int data_block = locate_free_byte(data_bitmap, s->data_region_len);
-            if (data_block < 0) return -1;
-            pinode->direct[pinode->size / UFS_BLOCK_SIZE] = data_block + s->data_region_addr;
+    // Allocate new block for parent directory if full and no slot is free
+    int grown = 0;
+    if (slot < 0 && pinode->size % UFS_BLOCK_SIZE == 0) {
+        if (append_block(pinode, pinode->size / UFS_BLOCK_SIZE) < 0) {
+            unlock_inode(pinum);
+            return -1;
         }
+        grown = 1;
+    }
 
-        // Push new directory entry onto end of parent directory
-        pinode->size += sizeof(dir_ent_t);
-        dir_ent_t* dir = (dir_ent_t*) fetch_ptr(pinode, pinode->size - sizeof(dir_ent_t));
-        strcpy(dir->name, name);
+    // Allocate new inode; nobody can reach it until the entry is written,
+    // but hold its lock so stale lookups of a recycled inum wait for it
+    int index = alloc_inode(*inum);
+    if (index < 0) {
+        if (slot >= 0) dirindex_put_slot(idx, slot);
+        if (grown) release_blocks(pinode, pinode->size / UFS_BLOCK_SIZE, pinode->size / UFS_BLOCK_SIZE + 1);
+        unlock_inode(pinum);
+        return -1;
+    }
+    bitmap_dirty(inode_bitmap, index);
+    pthread_rwlock_wrlock(&inode_locks[index]);
 
-        // Allocate new inode for new directory
-        int index = locate_free_byte(inode_bitmap, s->num_inodes);
+    // Allocate new data block for new file or directory
+    int data_block = alloc_block(-1);
+    if (data_block < 0) {
+        if (slot >= 0) dirindex_put_slot(idx, slot);
+        if (grown) release_blocks(pinode, pinode->size / UFS_BLOCK_SIZE, pinode->size / UFS_BLOCK_SIZE + 1);
+        balloc_free(&inode_alloc, index);
+        bitmap_dirty(inode_bitmap, index);
+        unlock_inode(index);
+        unlock_inode(pinum);
+        return -1;
+    }
+    init_inode(index, type, data_block, pinum);
 
-        if (index < 0) 
-            return -1;
+    // Fill the empty slot, or push the new entry onto end of parent directory
+    put_entry(pinode, idx, slot, name, index);
+    *inum = index;
+    mfs_repl_t op = { .mtype = MFS_CRET, .inum = pinum, .type = type, .target = index, .len = strlen(name) + 1 };
+    repl_log(&op, name);
 
-        dir->inum = index;
-        inode_t* inode = &inode_table[index];
+    unlock_inode(index);
+    unlock_inode(pinum);
+    return 0;
+}
 
-        // Allocate new data block for new directory
-        int data_block = locate_free_byte(data_bitmap, s->data_region_len);
+// Creates a file or directory that no entry of this image refers to, for
+// an entry on another server (see MFS_LINK); a directory's ".." refers to
+// parent, the global inode number of the directory holding that entry.
+// Takes inum as fs_create does. Returns 0, or -1 if the image is full.
+int fs_create_detached(int type, int parent, int *inum){
+    if(parent < 0 || (parent & MFS_REMOTE) || (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE)) return -1;
+    int index = alloc_inode(*inum);
+    if (index < 0) return -1;
+    bitmap_dirty(inode_bitmap, index);
+    pthread_rwlock_wrlock(&inode_locks[index]);
+    int data_block = alloc_block(-1);
+    if (data_block < 0) {
+        balloc_free(&inode_alloc, index);
+        bitmap_dirty(inode_bitmap, index);
+        unlock_inode(index);
+        return -1;
+    }
+    init_inode(index, type, data_block, parent | MFS_REMOTE);
+    detached_files[index] = type == UFS_REGULAR_FILE;
+    *inum = index;
+    mfs_repl_t op = { .mtype = MFS_CRET, .inum = -1, .offset = parent, .type = type, .target = index };
+    repl_log(&op, 0);
+    unlock_inode(index);
+    return 0;
+}
 
-        if (data_block < 0) 
-            return -1;
+// Adds an entry name to directory pinum referring to inode remote on
+// another server, by its global number. Sets inum to the entry's inode
+// number as a lookup would return it, that of the entry already there
+// under the name if there is one. Returns 0, or -1.
+int fs_link(int pinum, char *name, int remote, int *inum){
+    if(strlen(name)>=28 || remote < 0 || (remote & MFS_REMOTE)) return -1;
+    inode_t* pinode = lock_inode(pinum, 1);
+    if(pinode==0) return -1;
+    if(pinode->type!=UFS_DIRECTORY){
+        unlock_inode(pinum);
+        return -1;
+    }
 
-        inode->direct[0] = data_block + s->data_region_addr;
-        inode->size = 0;
-        inode->type = type;
-
-        // Add "." and ".." entries to new directory
-        if (inode->type == UFS_DIRECTORY) {
-            dir_ent_t* self = (dir_ent_t*)fetch_ptr(inode, 0);
-            sprintf(self->name, ".");
-            self->inum = index;
-            dir_ent_t* parent = (dir_ent_t*)fetch_ptr(inode, sizeof(dir_ent_t));
-            sprintf(parent->name, "..");
-            parent->inum = pinum;
-            inode->size = 2 * sizeof(dir_ent_t);
-        }
+    dirindex_t* idx = dir_index(pinum, pinode);
+    int existing = dirindex_lookup(idx, name);
+    if(existing >= 0){
+        *inum = ((dir_ent_t*) fetch_ptr(pinode, existing * sizeof(dir_ent_t)))->inum;
+        unlock_inode(pinum);
+        return 0;
+    }
+    int slot = dirindex_take_slot(idx);
+    if (slot < 0 && pinode->size % UFS_BLOCK_SIZE == 0 &&
+        append_block(pinode, pinode->size / UFS_BLOCK_SIZE) < 0) {
+        unlock_inode(pinum);
+        return -1;
+    }
+    put_entry(pinode, idx, slot, name, remote | MFS_REMOTE);
+    *inum = remote | MFS_REMOTE;
+    mfs_repl_t op = { .mtype = MFS_LINK, .inum = pinum, .nbytes = remote, .len = strlen(name) + 1 };
+    repl_log(&op, name);
+    unlock_inode(pinum);
+    return 0;
+}
+
+// Most blocks of a gap past the end of a file that a write zero-fills in
+// its own transaction; fill_gap does the rest ahead of it
+#define FILL_BLOCKS (256)
+
+// Returns at most how many image blocks a write of nbytes at offset
+// changes: its data blocks and those of any gap it leaves past the end of
+// the file, the blocks it adds to the file with their indirect blocks and
+// bitmap words, and the inode
+long write_blocks(inode_t* inode, int offset, int nbytes){
+    long start = MIN(inode->size, offset), end = (long)offset + nbytes;
+    long data = end > start ? (end - 1) / UFS_BLOCK_SIZE - start / UFS_BLOCK_SIZE + 1 : 0;
+    long need = end == 0 ? 1 : (end - 1) / UFS_BLOCK_SIZE + 1;
+    long added = MAX(need - inode_blocks(inode), 0);
+    long index = added > 0 ? 2 * (added / PTRS_PER_BLOCK) + 4 : 0;
+    return data + index + MIN(added + index, s->data_bitmap_len) + 1;
+}
+
+// Returns at most how many image blocks a write to inum changes, as
+// write_blocks does but without holding its lock, for reserving room in
+// the journal before the write takes it. Any gap beyond FILL_BLOCKS has
+// been filled by then (see fill_gap).
+long write_blocks_unlocked(int inum, int offset, int nbytes){
+    inode_t* inode = inum >= 0 ? fetch_inode(inum) : 0;
+    inode_t now = { .size = inode ? __atomic_load_n(&inode->size, __ATOMIC_RELAXED) : 0 };
+    now.size = MAX(now.size, (long)offset - FILL_BLOCKS * UFS_BLOCK_SIZE);
+    return write_blocks(&now, MAX(offset, 0), MAX(nbytes, 0));
+}
 
+// Body of fs_write; the caller holds the inode's lock exclusively
+int write_locked(inode_t* inode, char *buffer, int offset, int nbytes) {
+    if ((inode->type == UFS_DIRECTORY) || (nbytes < 0) || (offset < 0)) {
+        return -1;
+    }
+
+    // Check if the write is within the bounds of the file
+    long end = (long)offset + nbytes;
+    if (end > INT_MAX || end > max_blocks() * UFS_BLOCK_SIZE) {
+        return -1;
     }
 
+    // Refuse a write whose gap the journal transaction has no room for
+    if (write_blocks(inode, offset, nbytes) > journal_room()) {
+        return -1;
+    }
+
+    // Give the file every block up to the end of the write
+    int have = inode_blocks(inode);
+    int need = end == 0 ? 1 : (end - 1) / UFS_BLOCK_SIZE + 1;
+    for (int j = have; j < need; j++) {
+        if (append_block(inode, j) < 0) {
+            // No free data blocks available
+            release_blocks(inode, have, j);
+            return -1;
+        }
+    }
+
+    // A write past the end of the file leaves a gap that reads as zeros
+    if (offset > inode->size) {
+        copy_data(inode, 0, inode->size, offset - inode->size, 1);
+    }
+    copy_data(inode, buffer, offset, nbytes, 1);
+    inode->size = MAX(inode->size, end);
+    journal_dirty(inode, sizeof(inode_t));
     return 0;
 }
 
@@ -195,47 +597,50 @@ int fs_create(int pinum, int type, char *name){
  *  returns: an integer indicating the success or failure of the operation
  *           (0 for success, -1 for failure)
  */
-
 int fs_write(int inum, char *buffer, int offset, int nbytes) {
-    // Get the inode with the specified inode number
-    inode_t* inode = fetch_inode(inum);
-    if (!inode || (inode->type == UFS_DIRECTORY) || (nbytes > 4096)) {
+    // Get the inode with the specified inode number and hold it exclusively
+    inode_t* inode = lock_inode(inum, 1);
+    if (!inode) {
         // Inode does not exist
         return -1;
     }
+    int rc = write_locked(inode, buffer, offset, nbytes);
 
-    // Check if the write is within the bounds of the file
-    if (offset + nbytes > DIRECT_PTRS * UFS_BLOCK_SIZE) {
-        return -1;
+    // A bulk write is logged in pieces that fit a replication datagram
+    for (int done = 0; rc == 0 && repl_enabled(); ) {
+        int len = MIN(nbytes - done, REPL_MAX_DATA);
+        mfs_repl_t op = { .mtype = MFS_WRITE, .inum = inum, .offset = offset + done, .nbytes = len, .len = len };
+        repl_log(&op, buffer + done);
+        done += len;
+        if (done >= nbytes) break;
     }
-        // Check if a new block needs to be allocated
-    if ((offset + nbytes) / UFS_BLOCK_SIZE > inode->size / UFS_BLOCK_SIZE) {
-        // Allocate a new data block
-        int data_block = locate_free_byte(data_bitmap, s->data_region_len);
-        if (data_block < 0) {
-            // No free data blocks available
-            return -1;
-        }
-        inode->direct[inode->size / UFS_BLOCK_SIZE + 1] = data_block + s->data_region_addr;
-        inode->size = offset + nbytes;
-    } else {
-        // No need to allocate a new block
-        inode->size = MAX(inode->size, offset + nbytes);
-    }
-
-    // Check if the write spans across one or two blocks
-    if (offset % UFS_BLOCK_SIZE + nbytes <= UFS_BLOCK_SIZE) {
-        // One block
-        char* block = (char*)img + (inode->direct[offset / UFS_BLOCK_SIZE]) * UFS_BLOCK_SIZE;
-        memcpy((void*)(block + offset % UFS_BLOCK_SIZE), (void*)buffer, nbytes);
-    } else {
-        // Two blocks
-        char* block1 = (char*)img + (inode->direct[offset / UFS_BLOCK_SIZE]) * UFS_BLOCK_SIZE;
-        char* block2 = (char*)img + (inode->direct[offset / UFS_BLOCK_SIZE + 1]) * UFS_BLOCK_SIZE;
-        memcpy((void*)(block1 + offset % UFS_BLOCK_SIZE), (void*)buffer, UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE);
-        memcpy((void*)(block2), (void*)(buffer + UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE), nbytes - (UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE));
+    unlock_inode(inum);
+    return rc;
+}
+
+// Returns where the next piece of zero-filling ends ahead of a write at
+// offset to file inum, or -1 if the write may fill what gap it leaves
+int next_fill(int inum, int offset) {
+    inode_t* inode = inum >= 0 ? fetch_inode(inum) : 0;
+    long size = inode ? __atomic_load_n(&inode->size, __ATOMIC_RELAXED) : offset;
+    return offset - size > FILL_BLOCKS * UFS_BLOCK_SIZE ? size + FILL_BLOCKS * UFS_BLOCK_SIZE : -1;
+}
+
+// Zero-fills file inum towards offset, FILL_BLOCKS blocks to an update,
+// until what is left of the gap is small enough for a write at offset to
+// fill. Each piece is an empty write at the new end of the file, so it is
+// logged for backups like any write. Filling again what is already filled
+// changes nothing, so a crash between pieces only leaves the file longer.
+// Called outside any update.
+void fill_gap(int inum, int offset) {
+    inode_t piece = { .size = 1 };
+    long blocks = 8 + write_blocks(&piece, 1 + FILL_BLOCKS * UFS_BLOCK_SIZE, 0);
+    for (int end; (end = next_fill(inum, offset)) >= 0; ) {
+        journal_begin(blocks);
+        int rc = fs_write(inum, "", end, 0);
+        journal_end();
+        if (rc < 0) return;
     }
-    return 0;
 }
 
 /**
@@ -250,50 +655,94 @@ int fs_write(int inum, char *buffer, int offset, int nbytes) {
  *           (0 for success, -1 for failure)
  */
 
+// Most pieces fs_send gathers: a header, the blocks of a bulk read
+// fragment (which need not start on a block boundary), and a tail
+#define MAX_SEND_IOV (MFS_FRAG_SIZE / UFS_BLOCK_SIZE + 3)
+
+/**
+ * Sends nbytes of a file from offset as the body of one datagram to addr,
+ * between the bytes described by head and tail (tail may be null). The
+ * data goes to the kernel straight from where it lies in the mapped image,
+ * blocks adjacent there as one piece, so nothing is copied in user space;
+ * the inode stays read-locked until sendmsg has taken its copy.
+ *
+ *  returns:  0 once sent, or -1 (with nothing sent) if the inode does not
+ *            exist or the range is not within the file
+ */
+int fs_send(int inum, int offset, int nbytes, struct iovec* head, struct iovec* tail, struct sockaddr_in* addr) {
+    if (nbytes < 0 || nbytes > MFS_FRAG_SIZE) return -1;
+    inode_t* inode = lock_inode(inum, 0);
+    if (!inode) return -1;
+    if (offset < 0 || (long)offset + nbytes > inode->size) {
+        unlock_inode(inum);
+        return -1;
+    }
+
+    struct iovec iov[MAX_SEND_IOV];
+    int n = 0;
+    iov[n++] = *head;
+    while (nbytes > 0) {
+        int len = MIN(nbytes, UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE);
+        char* data = fetch_ptr(inode, offset);
+        if (n > 1 && (char*)iov[n - 1].iov_base + iov[n - 1].iov_len == data) {
+            iov[n - 1].iov_len += len;
+        } else {
+            iov[n].iov_base = data;
+            iov[n].iov_len = len;
+            n++;
+        }
+        offset += len;
+        nbytes -= len;
+    }
+    if (tail && tail->iov_len > 0) iov[n++] = *tail;
+    UDP_WriteV(sd, addr, iov, n);
+
+    unlock_inode(inum);
+    return 0;
+}
+
 int fs_read(int inum, char *buffer, int offset, int nbytes) {
-    // Get the inode with the specified inode number
-    inode_t* inode = fetch_inode(inum);
+    // Get the inode with the specified inode number; readers share the lock
+    inode_t* inode = lock_inode(inum, 0);
     if (!inode) {
         // Inode does not exist
         return -1;
     }
 
     // Check if the read is within the bounds of the file
-    if (offset + nbytes > inode->size) {
+    if (offset < 0 || nbytes < 0 || (long)offset + nbytes > inode->size) {
+        unlock_inode(inum);
         return -1;
     }
 
-    // Check if the read spans across one or two blocks
-    if (offset % UFS_BLOCK_SIZE + nbytes <= UFS_BLOCK_SIZE) {
-        // One block
-        char* block = (char*)img + (inode->direct[offset / UFS_BLOCK_SIZE]) * UFS_BLOCK_SIZE;
-        memcpy((void*)buffer, (void*)(block + offset % UFS_BLOCK_SIZE), nbytes);
-    } else {
-        // Two blocks
-        char* block1 = (char*)img + (inode->direct[offset / UFS_BLOCK_SIZE]) * UFS_BLOCK_SIZE;
-        char* block2 = (char*)img + (inode->direct[offset / UFS_BLOCK_SIZE + 1]) * UFS_BLOCK_SIZE;
-        memcpy((void*)buffer, (void*)(block1 + offset % UFS_BLOCK_SIZE), UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE);
-        memcpy((void*)(buffer + UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE), (void*)(block2), nbytes - (UFS_BLOCK_SIZE - offset % UFS_BLOCK_SIZE));
-    }
+    // Copy block by block through the inode's mapping
+    copy_data(inode, buffer, offset, nbytes, 0);
 
+    unlock_inode(inum);
     return 0;
 }
 
 
 /*
-Returns an integer representing the type and size of a file within a distributed file system built on a UDP connection.
+Gets the type and size of a file within a distributed file system built on a UDP connection.
 
 Arguments:
     inode_num: an integer representing the inode number of the file to be queried.
+    type: set to the type of the file.
+    size: set to the size of the file in bytes.
 
 Returns:
-    The type and size of the file encoded in an integer if the inode is found.
+    0 if the inode is found.
     -1 if the inode is not found.
 */
-int fs_stat(int inode_num) {
+int fs_stat(int inode_num, int *type, int *size) {
     // Get the inode for the file and return -1 if it is not found
-    inode_t* inode = fetch_inode(inode_num);
-    return inode ? (inode->size << 1) + inode->type : -1;
+    inode_t* inode = lock_inode(inode_num, 0);
+    if(inode == 0) return -1;
+    *type = inode->type;
+    *size = inode->size;
+    unlock_inode(inode_num);
+    return 0;
 }
 
 /*
@@ -309,25 +758,167 @@ Returns:
 */
 int fs_lookup(int pinum, char *name) {
     // Get the inode for the parent directory and return -1 if it is not found or is not a directory
-    inode_t* pinode = fetch_inode(pinum);
-    if(pinode == 0 || pinode->type != UFS_DIRECTORY) return -1;
-
-    // Iterate through the directory entries in the parent inode
-    int i = 0; 
-    while (i < pinode->size / sizeof(dir_ent_t)){
-        // Get the current directory entry
-        dir_ent_t* dir = (dir_ent_t*) fetch_ptr(pinode, i * sizeof(dir_ent_t));
+    inode_t* pinode = lock_inode(pinum, 0);
+    if(pinode == 0) return -1;
+    int result = -1;
 
-        // Check if the current directory entry is the file to be looked up
-        if(dir->inum != -1 && strcmp(dir->name, name) == 0) {
+    // Find the entry's slot through the directory's name index
+    if (pinode->type == UFS_DIRECTORY) {
+        int slot = dirindex_lookup(dir_index(pinum, pinode), name);
+        if (slot >= 0) {
             // Return the inode number of the file if it is found
-            return dir->inum;
+            result = ((dir_ent_t*) fetch_ptr(pinode, slot * sizeof(dir_ent_t)))->inum;
         }
-        i++; 
     }
 
     // Return -1 if the file is not found in the parent directory
-    return -1;
+    unlock_inode(pinum);
+    return result;
+}
+
+/*
+Resolves a path within the file system, one component at a time.
+
+Arguments:
+    inum: the inode number of the directory the path starts from.
+    path: a string of names separated by '/'; empty names are skipped. It is split in place.
+    ents: if not null, receives the inode number, type and size of each component resolved.
+    depth: set to the number of components resolved.
+
+    remote: set if the walk stopped early at an entry for an inode on another server.
+
+Returns:
+    The inode number of the last component (inum itself for an empty path), or of the entry the walk stopped at.
+    -1 if a component is not found or inum does not exist.
+*/
+int fs_lookup_path(int inum, char *path, mfs_path_ent_t *ents, int *depth, int *remote) {
+    *depth = 0;
+    *remote = 0;
+    int type, size;
+    if (fs_stat(inum, &type, &size) == -1) return -1;
+
+    // Each step locks only its own directory, as a series of lookups would
+    char *save;
+    for (char *name = strtok_r(path, "/", &save); name; name = strtok_r(0, "/", &save)) {
+        if (inum & MFS_REMOTE) {
+            *remote = 1;
+            return inum;
+        }
+        inum = fs_lookup(inum, name);
+        if (inum < 0) return -1;
+        if (ents && (inum & MFS_REMOTE)) {
+            ents[*depth].inum = inum;
+            ents[*depth].type = 0;
+            ents[*depth].size = -1;
+        } else if (ents) {
+            if (fs_stat(inum, &type, &size) == -1) return -1;
+            ents[*depth].inum = inum;
+            ents[*depth].type = type;
+            ents[*depth].size = size;
+        }
+        (*depth)++;
+    }
+    return inum;
+}
+
+/*
+Lists the live entries of a directory, packed as message.h describes for MFS_READDIR.
+
+Arguments:
+    inum: the inode number of the directory.
+    cookie: the entry slot to start from.
+    buffer: where to pack the entries.
+    max: the size of buffer.
+    limit: the most entries to return.
+    plus: whether to fill in each entry's type and size.
+    count: set to the number of entries packed.
+    next: set to the slot to continue from, or -1 once the directory is done.
+
+Returns:
+    The number of bytes packed, or -1 if inum is not a directory.
+*/
+int fs_readdir(int inum, int cookie, char *buffer, int max, int limit, int plus, int *count, int *next) {
+    inode_t* inode = lock_inode(inum, 0);
+    if (inode == 0) return -1;
+    if (inode->type != UFS_DIRECTORY || cookie < 0) {
+        unlock_inode(inum);
+        return -1;
+    }
+
+    int nslots = inode->size / sizeof(dir_ent_t);
+    int len = 0, slot;
+    *count = 0;
+    for (slot = cookie; slot < nslots && *count < limit; slot++) {
+        dir_ent_t* dir = (dir_ent_t*) fetch_ptr(inode, slot * sizeof(dir_ent_t));
+        if (dir->inum == -1) continue;
+        int namelen = strnlen(dir->name, sizeof(dir->name) - 1);
+        if (len + sizeof(mfs_dirent_t) + namelen + 1 > max) break;
+        mfs_dirent_t ent = { dir->inum, 0, 0, namelen };
+        memcpy(buffer + len, &ent, sizeof(mfs_dirent_t));
+        memcpy(buffer + len + sizeof(mfs_dirent_t), dir->name, namelen);
+        buffer[len + sizeof(mfs_dirent_t) + namelen] = '\0';
+        len += sizeof(mfs_dirent_t) + namelen + 1;
+        (*count)++;
+    }
+    *next = slot < nslots ? slot : -1;
+    unlock_inode(inum);
+
+    // Children are stat'ed once the directory is released, since ".." would
+    // otherwise be locked after its child
+    for (int pos = 0; plus && pos < len; ) {
+        mfs_dirent_t ent;
+        memcpy(&ent, buffer + pos, sizeof(mfs_dirent_t));
+        int type, size;
+        int result = fs_stat(ent.inum, &type, &size);
+        ent.type = result == -1 ? 0 : type;
+        ent.size = result == -1 ? -1 : size;
+        memcpy(buffer + pos, &ent, sizeof(mfs_dirent_t));
+        pos += sizeof(mfs_dirent_t) + ent.namelen + 1;
+    }
+    return len;
+}
+
+// Returns at most how many data bitmap blocks releasing the inode's blocks
+// changes: one for each run of its blocks within a bitmap block, and one
+// for each indirect block
+long release_bitmap_blocks(inode_t* inode) {
+    int n = inode_blocks(inode);
+    long blocks = 0, last = -1;
+    for(int j = 0; j < n; j++) {
+        long b = (long)(bmap(inode, j) - s->data_region_addr) / (UFS_BLOCK_SIZE * 8);
+        if(b != last) blocks++;
+        last = b;
+    }
+    if(s->version >= UFS_VERSION_INDIRECT && n > NDIRECT)
+        blocks += (n - NDIRECT) / PTRS_PER_BLOCK + 3;
+    return blocks;
+}
+
+// Frees an inode and its blocks, unless it is a directory with entries
+// other than "." and "..". The caller holds the inode's lock exclusively.
+// Returns 0, or -1 if the inode was kept.
+int release_inode(int inum, inode_t* inode) {
+    // The journal must have room for the bitmap blocks, the inode's and the
+    // entry's (the file may have grown since the update reserved room)
+    if(release_bitmap_blocks(inode) + 3 > journal_room()) return -1;
+
+    if(inode->type == UFS_DIRECTORY) {
+        for(int j = 2; j < inode->size / sizeof(dir_ent_t); j++) {
+            dir_ent_t* entry = (dir_ent_t*) fetch_ptr(inode, j * sizeof(dir_ent_t));
+            if(entry->inum != -1) return -1;
+        }
+        // The directory is going away, and so is its index
+        dirindex_free(dir_indexes[inum]);
+        dir_indexes[inum] = 0;
+    }
+
+    // Clear the data and indirect blocks used by the file from the data bitmap
+    release_blocks(inode, 0, inode_blocks(inode));
+    // Clear the inode from the inode bitmap
+    detached_files[inum] = 0;
+    balloc_free(&inode_alloc, inum);
+    bitmap_dirty(inode_bitmap, inum);
+    return 0;
 }
 
 /*
@@ -336,146 +927,1105 @@ Unlinks (deletes) a file within a distributed file system built on a UDP connect
 Arguments:
     pinum: an integer representing the inode number of the parent directory of the file to be unlinked.
     name: a string representing the name of the file to be unlinked.
+    remote: set to the entry's inode number if it refers to an inode on another server, which is then
+            left for that server to free; -1 otherwise.
 
 Returns:
     0 if the file was successfully unlinked.
     -1 if the parent inode is not found or is not a directory, or if the file to be unlinked is a non-empty directory.
     0 if the file was not found in the parent directory.
 */
-int fs_unlink(int pinum, char *name) {
+int fs_unlink(int pinum, char *name, int *remote) {
+    *remote = -1;
+    // "." and ".." are never unlinked; locking ".." here would also take an
+    // ancestor's lock after its child's
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return -1;
+
     // Get the inode for the parent directory and return -1 if it is not found
-    inode_t* pinode = fetch_inode(pinum);
-    if(pinode == 0 || pinode->type != UFS_DIRECTORY) return -1;
-
-    // Iterate through the directory entries in the parent inode until the file is found
-    int i = 0;
-    while(i < pinode->size / sizeof(dir_ent_t)) {
-        // Get the current directory entry
-        dir_ent_t* dir = (dir_ent_t*) fetch_ptr(pinode, i * sizeof(dir_ent_t));
-        // Check if the current directory entry is the file to be unlinked
-        if(dir->inum != -1 && strcmp(dir->name, name) == 0) {
-            // Get the inode for the file to be unlinked and return -1 if it is a non-empty directory
-            inode_t* inode = fetch_inode(dir->inum);
-            if(inode->type == UFS_DIRECTORY) {
-                int j = 2;
-                while(j < inode->size / sizeof(dir_ent_t)) {
-                    dir_ent_t* entry = (dir_ent_t*) fetch_ptr(inode, j * sizeof(dir_ent_t));
-                    if(entry->inum != -1) return -1;
-                    j++;
-                }
-            }
+    inode_t* pinode = lock_inode(pinum, 1);
+    if(pinode == 0) return -1;
+    if(pinode->type != UFS_DIRECTORY) {
+        unlock_inode(pinum);
+        return -1;
+    }
 
-            // Unlink the file by setting its inum to -1 in the directory entry
-            dir->inum = -1;
+    // Find the entry through the directory's name index
+    dirindex_t* idx = dir_index(pinum, pinode);
+    int slot = dirindex_lookup(idx, name);
+    if(slot >= 0) {
+        dir_ent_t* dir = (dir_ent_t*) fetch_ptr(pinode, slot * sizeof(dir_ent_t));
 
-            // Clear the data blocks used by the file from the data bitmap
-            for(int j = 0; j <= inode->size / UFS_BLOCK_SIZE; j++) {
-                bit_clear((unsigned int*)data_bitmap, inode->direct[j] - s->data_region_addr);
+        // Get the inode for the file to be unlinked and return -1 if it is a non-empty directory.
+        // Its lock is held until the change is logged, ahead of any reuse of the number.
+        int inum = dir->inum;
+        inode_t* inode = 0;
+        if(inum & MFS_REMOTE) {
+            *remote = inum;
+        } else {
+            inode = lock_inode(inum, 1);
+            if(inode == 0) {
+                unlock_inode(pinum);
+                return -1;
+            }
+            if(release_inode(inum, inode) < 0) {
+                unlock_inode(inum);
+                unlock_inode(pinum);
+                return -1;
             }
-            // Clear the inode from the inode bitmap
-            bit_clear((unsigned int*)inode_bitmap, dir->inum);
-            return 0;
         }
-        i++;
+
+        // Unlink the file by setting its inum to -1 in the directory entry
+        dir->inum = -1;
+        journal_dirty(dir, sizeof(dir_ent_t));
+        dirindex_remove(idx, name);
+        dirindex_put_slot(idx, slot);
+        mfs_repl_t op = { .mtype = MFS_UNLINK, .inum = pinum, .len = strlen(name) + 1 };
+        repl_log(&op, name);
+        if(inode) unlock_inode(inum);
+        unlock_inode(pinum);
+        return 0;
     }
 
     // Return 0 if the file was not found in the parent directory
+    unlock_inode(pinum);
+    return 0;
+}
+
+// Returns whether inode inum was made by fs_create_detached. The caller
+// holds the inode's lock.
+int is_detached(int inum, inode_t* inode) {
+    if(inode->type == UFS_REGULAR_FILE) return detached_files[inum];
+    dir_ent_t* up = (dir_ent_t*) fetch_ptr(inode, sizeof(dir_ent_t));
+    return up->inum >= 0 && (up->inum & MFS_REMOTE);
+}
+
+// Sets detached_files for a newly opened image: a regular file no entry
+// refers to was made by fs_create_detached (fsck frees any other)
+void find_detached() {
+    detached_files = calloc(s->num_inodes, 1);
+    for(int i = 1; i < s->num_inodes; i++) {
+        inode_t* inode = fetch_inode(i);
+        if(inode && inode->type == UFS_REGULAR_FILE) detached_files[i] = 1;
+    }
+    for(int i = 0; i < s->num_inodes; i++) {
+        inode_t* inode = fetch_inode(i);
+        if(inode == 0 || inode->type != UFS_DIRECTORY) continue;
+        for(int off = 0; off < inode->size; off += UFS_BLOCK_SIZE) {
+            dir_ent_t* ents = (dir_ent_t*) fetch_ptr(inode, off);
+            int n = MIN(inode->size - off, UFS_BLOCK_SIZE) / sizeof(dir_ent_t);
+            for(int j = off == 0 ? 2 : 0; j < n; j++) {
+                int target = ents[j].inum;
+                if(target > 0 && !(target & MFS_REMOTE) && target < s->num_inodes) detached_files[target] = 0;
+            }
+        }
+    }
+}
+
+// Frees an inode made by fs_create_detached once the entry on another
+// server that referred to it is gone. Returns 0, or -1 if it does not
+// exist, is not detached or is a directory with entries.
+int fs_unlink_detached(int inum) {
+    if(inum == 0) return -1;
+    inode_t* inode = lock_inode(inum, 1);
+    if(inode == 0) return -1;
+    if(!is_detached(inum, inode)) {
+        unlock_inode(inum);
+        return -1;
+    }
+    int rc = release_inode(inum, inode);
+    if(rc == 0) {
+        mfs_repl_t op = { .mtype = MFS_UNLINK, .inum = -1, .offset = inum };
+        repl_log(&op, 0);
+    }
+    unlock_inode(inum);
+    return rc;
+}
+
+// Decodes a datagram of either wire format into a request header and a
+// pointer to its payload. Legacy messages are decoded in place: the payload
+// points at the message's name or buffer. Returns -1 if the datagram is
+// malformed, otherwise 1 for a legacy message and 0 for a compact one.
+int decode_request(char* datagram, int n, mfs_hdr_t* req, char** payload) {
+  mfs_hdr_t* hdr = (mfs_hdr_t*)datagram;
+  if (n >= sizeof(mfs_hdr_t) && hdr->magic == MFS_WIRE_MAGIC) {
+    if (sizeof(mfs_hdr_t) + hdr->len > n) return -1;
+    *req = *hdr;
+    *payload = datagram + sizeof(mfs_hdr_t);
+    return 0;
+  }
+  if (n < sizeof(message_t)) return -1;
+
+  message_t* message = (message_t*)datagram;
+  bzero(req, sizeof(mfs_hdr_t));
+  req->mtype = message->mtype;
+  req->rc = message->rc;
+  req->inum = message->inum;
+  req->offset = message->offset;
+  req->nbytes = message->nbytes;
+  req->type = message->type;
+  if (message->mtype == MFS_WRITE) {
+    *payload = message->buffer;
+    req->len = MIN(MAX(message->nbytes, 0), sizeof(message->buffer));
+  } else {
+    *payload = message->name;
+    message->name[sizeof(message->name) - 1] = '\0';
+    req->len = strlen(message->name) + 1;
+  }
+  return 1;
+}
+
+// Returns whether a request came in the legacy format
+int legacy_request(mfs_hdr_t* req) {
+  return req->version < MFS_WIRE_VERSION;
+}
+
+// Returns the NUL-terminated name carried by a request, or null
+char* request_name(mfs_hdr_t* req, char* payload) {
+  if (req->len == 0 || payload[req->len - 1] != '\0') return 0;
+  return payload;
+}
+
+int handle_request(mfs_hdr_t* req, char* payload, mfs_hdr_t* reply, char* reply_payload);
+
+// Runs the operations of an MFS_COMPOUND request in order (see message.h),
+// each as if it had come in its own request, and fills in the reply with
+// their results. A malformed request runs none of them.
+void compound(mfs_hdr_t* req, char* payload, mfs_hdr_t* reply, char* reply_payload) {
+  mfs_result_t* results = (mfs_result_t*)reply_payload;
+  mfs_op_t op;
+  reply->rc = -1;
+  reply->nbytes = 0;
+
+  // Check that the operations fit the payload before running any
+  int n = 0;
+  for (int pos = 0; pos < req->len; n++) {
+    if (n == MFS_MAX_OPS || pos + sizeof(mfs_op_t) > req->len) return;
+    memcpy(&op, payload + pos, sizeof(mfs_op_t));
+    pos += sizeof(mfs_op_t) + op.len;
+    if (pos > req->len) return;
+  }
+
+  reply->rc = 0;
+  char* data = payload;
+  for (int i = 0; i < n; i++) {
+    memcpy(&op, data, sizeof(mfs_op_t));
+    data += sizeof(mfs_op_t);
+    mfs_hdr_t sub = *req, subreply;
+    sub.mtype = op.mtype;
+    sub.inum = op.inum;
+    sub.offset = op.offset;
+    sub.nbytes = op.nbytes;
+    sub.type = op.type;
+    sub.len = op.len;
+    if (op.flags & MFS_OP_REF) {
+      int ref = op.inum;
+      sub.inum = ref >= 0 && ref < i && results[ref].rc == 0 ? results[ref].inum : -1;
+    }
+
+    mfs_result_t* r = &results[i];
+    bzero(r, sizeof(mfs_result_t));
+    r->rc = -1;
+    r->inum = -1;
+    int allowed = op.mtype == MFS_LOOKUP || op.mtype == MFS_STAT || op.mtype == MFS_WRITE ||
+                  op.mtype == MFS_CRET || op.mtype == MFS_UNLINK;
+    if (allowed && sub.inum >= 0 && handle_request(&sub, data, &subreply, 0) == 1) {
+      r->rc = subreply.rc;
+      r->inum = subreply.rc == 0 ? subreply.inum : -1;
+      if (op.mtype == MFS_STAT) {
+        r->type = subreply.type;
+        r->size = subreply.nbytes;
+      }
+    }
+    if (r->rc != 0) reply->rc = -1;
+    data += op.len;
+  }
+  reply->nbytes = n;
+  reply->len = n * sizeof(mfs_result_t);
+}
+
+// Handles one decoded request, filling in the reply header and writing any
+// reply payload (read data) to reply_payload
+// Returns 1 if the reply should be sent, 0 if not, -1 on shutdown
+int handle_request(mfs_hdr_t* req, char* payload, mfs_hdr_t* reply, char* reply_payload) {
+  int result, depth, type;
+  char* name = request_name(req, payload);
+  *reply = *req;
+  reply->version = MFS_WIRE_VERSION;
+  reply->rc = 0;
+  reply->len = 0;
+  switch(req->mtype) {
+    case MFS_INIT:
+      // Tell the client which wire version to use from now on
+      reply->type = MFS_WIRE_VERSION;
+      return 1;
+    case MFS_STAT:
+      if (fs_stat(req->inum, &type, &reply->nbytes) == -1) {
+        reply->rc = -1;
+      } else {
+        reply->type = type;
+      }
+      reply->offset = lease_ms;
+      return 1;
+    case MFS_LOOKUP:
+      result = name ? fs_lookup(req->inum, name) : -1;
+      reply->inum = result;
+      reply->rc = result < 0 ? -1 : 0;
+      reply->offset = lease_ms;
+      return 1;
+    case MFS_LOOKUPPATH:
+      result = -1;
+      depth = 0;
+      int remote = 0;
+      // A path of MFS_MAX_PATH bytes has few enough components for their
+      // entries to fit in one reply
+      if (name && req->len <= MFS_MAX_PATH) {
+        mfs_path_ent_t* ents = (req->type & MFS_PATH_STAT) ? (mfs_path_ent_t*)reply_payload : 0;
+        result = fs_lookup_path(req->inum, name, ents, &depth, &remote);
+        if (ents) reply->len = depth * sizeof(mfs_path_ent_t);
+      }
+      reply->inum = result;
+      reply->rc = result < 0 ? -1 : remote ? MFS_PATH_REMOTE : 0;
+      reply->nbytes = depth;
+      reply->offset = lease_ms;
+      return 1;
+    case MFS_READDIR:
+      // Legacy replies have room for a block
+      result = fs_readdir(req->inum, req->offset, reply_payload,
+                          req->version >= MFS_WIRE_VERSION ? BUFFER_SZ - sizeof(mfs_hdr_t) : UFS_BLOCK_SIZE,
+                          req->nbytes, req->type & MFS_READDIR_PLUS, &reply->nbytes, &depth);
+      reply->type = 0;
+      if (result < 0) {
+        reply->rc = -1;
+        reply->nbytes = 0;
+      } else {
+        reply->len = result;
+        reply->offset = MAX(depth, 0);
+        if (depth < 0) reply->type = MFS_READDIR_EOF;
+      }
+      return 1;
+    case MFS_CRET:
+      result = -1;
+      if (req->inum == -1 && !legacy_request(req)) {
+        reply->rc = fs_create_detached(req->type, req->offset, &result);
+      } else {
+        reply->rc = name ? fs_create(req->inum, req->type, name, &result) : -1;
+      }
+      reply->inum = reply->rc == 0 ? result : -1;
+      return 1;
+    case MFS_LINK:
+      result = -1;
+      reply->rc = name ? fs_link(req->inum, name, req->nbytes, &result) : -1;
+      reply->inum = reply->rc == 0 ? result : -1;
+      return 1;
+    case MFS_COMPOUND:
+      compound(req, payload, reply, reply_payload);
+      return 1;
+    case MFS_WRITE:
+      if (req->nbytes < 0 || req->nbytes > req->len || req->nbytes > UFS_BLOCK_SIZE) {
+        reply->rc = -1;
+        return 1;
+      }
+      // A gap too large for one transaction is filled in updates of its own
+      if (next_fill(req->inum, req->offset) >= 0) {
+        journal_pause();
+        fill_gap(req->inum, req->offset);
+        journal_resume();
+      }
+      reply->rc = fs_write(req->inum, payload, req->offset, req->nbytes);
+      return 1;
+    case MFS_UNLINK:
+      if (req->inum == -1 && !legacy_request(req)) {
+        reply->rc = fs_unlink_detached(req->offset);
+        return 1;
+      }
+      reply->rc = name ? fs_unlink(req->inum, name, &result) : -1;
+      if (reply->rc == 0 && result >= 0) {
+        reply->inum = result;
+        reply->type = MFS_UNLINK_REMOTE;
+      }
+      return 1;
+    case MFS_STATS:
+      // Too large for a legacy reply
+      if (req->version < MFS_WIRE_VERSION) {
+        reply->rc = -1;
+        return 1;
+      }
+      mfs_stats_t st;
+      server_stats(&st);
+      if (req->type & MFS_STATS_TEXT) {
+        reply->len = stats_format(&st, reply_payload, BUFFER_SZ - sizeof(mfs_hdr_t)) + 1;
+      } else {
+        memcpy(reply_payload, &st, sizeof(mfs_stats_t));
+        reply->len = sizeof(mfs_stats_t);
+      }
+      return 1;
+    case MFS_SHUTDOWN:
+      return -1;
+    default:
+      fprintf(stderr, "Invalid Request\n");
+      return 0;
+  }
+}
+
+// Returns whether a request modifies the file system, and so must be
+// executed at most once even if the client retransmits it
+int is_update(int mtype) {
+  return mtype == MFS_CRET || mtype == MFS_WRITE || mtype == MFS_UNLINK || mtype == MFS_COMPOUND ||
+         mtype == MFS_LINK;
+}
+
+// Returns at most how many data bitmap blocks freeing inum changes (see
+// release_bitmap_blocks), looking at it without an update in progress
+long free_bitmap_blocks(int inum) {
+  inode_t* inode = inum >= 0 && !(inum & MFS_REMOTE) ? lock_inode(inum, 0) : 0;
+  if (!inode) return 0;
+  long blocks = release_bitmap_blocks(inode);
+  unlock_inode(inum);
+  return blocks;
+}
+
+// Returns how many image blocks one operation may change, for the journal:
+// a few for inodes, directory and index blocks and the superblock, and the
+// bitmap blocks it may touch. Creates take an inode bitmap block and those
+// of up to four data and index blocks; writes and unlinks look at the file
+// they change (see write_blocks and release_bitmap_blocks). One that finds
+// more to change once it holds its locks fails instead.
+long op_blocks(int mtype, int inum, int offset, int nbytes, char* name) {
+  switch (mtype) {
+    case MFS_WRITE:
+    case MFS_BWRITE:
+      return 8 + write_blocks_unlocked(inum, offset, nbytes);
+    case MFS_UNLINK:
+      if (name) return 9 + MAX(4, free_bitmap_blocks(fs_lookup(inum, name)));
+      return 9 + MAX(4, inum == -1 ? free_bitmap_blocks(offset) : 0);
+    case MFS_CRET:
+    case MFS_LINK:
+      return 13;
+    default:
+      return 8;
+  }
+}
+
+// Returns how many image blocks an update may change, for the journal: what
+// each of its operations may (see op_blocks)
+long update_blocks(mfs_hdr_t* req, char* payload) {
+  if (req->mtype == MFS_UNLINK)
+    return op_blocks(req->mtype, req->inum, req->offset, req->nbytes, request_name(req, payload));
+  if (req->mtype != MFS_COMPOUND)
+    return op_blocks(req->mtype, req->inum, req->offset, req->nbytes, 0);
+
+  long blocks = 8;
+  mfs_op_t op;
+  for (int pos = 0; pos + sizeof(mfs_op_t) <= req->len; pos += sizeof(mfs_op_t) + op.len) {
+    memcpy(&op, payload + pos, sizeof(mfs_op_t));
+    if (pos + sizeof(mfs_op_t) + op.len > req->len) break;
+    // An operation on a file made earlier in the request finds it empty
+    mfs_hdr_t sub = { .len = op.len };
+    char* name = op.mtype == MFS_UNLINK ? request_name(&sub, payload + pos + sizeof(mfs_op_t)) : 0;
+    blocks += op_blocks(op.mtype, op.flags & MFS_OP_REF ? -1 : op.inum, op.offset, op.nbytes, name);
+  }
+  return blocks;
+}
+
+// Collects a fragment of a bulk write into reply (see message.h). The write
+// is applied once every fragment has arrived, and its reply is kept in the
+// duplicate reply cache like that of any update. Returns 1 if the reply
+// should be sent, 0 if not.
+int bulk_write(struct sockaddr_in* addr, mfs_hdr_t* req, char* payload, char* reply, int* out_len) {
+  mfs_hdr_t* hdr = (mfs_hdr_t*)reply;
+  mfs_frag_t* status = (mfs_frag_t*)(reply + sizeof(mfs_hdr_t));
+  *hdr = *req;
+  hdr->version = MFS_WIRE_VERSION;
+  hdr->rc = -1;
+  hdr->len = 0;
+  *out_len = sizeof(mfs_hdr_t);
+
+  // Fragments of a write that was already applied get its reply again
+  int cached = drc_peek(addr, req->reqid, reply, out_len);
+  if (cached == DRC_HIT) {
+    journal_depend();
+    repl_depend();
+    return 1;
+  }
+  if (cached == DRC_IN_PROGRESS) return 0;
+  if (req->len < sizeof(mfs_frag_t)) return 1;
+
+  mfs_frag_t* frag = (mfs_frag_t*)payload;
+  char* whole;
+  int rc = bulk_add(addr, req, frag, payload + sizeof(mfs_frag_t), req->len - sizeof(mfs_frag_t),
+                    status->bits, &whole);
+  if (rc == BULK_INVALID) return 1;
+  if (rc == BULK_PARTIAL) {
+    if (!(frag->flags & MFS_FRAG_PROBE)) return 0;
+    hdr->rc = MFS_BULK_PARTIAL;
+    hdr->len = sizeof(mfs_frag_t);
+    status->index = 0;
+    status->flags = 0;
+    *out_len += hdr->len;
+    return 1;
+  }
+
+  cached = drc_begin(addr, req->reqid, reply, out_len);
+  if (cached == DRC_MISS) {
+    fill_gap(req->inum, req->offset);
+    journal_begin(MIN(update_blocks(req, whole), INT_MAX));
+    hdr->rc = fs_write(req->inum, whole, req->offset, req->nbytes);
+    journal_end();
+    drc_finish(addr, req->reqid, reply, *out_len);
+  } else if (cached == DRC_HIT) {
+    journal_depend();
+    repl_depend();
+  }
+  free(whole);
+  return cached != DRC_IN_PROGRESS;
+}
+
+// Makes the change a primary logged as entry e, followed by data. Returns
+// 0, or -1 if it failed here where it succeeded on the primary.
+int apply_entry(mfs_repl_t* e, char* data) {
+  int result = e->target, remote;
+  int named = e->len > 0 && data[e->len - 1] == '\0';
+  switch (e->mtype) {
+    case MFS_CRET:
+      if (e->inum == -1) return fs_create_detached(e->type, e->offset, &result) == 0 && result == e->target ? 0 : -1;
+      return named && fs_create(e->inum, e->type, data, &result) == 0 && result == e->target ? 0 : -1;
+    case MFS_LINK:
+      return named ? fs_link(e->inum, data, e->nbytes, &result) : -1;
+    case MFS_WRITE:
+      return e->nbytes == e->len ? fs_write(e->inum, data, e->offset, e->nbytes) : -1;
+    case MFS_UNLINK:
+      if (e->inum == -1) return fs_unlink_detached(e->offset);
+      return named ? fs_unlink(e->inum, data, &remote) : -1;
+    default:
+      return -1;
+  }
+}
+
+// Applies the log entries of an MFS_REPLICATE request from the primary,
+// in order (see message.h), and replies with how far this backup has
+// got. Entries are applied one at a time by whichever worker received
+// them; one holding entries that come later waits up to REPLAY_WAIT_MS
+// for another to apply those before them. Returns 1.
+int replicate(mfs_hdr_t* req, char* payload, char* reply, int* out_len) {
+  mfs_hdr_t* hdr = (mfs_hdr_t*)reply;
+  *hdr = *req;
+  hdr->version = MFS_WIRE_VERSION;
+  hdr->rc = -1;
+  hdr->len = 0;
+  *out_len = sizeof(mfs_hdr_t);
+  if (!backup) return 1;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  long ns = deadline.tv_nsec + REPLAY_WAIT_MS * 1000000L;
+  deadline.tv_sec += ns / 1000000000L;
+  deadline.tv_nsec = ns % 1000000000L;
+
+  hdr->rc = 0;
+  pthread_mutex_lock(&replay_lock);
+  for (int pos = 0; pos + sizeof(mfs_repl_t) <= req->len; ) {
+    mfs_repl_t e;
+    memcpy(&e, payload + pos, sizeof(mfs_repl_t));
+    char* data = payload + pos + sizeof(mfs_repl_t);
+    if (e.len < 0 || e.len > req->len - pos - sizeof(mfs_repl_t)) break;
+    pos += sizeof(mfs_repl_t) + e.len;
+
+    int rc = 0;
+    while (e.seq > *image_seq + 1 && rc == 0)
+      rc = pthread_cond_timedwait(&replay_cond, &replay_lock, &deadline);
+    if (e.seq > *image_seq + 1) {
+      hdr->rc = MFS_REPL_GAP;
+      break;
+    }
+    if (e.seq <= *image_seq) continue;
+
+    char* name = e.mtype == MFS_UNLINK && e.len > 0 && data[e.len - 1] == '\0' ? data : 0;
+    journal_begin(MIN(op_blocks(e.mtype, e.inum, e.offset, e.nbytes, name), INT_MAX));
+    if (apply_entry(&e, data) < 0)
+      fprintf(stderr, "replication: entry %llu (type %d) failed on this backup\n", (unsigned long long)e.seq, e.mtype);
+    *image_seq = e.seq;
+    journal_dirty(image_seq, sizeof(*image_seq));
+    journal_end();
+    pthread_cond_broadcast(&replay_cond);
+  }
+  long long applied = *image_seq;
+  pthread_mutex_unlock(&replay_lock);
+
+  // What other workers applied is acknowledged here too, once durable
+  journal_depend();
+  memcpy(reply + sizeof(mfs_hdr_t), &applied, sizeof(applied));
+  hdr->len = sizeof(applied);
+  *out_len += hdr->len;
+  return 1;
+}
+
+// Answers an MFS_READ by sending the data from the image with fs_send,
+// rather than copying it into reply. Returns 1 if reply holds an error to
+// send, 0 if the reply has been sent.
+int read_reply(struct sockaddr_in* addr, mfs_hdr_t* req, char* reply, int* out_len) {
+  mfs_hdr_t* hdr = (mfs_hdr_t*)reply;
+  *hdr = *req;
+  hdr->version = MFS_WIRE_VERSION;
+  hdr->rc = -1;
+  hdr->len = 0;
+  hdr->offset = lease_ms;
+  *out_len = sizeof(mfs_hdr_t);
+  if (req->nbytes < 0 || req->nbytes > UFS_BLOCK_SIZE) return 1;
+  if (req->type & MFS_READ_PARTIAL) {
+    // Clip the range at the end of the file
+    int type, size;
+    if (fs_stat(req->inum, &type, &size) == 0 && req->offset >= 0 && req->offset <= size)
+      hdr->nbytes = MIN(req->nbytes, size - req->offset);
+  }
+
+  hdr->rc = 0;
+  hdr->len = hdr->nbytes;
+  struct iovec head = { hdr, sizeof(mfs_hdr_t) };
+  if (fs_send(req->inum, req->offset, hdr->nbytes, &head, 0, addr) < 0) {
+    hdr->rc = -1;
+    hdr->len = 0;
+    return 1;
+  }
+  stats_sent(MFS_READ, sizeof(mfs_hdr_t) + hdr->len);
+  return 0;
+}
+
+// Answers a bulk read request by sending each wanted fragment in its own
+// datagram, built in reply. Returns 1 if reply holds an error to send, 0 if
+// everything has been sent.
+int bulk_read(struct sockaddr_in* addr, mfs_hdr_t* req, char* payload, char* reply, int* out_len) {
+  mfs_hdr_t* hdr = (mfs_hdr_t*)reply;
+  mfs_frag_t* frag = (mfs_frag_t*)(reply + sizeof(mfs_hdr_t));
+  *hdr = *req;
+  hdr->version = MFS_WIRE_VERSION;
+  hdr->rc = -1;
+  hdr->len = 0;
+  *out_len = sizeof(mfs_hdr_t);
+
+  // The whole range must lie within the file, as for MFS_READ
+  int type, size;
+  if (req->len < sizeof(mfs_frag_t) || fs_stat(req->inum, &type, &size) == -1 || req->offset < 0 ||
+      req->nbytes <= 0 || req->nbytes > MFS_MAX_FRAGS * MFS_FRAG_SIZE || (long)req->offset + req->nbytes > size) {
+    return 1;
+  }
+  mfs_frag_t* wanted = (mfs_frag_t*)payload;
+  int nfrags = (req->nbytes - 1) / MFS_FRAG_SIZE + 1;
+
+  hdr->rc = 0;
+  bzero(frag, sizeof(mfs_frag_t));
+  struct iovec head = { reply, sizeof(mfs_hdr_t) + sizeof(mfs_frag_t) };
+  for (int i = 0; i < nfrags; i++) {
+    if (!MFS_FRAG_HAS(wanted->bits, i)) continue;
+    int len = MIN(MFS_FRAG_SIZE, req->nbytes - i * MFS_FRAG_SIZE);
+    frag->index = i;
+    hdr->len = sizeof(mfs_frag_t) + len;
+    if (fs_send(req->inum, req->offset + i * MFS_FRAG_SIZE, len, &head, 0, addr) < 0) {
+      // The file changed under the transfer
+      hdr->rc = -1;
+      hdr->len = 0;
+      return 1;
+    }
+    stats_sent(MFS_BREAD, sizeof(mfs_hdr_t) + hdr->len);
+  }
+  return 0;
+}
+
+// Handles the datagram in buffer, received from addr, and builds its reply in
+// the same format the request used: a compact reply is written to reply, a
+// legacy one overwrites the request message in buffer. Sets *out and *out_len
+// to the datagram to send. Returns 1 if the reply should be sent, 0 if not,
+// -1 on shutdown
+int handle_datagram(struct sockaddr_in* addr, char* buffer, int n, char* reply, char** out, int* out_len) {
+  mfs_hdr_t req;
+  char* payload;
+  int legacy = decode_request(buffer, n, &req, &payload);
+  if (legacy < 0) return 0;
+
+  if (!legacy) {
+    *out = reply;
+    if (req.mtype == MFS_REPLICATE) return replicate(&req, payload, reply, out_len);
+    if (backup && (req.mtype == MFS_BWRITE || is_update(req.mtype))) {
+      // A backup takes changes only from its primary
+      mfs_hdr_t* hdr = (mfs_hdr_t*)reply;
+      *hdr = req;
+      hdr->version = MFS_WIRE_VERSION;
+      hdr->rc = -1;
+      hdr->len = 0;
+      *out_len = sizeof(mfs_hdr_t);
+      return 1;
+    }
+    if (req.mtype == MFS_BWRITE) return bulk_write(addr, &req, payload, reply, out_len);
+    if (req.mtype == MFS_BREAD) return bulk_read(addr, &req, payload, reply, out_len);
+    if (req.mtype == MFS_READ) return read_reply(addr, &req, reply, out_len);
+
+    // Answer retransmitted updates from the duplicate reply cache, once
+    // what they did is durable
+    int update = is_update(req.mtype);
+    if (update) {
+      int cached = drc_begin(addr, req.reqid, reply, out_len);
+      if (cached == DRC_HIT) {
+        journal_depend();
+        repl_depend();
+        return 1;
+      }
+      if (cached == DRC_IN_PROGRESS) return 0;
+      journal_begin(MIN(update_blocks(&req, payload), INT_MAX));
+    }
+    mfs_hdr_t* hdr = (mfs_hdr_t*)reply;
+    int rc = handle_request(&req, payload, hdr, reply + sizeof(mfs_hdr_t));
+    if (update) journal_end();
+    *out_len = sizeof(mfs_hdr_t) + hdr->len;
+    if (update) drc_finish(addr, req.reqid, reply, *out_len);
+    return rc;
+  }
+
+  // Legacy clients never wait for an MFS_INIT reply
+  message_t* message = (message_t*)buffer;
+  *out = buffer;
+  *out_len = sizeof(message_t);
+
+  // Legacy read replies are sent from the image too: the message up to
+  // its buffer, the data, and the rest of the request message as it came
+  if (req.mtype == MFS_READ) {
+    message->rc = -1;
+    if (req.nbytes < 0 || req.nbytes > UFS_BLOCK_SIZE) return 1;
+    message->rc = 0;
+    struct iovec head = { message, offsetof(message_t, buffer) };
+    struct iovec tail = { message->buffer + req.nbytes, sizeof(message_t) - offsetof(message_t, buffer) - req.nbytes };
+    if (fs_send(req.inum, req.offset, req.nbytes, &head, &tail, addr) < 0) {
+      message->rc = -1;
+      return 1;
+    }
+    stats_sent(MFS_READ, sizeof(message_t));
     return 0;
+  }
+  mfs_hdr_t hdr;
+  int update = is_update(req.mtype);
+  if (update && backup) {
+    message->rc = -1;
+    return 1;
+  }
+  if (update) journal_begin(MIN(update_blocks(&req, payload), INT_MAX));
+  int rc = handle_request(&req, payload, &hdr, message->buffer);
+  if (update) journal_end();
+  if (req.mtype == MFS_INIT) return 0;
+  message->rc = hdr.rc;
+  message->inum = hdr.inum;
+  message->type = hdr.type;
+  message->nbytes = hdr.nbytes;
+  return rc;
+}
+
+// Returns the message type of a datagram in either format, or 0
+int datagram_mtype(char* datagram, int n) {
+  mfs_hdr_t* hdr = (mfs_hdr_t*)datagram;
+  if (n >= sizeof(mfs_hdr_t) && hdr->magic == MFS_WIRE_MAGIC) return hdr->mtype;
+  if (n >= sizeof(message_t)) return ((message_t*)datagram)->mtype;
+  return 0;
+}
+
+// Returns the return code in a reply datagram of either format
+int datagram_rc(char* datagram) {
+  mfs_hdr_t* hdr = (mfs_hdr_t*)datagram;
+  if (hdr->magic == MFS_WIRE_MAGIC) return hdr->rc;
+  return ((message_t*)datagram)->rc;
 }
 
+// Worker loop: each worker drains up to batch_size datagrams from the shared
+// socket with one call, handles them in order, and sends all the replies with
+// one call. The kernel hands each datagram to one reader; request and reply
+// buffers are allocated once per worker and reused for every batch.
+void* worker(void* arg) {
+  struct sockaddr_in addrs[MAX_BATCH], reply_addrs[MAX_BATCH];
+  char* buffers[MAX_BATCH];
+  char* reply_buffers[MAX_BATCH];
+  char* replies[MAX_BATCH];
+  int lens[MAX_BATCH], reply_lens[MAX_BATCH], mtypes[MAX_BATCH];
+  for (int i = 0; i < batch_size; i++) {
+    buffers[i] = malloc(BUFFER_SZ);
+    reply_buffers[i] = malloc(BUFFER_SZ);
+  }
+
+  while (1) {
+    int n = UDP_ReadBatch(sd, addrs, buffers, lens, batch_size, BUFFER_SZ);
+    if (n <= 0) continue;
+    long received = stats_now_us();
+    if (sharding) stats_received(shard, n);
+
+    int nreplies = 0, handled = 0, shutdown = 0;
+    for (int i = 0; i < n && !shutdown; i++, handled++) {
+      long start = stats_now_us();
+      mtypes[i] = datagram_mtype(buffers[i], lens[i]);
+      int rc = handle_datagram(&addrs[i], buffers[i], lens[i], reply_buffers[i],
+                               &replies[nreplies], &reply_lens[nreplies]);
+      int replied = rc > 0;
+      stats_request(mtypes[i], replied && datagram_rc(replies[nreplies]) < 0, lens[i],
+                    replied ? reply_lens[nreplies] : 0, stats_now_us() - start);
+      if (replied) {
+        reply_addrs[nreplies] = addrs[i];
+        nreplies++;
+      }
+      shutdown = rc < 0;
+    }
+    // Replies to updates go out once the updates are durable, and applied
+    // by the backups; updates from every worker that ended meanwhile share
+    // the commit
+    journal_wait();
+    repl_wait();
+    if (nreplies > 0) {
+      UDP_WriteBatch(sd, reply_addrs, replies, reply_lens, nreplies);
+    }
+    long sent = stats_now_us();
+    for (int i = 0; i < handled; i++) stats_total(mtypes[i], sent - received);
+    if (shutdown) {
+      stop_server();
+      exit(0);
+    }
+  }
+  return 0;
+}
+
+// io_uring event loop, chosen with -u: each worker has its own ring with a
+// multishot receive armed on the shared socket, so datagrams arrive as
+// completions in buffers the ring provides rather than through a receive
+// call each. Up to batch_size of them are handled as they come, and their
+// replies are queued as sends that go to the kernel with the next wait for
+// completions, in the same system call. Replies wait for the journal as in
+// worker(). Read replies and bulk read fragments are still sent directly
+// by fs_send, which must hold the inode lock until the data is copied.
+#define URING_BUFFERS (64)  // receive buffers per ring, and sends in flight
+#define URING_GROUP   (0)
+
+// A reply being sent: its message, and the receive buffer it was built in
+// (legacy replies overwrite their request) to give back once it is sent
+typedef struct {
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_in addr;
+  char* reply;
+  int bid;
+  int mtype;
+  long received;
+} uring_send_t;
+
+// Arms the multishot receive, again whenever it stops (when the ring runs
+// out of buffers, say)
+static void uring_receive(uring_t* ring, struct msghdr* msg) {
+  struct io_uring_sqe* sqe = uring_sqe(ring);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = sd;
+  sqe->addr = (unsigned long)msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_GROUP;
+  sqe->user_data = 0;
+}
+
+void* uring_worker(void* arg) {
+  uring_t ring;
+  if (uring_init(&ring, 2 * URING_BUFFERS) < 0 ||
+      uring_provide(&ring, URING_GROUP, URING_BUFFERS,
+                    sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + BUFFER_SZ) < 0) {
+    perror("io_uring, using the blocking loop");
+    return worker(arg);
+  }
+
+  // Each send has a slot; when all are taken a reply is sent at once from
+  // spare instead
+  uring_send_t slots[URING_BUFFERS], spare;
+  int free_slots[URING_BUFFERS], nfree = 0;
+  for (int i = 0; i < URING_BUFFERS; i++) {
+    slots[i].reply = malloc(BUFFER_SZ);
+    free_slots[nfree++] = i;
+  }
+  spare.reply = malloc(BUFFER_SZ);
+
+  struct msghdr receive;
+  bzero(&receive, sizeof(receive));
+  receive.msg_namelen = sizeof(struct sockaddr_in);
+  uring_receive(&ring, &receive);
+
+  while (1) {
+    uring_submit(&ring, 1);
+    long received = stats_now_us();
+    int handled = 0, rearm = 0, shutdown = 0;
+    struct io_uring_cqe* cqe;
+    while (handled < batch_size && !shutdown && (cqe = uring_peek(&ring))) {
+      uint64_t tag = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uring_seen(&ring);
+
+      // A reply has been sent
+      if (tag != 0) {
+        uring_send_t* slot = &slots[tag - 1];
+        stats_total(slot->mtype, stats_now_us() - slot->received);
+        if (slot->bid >= 0) uring_recycle(&ring, slot->bid);
+        free_slots[nfree++] = tag - 1;
+        continue;
+      }
+
+      // A datagram has arrived
+      if (!(flags & IORING_CQE_F_MORE)) rearm = 1;
+      if (res < 0 || !(flags & IORING_CQE_F_BUFFER)) continue;
+      int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      char* buffer = uring_buffer(&ring, bid);
+      struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buffer;
+      char* payload = buffer + sizeof(struct io_uring_recvmsg_out) + receive.msg_namelen;
+      if (sharding) stats_received(shard, 1);
+      if (out->flags & MSG_TRUNC) {
+        uring_recycle(&ring, bid);
+        continue;
+      }
+
+      int index = nfree > 0 ? free_slots[--nfree] : -1;
+      uring_send_t* slot = index >= 0 ? &slots[index] : &spare;
+      memcpy(&slot->addr, buffer + sizeof(struct io_uring_recvmsg_out), sizeof(struct sockaddr_in));
+      slot->mtype = datagram_mtype(payload, out->payloadlen);
+      slot->received = received;
+      long start = stats_now_us();
+      char* reply;
+      int reply_len;
+      int rc = handle_datagram(&slot->addr, payload, out->payloadlen, slot->reply, &reply, &reply_len);
+      stats_request(slot->mtype, rc > 0 && datagram_rc(reply) < 0, out->payloadlen, rc > 0 ? reply_len : 0,
+                    stats_now_us() - start);
+      handled++;
+      shutdown = rc < 0;
+
+      slot->bid = rc > 0 && reply == payload ? bid : -1;
+      if (slot->bid < 0) uring_recycle(&ring, bid);
+      if (rc <= 0 || index < 0) {
+        if (rc > 0) {
+          journal_wait();
+          repl_wait();
+          UDP_Write(sd, &slot->addr, reply, reply_len);
+        }
+        stats_total(slot->mtype, stats_now_us() - received);
+        if (slot->bid >= 0) uring_recycle(&ring, slot->bid);
+        if (index >= 0) free_slots[nfree++] = index;
+        continue;
+      }
+      bzero(&slot->msg, sizeof(struct msghdr));
+      slot->iov.iov_base = reply;
+      slot->iov.iov_len = reply_len;
+      slot->msg.msg_name = &slot->addr;
+      slot->msg.msg_namelen = sizeof(struct sockaddr_in);
+      slot->msg.msg_iov = &slot->iov;
+      slot->msg.msg_iovlen = 1;
+      struct io_uring_sqe* sqe = uring_sqe(&ring);
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = sd;
+      sqe->addr = (unsigned long)&slot->msg;
+      sqe->len = 1;
+      sqe->user_data = index + 1;
+    }
+
+    // The sends queued above go out with the next submission, once what
+    // they report is durable and replicated
+    journal_wait();
+    repl_wait();
+    if (rearm) uring_receive(&ring, &receive);
+    if (shutdown) {
+      uring_submit(&ring, 0);
+      stop_server();
+      exit(0);
+    }
+  }
+  return 0;
+}
+
+// Starts worker i (passed as the argument) on its socket; under sharding
+// it is pinned to the i-th CPU the server may run on, wrapping around
+void* start_worker(void* arg) {
+  shard = (long)arg;
+  sd = sockets[shard % num_sockets];
+  cpu_set_t allowed, cpu;
+  if (sharding && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    int n = shard % CPU_COUNT(&allowed), c = 0;
+    while (!CPU_ISSET(c, &allowed) || n-- > 0) c++;
+    CPU_ZERO(&cpu);
+    CPU_SET(c, &cpu);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+  }
+  return use_uring ? uring_worker(arg) : worker(arg);
+}
+
+void usage() {
+  fprintf(stderr, "usage: server [-t <num_workers>] [-b <batch_size>] [-l <lease_ms>] "
+          "[-f sync|none|<ms>[:<blocks>]] [-u] [-s | -S] [-r <host>:<port> ... | -B] <port> <image_file>\n");
+  exit(1);
+}
+
+// Parses the -f argument: sync, none, or a flush period in milliseconds
+// optionally followed by a count of changed blocks that flushes sooner
+int parse_flush(char* arg) {
+  if (strcmp(arg, "sync") == 0) {
+    flush_policy = JOURNAL_SYNC;
+    return 0;
+  }
+  if (strcmp(arg, "none") == 0) {
+    flush_policy = JOURNAL_NONE;
+    return 0;
+  }
+  char* end;
+  flush_policy = JOURNAL_PERIODIC;
+  flush_ms = strtol(arg, &end, 10);
+  if (*end == ':') flush_blocks = strtol(end + 1, &end, 10);
+  return *end == 0 && end != arg && flush_ms > 0 && flush_blocks > 0 ? 0 : -1;
+}
 
 int main(int argc, char *argv[]) {
-  signal(SIGINT, interrupt_handler);
+  // Parse options
+  int ch;
+  int num_workers = 0;
+  while ((ch = getopt(argc, argv, "t:b:l:f:usSr:B")) != -1) {
+    switch (ch) {
+    case 't':
+      num_workers = atoi(optarg);
+      break;
+    case 'b':
+      batch_size = atoi(optarg);
+      break;
+    case 'l':
+      lease_ms = atoi(optarg);
+      break;
+    case 'f':
+      if (parse_flush(optarg) < 0) usage();
+      break;
+    case 'u':
+      use_uring = 1;
+      break;
+    case 's':
+      sharding = SHARD_FLOW;
+      break;
+    case 'S':
+      sharding = SHARD_CPU;
+      break;
+    case 'r':
+      if (repl_add_backup(optarg) < 0) usage();
+      break;
+    case 'B':
+      backup = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  // A worker per CPU by default under sharding, else one
+  if (num_workers == 0) {
+    cpu_set_t allowed;
+    num_workers = sharding && sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ?
+      MIN(CPU_COUNT(&allowed), MAX_WORKERS) : 1;
+  }
 
   // Check number of arguments
-  if (argc != 3) {
-    return 1;
+  if (argc != 2 || num_workers < 1 || num_workers > MAX_WORKERS ||
+      batch_size < 1 || batch_size > MAX_BATCH || lease_ms < 0 || (backup && repl_enabled())) {
+    usage();
   }
 
-  // Open socket and file system img
-  int portnum = atoi(argv[1]);
-  sd = UDP_Open(portnum);
-  if (sd < 0) {
+  // Signals are taken by one thread, so that a stop never interrupts a
+  // worker halfway through an update; every thread started from here on
+  // blocks them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  // Open the sockets (one, or one per worker) and file system img
+  int portnum = atoi(argv[0]);
+  num_sockets = sharding ? num_workers : 1;
+  for (int i = 0; i < num_sockets; i++) {
+    sockets[i] = sharding ? UDP_OpenShared(portnum) : UDP_Open(portnum);
+    if (sockets[i] < 0) {
+      return 1;
+    }
+    // room for a whole bulk write arriving at once
+    UDP_SetBufferSize(sockets[i], MFS_MAX_FRAGS * MFS_FRAG_SIZE);
+  }
+  if (sharding == SHARD_CPU && UDP_SteerByCPU(sockets[0], num_sockets) < 0) {
     return 1;
   }
-  fs_img = open(argv[2], O_RDWR|O_SYNC);
+  fs_img = open(argv[1], O_RDWR);
   if (fs_img == -1) {
     return -1;
   }
 
+  // An image with a journal is mapped privately and changed on disk only
+  // through the journal, after replaying what a crash left there. Older
+  // images are mapped shared and flushed in place.
+  static super_t sb;
+  char block[UFS_BLOCK_SIZE];
+  if (pread(fs_img, block, UFS_BLOCK_SIZE, 0) != UFS_BLOCK_SIZE) {
+    return 1;
+  }
+  ufs_super_read(block, &sb);
+  int journaled = sb.version >= UFS_VERSION_JOURNAL && sb.journal_len > 0;
+  if (journaled) {
+    if (sb.journal_len < UFS_JOURNAL_MIN_LEN) {
+      fprintf(stderr, "journal of %lld blocks is too small\n", sb.journal_len);
+      return 1;
+    }
+    int replayed = journal_replay(fs_img, &sb);
+    if (replayed < 0) {
+      perror("journal replay");
+      return 1;
+    }
+    if (replayed > 0) fprintf(stderr, "journal: replayed %d transactions\n", replayed);
+  }
+
   // Map file system img to memory
   struct stat sbuf;
   int rc = fstat(fs_img, &sbuf);
   if (rc < 0) {
     return 1;
   }
-  img = mmap(NULL, sbuf.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fs_img, 0);
+  // Only the blocks changed take memory of their own, so the private
+  // mapping reserves none up front: images may be far larger than memory.
+  img = mmap(NULL, sbuf.st_size, PROT_READ|PROT_WRITE,
+             journaled ? MAP_PRIVATE|MAP_NORESERVE : MAP_SHARED, fs_img, 0);
   if (img == MAP_FAILED) {
     return 1;
   }
 
-  // Get superblock, inode table, and bitmaps
-  s = (super_t *)img;
+  // Get superblock, inode table, and bitmaps. Replay may have changed the
+  // superblock, so it is read again.
+  ufs_super_read(img, &sb);
+  s = &sb;
+  image_seq = ufs_repl_seq(img);
   inode_table = img + (s->inode_region_addr * UFS_BLOCK_SIZE);
   inode_bitmap = img + (s->inode_bitmap_addr * UFS_BLOCK_SIZE);
   data_bitmap = img + (s->data_bitmap_addr * UFS_BLOCK_SIZE);
 
-  // Main loop
-  while (1) {
-    struct sockaddr_in addr;
-    int result;
-    message_t* message = malloc(sizeof(message_t));
-    int rc = UDP_Read(sd, &addr, (char*)message, BUFFER_SZ);
-    if (rc <= 0) continue;
-
-    // Handle message based on type
-    switch(message->mtype) {
-      case MFS_INIT:
-        break;
-      case MFS_STAT:
-        result = fs_stat(message->inum);
-        if (result == -1) {
-          message->rc = -1;
-        } else {
-          message->type = result & 1;
-          message->nbytes = result / 2;
-        }
-        rc = UDP_Write(sd, &addr, (char*)message, BUFFER_SZ);
-        break;
-      case MFS_LOOKUP:
-        result = fs_lookup(message->inum, message->name);
-        message->inum = result;
-        rc = UDP_Write(sd, &addr, (char*)message, BUFFER_SZ);
-        break;
-      case MFS_CRET:
-        result = fs_create(message->inum, message->type, message->name);
-        message->rc = result;
-        rc = UDP_Write(sd, &addr, (char*)message, BUFFER_SZ);
-        break;
-      case MFS_WRITE:
-        result = fs_write(message->inum, message->buffer, message->offset, message->nbytes);
-        message->rc = result;
-        rc = UDP_Write(sd, &addr, (char*)message, BUFFER_SZ);
-        break;
-      case MFS_READ:
-        result = fs_read(message->inum, message->buffer, message->offset, message->nbytes);
-        message->rc = result;
-        rc = UDP_Write(sd, &addr, (char*)message, BUFFER_SZ);
-        break;
-      case MFS_UNLINK:
-        result = fs_unlink(message->inum, message->name);
-        message->rc = result;
-        rc = UDP_Write(sd, &addr, (char*)message, BUFFER_SZ);
-        break;
-    case MFS_SHUTDOWN:
-        exit(0);
-        break;
-    default:
-        fprintf(stderr, "Invalid Request\n");
-        break;
-    }
-    free(message);
+  drc_init();
+  stats_init();
+  if (sharding) stats_shards(num_sockets);
+  journal_init(fs_img, img, s, flush_policy, flush_ms, flush_blocks);
+
+  // One lock per inode in the table
+  inode_locks = malloc(s->num_inodes * sizeof(pthread_rwlock_t));
+  for (int i = 0; i < s->num_inodes; i++) {
+    pthread_rwlock_init(&inode_locks[i], NULL);
+  }
+  dir_indexes = calloc(s->num_inodes, sizeof(dirindex_t*));
+  find_detached();
+  balloc_init(&inode_alloc, inode_bitmap, s->num_inodes);
+  balloc_init(&data_alloc, data_bitmap, s->data_region_len);
+  repl_start(image_seq);
+
+  pthread_t signal_thread;
+  pthread_create(&signal_thread, NULL, interrupt_handler, &signals);
+
+  // Start the workers; the main thread serves as the last one
+  pthread_t threads[MAX_WORKERS];
+  for (long i = 0; i < num_workers - 1; i++) {
+    pthread_create(&threads[i], NULL, start_worker, (void*)i);
   }
+  start_worker((void*)(long)(num_workers - 1));
   return 0;
 }
-     
\ No newline at end of file
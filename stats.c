@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+mfs_stats_t stats;
+long stats_started_us;
+
+// Names for the text form, by message type
+static const char *stats_names[MFS_STATS_OPS] = {
+    "other", "init", "lookup", "stat", "write", "read", "creat", "unlink",
+    "shutdown", "bread", "bwrite", "lookuppath", "compound", "readdir", "stats", "link",
+    "replicate",
+};
+
+long stats_now_us() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+void stats_init() {
+    stats_started_us = stats_now_us();
+}
+
+static mfs_op_stats_t *stats_op(int mtype) {
+    return &stats.ops[mtype > 0 && mtype < MFS_STATS_OPS ? mtype : 0];
+}
+
+static void stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Bucket i holds durations under 2^i us and at least 2^(i-1)
+static int stats_bucket(long us) {
+    if (us <= 0)
+	return 0;
+    int b = 64 - __builtin_clzl(us);
+    return b < MFS_STATS_BUCKETS ? b : MFS_STATS_BUCKETS - 1;
+}
+
+// Counts a handled request and the reply it got (bytes_out 0 if none)
+void stats_request(int mtype, int error, long bytes_in, long bytes_out, long handler_us) {
+    mfs_op_stats_t *op = stats_op(mtype);
+    stats_add(&op->requests, 1);
+    if (error)
+	stats_add(&op->errors, 1);
+    stats_add(&op->bytes_in, bytes_in);
+    stats_add(&op->bytes_out, bytes_out);
+    stats_add(&op->handler_us[stats_bucket(handler_us)], 1);
+}
+
+// Counts a datagram sent outside the request's own reply, such as a
+// fragment of a bulk read
+void stats_sent(int mtype, long bytes) {
+    stats_add(&stats_op(mtype)->bytes_out, bytes);
+}
+
+void stats_total(int mtype, long total_us) {
+    stats_add(&stats_op(mtype)->total_us[stats_bucket(total_us)], 1);
+}
+
+// Sets how many shards there are, for a server that has several
+void stats_shards(int n) {
+    stats.num_shards = n;
+}
+
+// Counts datagrams received by a shard
+void stats_received(int shard, long datagrams) {
+    stats_add(&stats.shard_datagrams[shard < MFS_STATS_SHARDS ? shard : MFS_STATS_SHARDS - 1], datagrams);
+}
+
+static void stats_copy(uint64_t *to, uint64_t *from, int n) {
+    for (int i = 0; i < n; i++)
+	to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+// Copies the counters; the caller fills in the gauges
+void stats_snapshot(mfs_stats_t *out) {
+    stats_copy((uint64_t *)out->ops, (uint64_t *)stats.ops, sizeof(stats.ops) / (sizeof(uint64_t)));
+    out->num_shards = stats.num_shards;
+    out->unused = 0;
+    stats_copy(out->shard_datagrams, stats.shard_datagrams, MFS_STATS_SHARDS);
+    out->uptime_ms = (stats_now_us() - stats_started_us) / 1000;
+}
+
+// Returns the duration under which fraction p of a histogram's requests
+// took, interpolating within its bucket
+static long stats_percentile(uint64_t *hist, double p) {
+    uint64_t n = 0;
+    for (int i = 0; i < MFS_STATS_BUCKETS; i++)
+	n += hist[i];
+    if (n == 0)
+	return 0;
+    double rank = p * n, seen = 0;
+    for (int i = 0; i < MFS_STATS_BUCKETS; i++) {
+	if (hist[i] > 0 && seen + hist[i] >= rank) {
+	    long lo = i == 0 ? 0 : 1L << (i - 1), hi = 1L << i;
+	    return lo + (long)((hi - lo) * (rank - seen) / hist[i]);
+	}
+	seen += hist[i];
+    }
+    return 1L << (MFS_STATS_BUCKETS - 1);
+}
+
+// Writes st as text to buffer, one line per message type seen. Returns
+// the length of the text, cut short at len - 1 bytes if need be.
+int stats_format(mfs_stats_t *st, char *buffer, int len) {
+    int n = snprintf(buffer, len, "uptime %lu ms, %d of %d inodes free, %d of %d blocks free\n"
+		     "%-10s %9s %7s %11s %11s %9s %9s %9s %9s\n",
+		     (unsigned long)st->uptime_ms, st->free_inodes, st->num_inodes, st->free_blocks,
+		     st->num_blocks, "op", "requests", "errors", "bytes in", "bytes out",
+		     "p50 us", "p99 us", "e2e p50", "e2e p99");
+    for (int i = 0; i < MFS_STATS_OPS && n < len; i++) {
+	mfs_op_stats_t *op = &st->ops[i];
+	if (op->requests == 0)
+	    continue;
+	n += snprintf(buffer + n, len - n, "%-10s %9lu %7lu %11lu %11lu %9ld %9ld %9ld %9ld\n",
+		      stats_names[i], (unsigned long)op->requests, (unsigned long)op->errors,
+		      (unsigned long)op->bytes_in, (unsigned long)op->bytes_out,
+		      stats_percentile(op->handler_us, 0.5), stats_percentile(op->handler_us, 0.99),
+		      stats_percentile(op->total_us, 0.5), stats_percentile(op->total_us, 0.99));
+    }
+
+    // Datagrams per shard, with how far the busiest is above the average
+    int shards = st->num_shards < MFS_STATS_SHARDS ? st->num_shards : MFS_STATS_SHARDS;
+    uint64_t sum = 0, max = 0;
+    for (int i = 0; i < shards; i++) {
+	sum += st->shard_datagrams[i];
+	max = st->shard_datagrams[i] > max ? st->shard_datagrams[i] : max;
+    }
+    if (shards > 0 && n < len)
+	n += snprintf(buffer + n, len - n, "shards %d, busiest %.2fx the average:", shards,
+		      sum ? (double)max * shards / sum : 0.0);
+    for (int i = 0; i < shards && n < len; i++)
+	n += snprintf(buffer + n, len - n, " %lu", (unsigned long)st->shard_datagrams[i]);
+    if (shards > 0 && n < len)
+	n += snprintf(buffer + n, len - n, "\n");
+    return n < len ? n : len - 1;
+}
@@ -0,0 +1,20 @@
+#ifndef __stats_h__
+#define __stats_h__
+
+#include "message.h"
+
+// Server counters, per message type: requests, errors, bytes and latency
+// histograms (see MFS_STATS in message.h). Every update is a relaxed
+// atomic add, so workers never wait on each other to count.
+
+void stats_init();
+long stats_now_us();
+void stats_request(int mtype, int error, long bytes_in, long bytes_out, long handler_us);
+void stats_sent(int mtype, long bytes);
+void stats_total(int mtype, long total_us);
+void stats_shards(int n);
+void stats_received(int shard, long datagrams);
+void stats_snapshot(mfs_stats_t *out);
+int stats_format(mfs_stats_t *st, char *buffer, int len);
+
+#endif // __stats_h__
@@ -1,14 +1,20 @@
+#define _GNU_SOURCE
 #include "udp.h"
+#include <linux/filter.h>
 
-// create a socket and bind it to a port on the current machine
-// used to listen for incoming packets
-int UDP_Open(int port) {
+static int udp_bind(int port, int reuse) {
     int fd;           
     if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
 	perror("socket");
 	return 0;
     }
 
+    if (reuse && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+	perror("setsockopt");
+	close(fd);
+	return -1;
+    }
+
     // set up the bind
     struct sockaddr_in my_addr;
     bzero(&my_addr, sizeof(my_addr));
@@ -26,6 +32,35 @@ int UDP_Open(int port) {
     return fd;
 }
 
+// create a socket and bind it to a port on the current machine
+// used to listen for incoming packets
+int UDP_Open(int port) {
+    return udp_bind(port, 0);
+}
+
+// like UDP_Open, but any number of sockets opened this way may share the
+// port; the kernel spreads incoming datagrams over them by flow
+int UDP_OpenShared(int port) {
+    return udp_bind(port, 1);
+}
+
+// steer each datagram to the socket of the group sharing fd's port whose
+// index (in the order the n sockets were opened) is the number of the CPU
+// receiving it, modulo n, rather than by flow
+int UDP_SteerByCPU(int fd, int n) {
+    struct sock_filter code[] = {
+	{ BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+	{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+	{ BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+	perror("setsockopt");
+	return -1;
+    }
+    return 0;
+}
+
 // fill sockaddr_in struct with proper goodies
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
     bzero(addr, sizeof(struct sockaddr_in));
@@ -48,12 +83,37 @@ int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
     return 0;
 }
 
+// size the socket's send and receive buffers to hold bursts of datagrams
+// (the kernel caps the request at net.core.[rw]mem_max)
+int UDP_SetBufferSize(int fd, int bytes) {
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) == -1 ||
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) == -1) {
+	perror("setsockopt");
+	return -1;
+    }
+    return 0;
+}
+
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     int addr_len = sizeof(struct sockaddr_in);
     int rc = sendto(fd, buffer, n, 0, (struct sockaddr *) addr, addr_len);
     return rc;
 }
 
+int UDP_WriteV(int fd, struct sockaddr_in *addr, struct iovec *iov, int n) {
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_name    = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = n;
+    int rc;
+    do {
+	rc = sendmsg(fd, &msg, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     int len = sizeof(struct sockaddr_in); 
     int rc = recvfrom(fd, buffer, n, 0, (struct sockaddr *) addr, (socklen_t *) &len);
@@ -61,6 +121,56 @@ int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     return rc;
 }
 
+// receive a batch of datagrams with one recvmmsg call
+// returns the number received (lens[] holds their sizes), or -1 on error
+int UDP_ReadBatch(int fd, struct sockaddr_in *addrs, char **buffers, int *lens, int n, int size) {
+    struct mmsghdr msgs[n];
+    struct iovec iovs[n];
+    bzero(msgs, sizeof(msgs));
+    for (int i = 0; i < n; i++) {
+	iovs[i].iov_base = buffers[i];
+	iovs[i].iov_len  = size;
+	msgs[i].msg_hdr.msg_name    = &addrs[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	msgs[i].msg_hdr.msg_iov     = &iovs[i];
+	msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+    int rc = recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+    for (int i = 0; i < rc; i++) 
+	lens[i] = msgs[i].msg_len;
+    return rc;
+}
+
+// send a batch of datagrams, with as few sendmmsg calls as the kernel allows
+// returns the number sent
+int UDP_WriteBatch(int fd, struct sockaddr_in *addrs, char **buffers, int *lens, int n) {
+    struct mmsghdr msgs[n];
+    struct iovec iovs[n];
+    bzero(msgs, sizeof(msgs));
+    for (int i = 0; i < n; i++) {
+	iovs[i].iov_base = buffers[i];
+	iovs[i].iov_len  = lens[i];
+	msgs[i].msg_hdr.msg_name    = &addrs[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	msgs[i].msg_hdr.msg_iov     = &iovs[i];
+	msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+    int sent = 0, i = 0;
+    while (i < n) {
+	int rc = sendmmsg(fd, msgs + i, n - i, 0);
+	if (rc < 0) {
+	    if (errno == EINTR) 
+		continue;
+	    // drop the datagram that failed, as if it were lost, and go on
+	    i++;
+	    continue;
+	}
+	i += rc;
+	sent += rc;
+    }
+    return sent;
+}
+
 int UDP_Close(int fd) {
     return close(fd);
 }
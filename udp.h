@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -28,11 +29,26 @@
 // 
 
 int UDP_Open(int port);
+
+// sockets sharing a port (SO_REUSEPORT), and a steering program for them
+int UDP_OpenShared(int port);
+int UDP_SteerByCPU(int fd, int n);
 int UDP_Close(int fd);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
 
+// gathered write: sends the n pieces in iov as one datagram, without
+// assembling it in user space first
+int UDP_WriteV(int fd, struct sockaddr_in *addr, struct iovec *iov, int n);
+
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
+int UDP_SetBufferSize(int fd, int bytes);
+
+// batched variants: read blocks until at least one datagram is available and
+// then drains up to n without blocking; write sends lens[i] bytes of
+// buffers[i] to addrs[i] for all n datagrams
+int UDP_ReadBatch(int fd, struct sockaddr_in *addrs, char **buffers, int *lens, int n, int size);
+int UDP_WriteBatch(int fd, struct sockaddr_in *addrs, char **buffers, int *lens, int n);
 
 #endif // __UDP_h__
@@ -0,0 +1,43 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "ufs.h"
+
+_Static_assert(offsetof(super_t, version) == offsetof(super32_t, version),
+	       "superblock formats must keep version in the same place");
+
+// Fills in *s from the superblock at block, in whichever format the image
+// was made with
+void ufs_super_read(void *block, super_t *s) {
+    super32_t *old = block;
+    if (old->version >= UFS_VERSION_WIDE) {
+	memcpy(s, block, sizeof(super_t));
+	return;
+    }
+    memset(s, 0, sizeof(super_t));
+    s->inode_bitmap_addr = old->inode_bitmap_addr;
+    s->inode_bitmap_len = old->inode_bitmap_len;
+    s->data_bitmap_addr = old->data_bitmap_addr;
+    s->data_bitmap_len = old->data_bitmap_len;
+    s->inode_region_addr = old->inode_region_addr;
+    s->inode_region_len = old->inode_region_len;
+    s->data_region_addr = old->data_region_addr;
+    s->data_region_len = old->data_region_len;
+    s->num_inodes = old->num_inodes;
+    s->num_data_blocks = old->num_data_blocks;
+    s->version = old->version;
+    if (old->version >= UFS_VERSION_JOURNAL) {
+	s->journal_addr = old->journal_addr;
+	s->journal_len = old->journal_len;
+    }
+    s->repl_seq = old->repl_seq;
+}
+
+// Returns where the superblock at block keeps repl_seq, for updates to
+// change it in place
+long long *ufs_repl_seq(void *block) {
+    super32_t *old = block;
+    if (old->version >= UFS_VERSION_WIDE)
+	return &((super_t *)block)->repl_seq;
+    return &old->repl_seq;
+}
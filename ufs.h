@@ -8,6 +8,33 @@
 
 #define DIRECT_PTRS (30)
 
+// On-disk format versions, recorded in super_t. Images made before the
+// field existed read as version 0, where every pointer in an inode is
+// direct. From version 1 the last two pointers name a single indirect and
+// a double indirect block, each holding PTRS_PER_BLOCK block addresses.
+// From version 2 the image ends with a journal region of journal_len
+// blocks (none if 0), where the server logs updates before applying them.
+// From version 3 the superblock holds block addresses and lengths in 64
+// bits (super_t); earlier images have the 32-bit super32_t, which
+// ufs_super_read converts.
+#define UFS_VERSION_DIRECT   (0)
+#define UFS_VERSION_INDIRECT (1)
+#define UFS_VERSION_JOURNAL  (2)
+#define UFS_VERSION_WIDE     (3)
+#define UFS_VERSION          (UFS_VERSION_WIDE)
+
+// Most blocks an image may have: the server numbers blocks with an int,
+// and inodes point at them with 32 bits
+#define UFS_MAX_BLOCKS (0x7fffffffLL)
+
+// Smallest journal that holds the largest single update, a bulk write
+#define UFS_JOURNAL_MIN_LEN (2048)
+
+#define NDIRECT        (DIRECT_PTRS - 2) // direct pointers from version 1
+#define INDIRECT_PTR   (DIRECT_PTRS - 2) // single indirect block
+#define DINDIRECT_PTR  (DIRECT_PTRS - 1) // double indirect block
+#define PTRS_PER_BLOCK (UFS_BLOCK_SIZE / 4)
+
 typedef struct {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
     int size;   // bytes
@@ -16,22 +43,51 @@ typedef struct {
 
 typedef struct {
     char name[28];  // up to 28 bytes of name in directory (including \0)
-    int  inum;      // inode number of entry (-1 means entry not used)
+    int  inum;      // inode number of entry (-1 means entry not used, MFS_REMOTE
+                    // set that it is on another server; see message.h)
 } dir_ent_t;
 
-// presumed: block 0 is the super block
+// presumed: block 0 is the super block. version is at the same offset in
+// every format, so it tells them apart.
 typedef struct __super {
-    int inode_bitmap_addr; // block address
-    int inode_bitmap_len;  // in blocks
-    int data_bitmap_addr;  // block address
-    int data_bitmap_len;   // in blocks
-    int inode_region_addr; // block address
-    int inode_region_len;  // in blocks
-    int data_region_addr;  // block address
-    int data_region_len;   // in blocks
-    int num_inodes;        // number of inodes 
-    int num_data_blocks;   // number of data blocks
+    long long inode_bitmap_addr; // block address
+    long long inode_bitmap_len;  // in blocks
+    long long data_bitmap_addr;  // block address
+    long long data_bitmap_len;   // in blocks
+    long long inode_region_addr; // block address
+    int version;                 // on-disk format (UFS_VERSION_*)
+    int num_inodes;              // number of inodes
+    long long inode_region_len;  // in blocks
+    long long data_region_addr;  // block address
+    long long data_region_len;   // in blocks
+    long long num_data_blocks;   // number of data blocks
+    long long journal_addr;      // block address
+    long long journal_len;       // in blocks
+    long long repl_seq;          // last replication log entry made or applied
+                                 // (see server.c), 0 if none
 } super_t;
 
+// The superblock before version 3
+typedef struct {
+    int inode_bitmap_addr;
+    int inode_bitmap_len;
+    int data_bitmap_addr;
+    int data_bitmap_len;
+    int inode_region_addr;
+    int inode_region_len;
+    int data_region_addr;
+    int data_region_len;
+    int num_inodes;
+    int num_data_blocks;
+    int version;
+    int journal_addr;      // from version 2
+    int journal_len;
+    int unused;
+    long long repl_seq;
+} super32_t;
+
+void ufs_super_read(void *block, super_t *s);
+long long *ufs_repl_seq(void *block);
+
 
 #endif // __ufs_h__
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *p, unsigned flags) {
+    memset(p, 0, sizeof(*p));
+    p->flags = flags;
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+// Sets up a ring with room for entries submissions. Completions are only
+// run when the owning thread asks for them, where the kernel allows that.
+// Returns 0, or -1 with errno set if io_uring is unavailable.
+int uring_init(uring_t *r, unsigned entries) {
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params p;
+    r->fd = uring_setup(entries, &p, IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+    if (r->fd < 0 && errno == EINVAL)
+	r->fd = uring_setup(entries, &p, 0);
+    if (r->fd < 0)
+	return -1;
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (r->cq_ring_len > r->sq_ring_len)
+	    r->sq_ring_len = r->cq_ring_len;
+	r->cq_ring_len = r->sq_ring_len;
+    }
+    r->sq_ring = mmap(0, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+		      IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+	goto fail;
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+	r->cq_ring = mmap(0, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+			  IORING_OFF_CQ_RING);
+	if (r->cq_ring == MAP_FAILED)
+	    goto fail;
+    }
+    r->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+	goto fail;
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(r->fd);
+    return -1;
+}
+
+// Returns a cleared submission entry to fill in, or null if the queue is
+// full; it goes to the kernel with the next uring_submit
+struct io_uring_sqe *uring_sqe(uring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries)
+	return 0;
+    unsigned i = r->sq_local_tail & *r->sq_mask;
+    r->sq_array[i] = i;
+    r->sq_local_tail++;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Submits what has been queued and waits for at least wait completions,
+// all with one system call. Returns what io_uring_enter does.
+int uring_submit(uring_t *r, unsigned wait) {
+    unsigned submit = r->sq_local_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    int rc;
+    do {
+	rc = syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+// Returns the oldest completion not yet seen, or null
+struct io_uring_cqe *uring_peek(uring_t *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+	return 0;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+// Consumes the completion uring_peek returned
+void uring_seen(uring_t *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Registers count buffers of size bytes as buffer group group, for
+// receives flagged IOSQE_BUFFER_SELECT. count must be a power of two.
+// Returns 0, or -1.
+int uring_provide(uring_t *r, int group, int count, int size) {
+    long ring_len = count * sizeof(struct io_uring_buf);
+    r->bufs = mmap(0, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->buf_base = malloc((long)count * size);
+    if (r->bufs == MAP_FAILED || !r->buf_base)
+	return -1;
+    r->buf_mask = count - 1;
+    r->buf_size = size;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->bufs;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	return -1;
+    for (int bid = 0; bid < count; bid++)
+	uring_recycle(r, bid);
+    return 0;
+}
+
+char *uring_buffer(uring_t *r, int bid) {
+    return r->buf_base + (long)bid * r->buf_size;
+}
+
+// Hands buffer bid back for receives to fill
+void uring_recycle(uring_t *r, int bid) {
+    struct io_uring_buf *buf = &r->bufs->bufs[r->buf_tail & r->buf_mask];
+    buf->addr = (unsigned long)uring_buffer(r, bid);
+    buf->len = r->buf_size;
+    buf->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->bufs->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,38 @@
+#ifndef __uring_h__
+#define __uring_h__
+
+#include <linux/io_uring.h>
+
+// Minimal io_uring access through the raw system calls: a submission and
+// completion queue pair, and a ring of provided buffers that receives pick
+// from (IOSQE_BUFFER_SELECT), so a multishot receive needs no buffer of its
+// own. A ring belongs to one thread.
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;       // SQEs handed out, not yet published
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    long sq_ring_len, cq_ring_len;
+    struct io_uring_buf_ring *bufs;
+    unsigned buf_mask;
+    unsigned short buf_tail;
+    char *buf_base;
+    int buf_size;
+} uring_t;
+
+int uring_init(uring_t *r, unsigned entries);
+struct io_uring_sqe *uring_sqe(uring_t *r);
+int uring_submit(uring_t *r, unsigned wait);
+struct io_uring_cqe *uring_peek(uring_t *r);
+void uring_seen(uring_t *r);
+
+int uring_provide(uring_t *r, int group, int count, int size);
+char *uring_buffer(uring_t *r, int bid);
+void uring_recycle(uring_t *r, int bid);
+
+#endif // __uring_h__